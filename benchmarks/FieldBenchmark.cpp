@@ -0,0 +1,207 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+/*
+ * Times looking up and setting the extra fields of a BibData, against the
+ * std::map with a casefolding comparator which they used to live in.
+ *
+ * Each operation prints one JSON object per line on stdout, with the time
+ * and the number of allocations made by C++ code per call:
+ *
+ *   {"operation": "find", "store": "FieldStore", "ns_per_op": 21.5, ...}
+ *
+ * The "while_loading" operations look fields up while another thread
+ * interns values as a library being loaded does. Their allocation counts
+ * include that thread's.
+ */
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <new>
+#include <vector>
+
+#include <glib.h>
+#include <glibmm/threads.h>
+#include <glibmm/ustring.h>
+
+#include "BibData.h"
+#include "CaseFoldCompare.h"
+
+
+static std::atomic<unsigned long> allocCount (0);
+
+void *operator new (size_t size)
+{
+	allocCount.fetch_add (1, std::memory_order_relaxed);
+	void *p = malloc (size ? size : 1);
+	if (!p)
+		throw std::bad_alloc ();
+	return p;
+}
+
+void operator delete (void *p) noexcept
+{
+	free (p);
+}
+
+
+/* The store extras were kept in before */
+typedef std::map <Glib::ustring, Glib::ustring, casefoldCompare> OldExtras;
+
+/* Names as they come from BibTeX files and plugins, in mixed case */
+static char const *const present[] = {
+	"url", "Publisher", "month", "ISBN", "editor", "Address", "eprint",
+	"Abstract", "keywords", "note", "Series", "edition"};
+static char const *const absent[] = {
+	"pmid", "Howpublished", "organization", "school"};
+
+
+class Timer {
+	public:
+	Timer (char const *operation, char const *store, guint const calls)
+		: operation_ (operation), store_ (store), calls_ (calls)
+	{
+		allocs_ = allocCount.load ();
+		start_ = g_get_monotonic_time ();
+	}
+
+	~Timer ()
+	{
+		gint64 const elapsed = g_get_monotonic_time () - start_;
+		std::cout
+			<< "{\"operation\": \"" << operation_ << "\""
+			<< ", \"store\": \"" << store_ << "\""
+			<< ", \"calls\": " << calls_
+			<< ", \"ns_per_op\": " << elapsed * 1000.0 / calls_
+			<< ", \"allocations_per_op\": "
+			<< double (allocCount.load () - allocs_) / calls_
+			<< "}" << std::endl;
+	}
+
+	private:
+	char const *operation_;
+	char const *store_;
+	guint calls_;
+	unsigned long allocs_;
+	gint64 start_;
+};
+
+
+/* Keeps the compiler from dropping the lookups */
+static volatile size_t sink;
+
+template <typename Store>
+static void benchmarkStore (char const *name, Store &store, guint const rounds)
+{
+	// The names are made up front, as callers mostly have them already
+	std::vector<Glib::ustring> hits (present, present + G_N_ELEMENTS (present));
+	std::vector<Glib::ustring> misses (absent, absent + G_N_ELEMENTS (absent));
+	// Looked up in a different case from the one they were set in
+	std::vector<Glib::ustring> folded;
+	for (size_t i = 0; i < hits.size (); ++i)
+		folded.push_back (hits[i].uppercase ());
+
+	{
+		Timer timer ("find", name, rounds * hits.size ());
+		for (guint round = 0; round < rounds; ++round)
+			for (size_t i = 0; i < hits.size (); ++i)
+				sink = sink + store.find (hits[i])->second.bytes ();
+	}
+
+	{
+		Timer timer ("find_other_case", name, rounds * folded.size ());
+		for (guint round = 0; round < rounds; ++round)
+			for (size_t i = 0; i < folded.size (); ++i)
+				sink = sink + store.find (folded[i])->second.bytes ();
+	}
+
+	{
+		Timer timer ("find_missing", name, rounds * misses.size ());
+		for (guint round = 0; round < rounds; ++round)
+			for (size_t i = 0; i < misses.size (); ++i)
+				sink = sink + (store.find (misses[i]) == store.end ());
+	}
+
+	{
+		Timer timer ("set", name, rounds * hits.size ());
+		for (guint round = 0; round < rounds; ++round)
+			for (size_t i = 0; i < hits.size (); ++i)
+				store[hits[i]].assign (present[(i + round) % hits.size ()]);
+	}
+}
+
+
+static std::atomic<bool> loading (false);
+
+/* Interns values the way decoding a library does, most of them new */
+static void load ()
+{
+	guint n = 0;
+	while (loading.load ()) {
+		BibData bib;
+		bib.setJournal (Glib::ustring::compose ("Journal %1", n));
+		bib.setYear (Glib::ustring::compose ("%1", n % 200));
+		bib.addExtra (Glib::ustring::compose ("key%1", n % 64), "some value");
+		++n;
+	}
+}
+
+
+template <typename Store>
+static void benchmarkWhileLoading (char const *name, Store &store, guint const rounds)
+{
+	std::vector<Glib::ustring> hits (present, present + G_N_ELEMENTS (present));
+	std::vector<Glib::ustring> folded;
+	for (size_t i = 0; i < hits.size (); ++i)
+		folded.push_back (hits[i].uppercase ());
+
+	loading = true;
+	Glib::Threads::Thread *loader = Glib::Threads::Thread::create (sigc::ptr_fun (&load));
+
+	{
+		Timer timer ("find_while_loading", name, rounds * hits.size ());
+		for (guint round = 0; round < rounds; ++round)
+			for (size_t i = 0; i < hits.size (); ++i)
+				sink = sink + store.find (hits[i])->second.bytes ();
+	}
+
+	{
+		Timer timer ("find_other_case_while_loading", name, rounds * folded.size ());
+		for (guint round = 0; round < rounds; ++round)
+			for (size_t i = 0; i < folded.size (); ++i)
+				sink = sink + store.find (folded[i])->second.bytes ();
+	}
+
+	loading = false;
+	loader->join ();
+}
+
+
+int main (int argc, char **argv)
+{
+	guint rounds = 100000;
+	if (argc > 1)
+		rounds = strtoul (argv[1], NULL, 10);
+
+	BibData bib;
+	OldExtras old;
+	for (size_t i = 0; i < G_N_ELEMENTS (present); ++i) {
+		bib.addExtra (present[i], "some value");
+		old[present[i]] = "some value";
+	}
+
+	benchmarkStore ("FieldStore", bib.extras_, rounds);
+	benchmarkStore ("std::map", old, rounds);
+	benchmarkWhileLoading ("FieldStore", bib.extras_, rounds);
+	benchmarkWhileLoading ("std::map", old, rounds);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,561 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+/*
+ * Times the library's load, save, search and export paths against
+ * synthetic reflibs.
+ *
+ * For each library size, a reflib is generated and then put through each
+ * phase in turn. Every phase prints one JSON object per line on stdout,
+ * with its wall time, the number and size of the allocations made by C++
+ * code and libxml2, the peak resident set size reached during it and the
+ * size of the string pool after it:
+ *
+ *   {"phase": "load", "documents": 1000, "compressed": true, ...}
+ *
+ * Run it from the source directory, which holds the data files documents
+ * need, or through "meson test --benchmark", which does that for you.
+ */
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib/gstdio.h>
+#include <giomm/init.h>
+#include <glibmm/convert.h>
+#include <glibmm/miscutils.h>
+#include <gtkmm/main.h>
+#include <libxml/xmlmemory.h>
+#include <libxml/xmlreader.h>
+#include <libxml/xmlwriter.h>
+
+#include "DocumentList.h"
+#include "Library.h"
+#include "LibraryCopy.h"
+#include "LibrarySnapshot.h"
+#include "StringPool.h"
+#include "TagList.h"
+
+
+/*
+ * Allocation counting. glib's allocations can't be hooked any more, so
+ * this covers operator new and libxml2, which between them make most of
+ * the allocations on these paths.
+ */
+
+static std::atomic<unsigned long> allocCount (0);
+static std::atomic<unsigned long> allocBytes (0);
+
+static inline void countAlloc (size_t const size)
+{
+	allocCount.fetch_add (1, std::memory_order_relaxed);
+	allocBytes.fetch_add (size, std::memory_order_relaxed);
+}
+
+void *operator new (size_t size)
+{
+	countAlloc (size);
+	void *p = malloc (size ? size : 1);
+	if (!p)
+		throw std::bad_alloc ();
+	return p;
+}
+
+void operator delete (void *p) noexcept
+{
+	free (p);
+}
+
+static void *xmlCountingMalloc (size_t size)
+{
+	countAlloc (size);
+	return malloc (size);
+}
+
+static void *xmlCountingRealloc (void *p, size_t size)
+{
+	countAlloc (size);
+	return realloc (p, size);
+}
+
+static char *xmlCountingStrdup (char const *str)
+{
+	countAlloc (strlen (str) + 1);
+	return strdup (str);
+}
+
+
+/*
+ * Peak RSS. Writing 5 to clear_refs resets VmHWM (Linux 4.0 and later), so
+ * each phase reports its own peak rather than the process's.
+ */
+
+static void resetPeakRss ()
+{
+	FILE *f = fopen ("/proc/self/clear_refs", "w");
+	if (f) {
+		fputs ("5", f);
+		fclose (f);
+	}
+}
+
+static long peakRssKb ()
+{
+	std::ifstream status ("/proc/self/status");
+	std::string line;
+	while (std::getline (status, line)) {
+		if (line.compare (0, 6, "VmHWM:") == 0)
+			return atol (line.c_str () + 6);
+	}
+	return -1;
+}
+
+
+/*
+ * Asks the kernel to drop a file's cached pages, so that the next read of
+ * it has to go to the disk (or the network, for a remote home directory).
+ */
+static void dropCache (std::string const &path)
+{
+	int fd = open (path.c_str (), O_RDONLY);
+	if (fd < 0)
+		return;
+	fdatasync (fd);
+	posix_fadvise (fd, 0, 0, POSIX_FADV_DONTNEED);
+	close (fd);
+}
+
+
+/*
+ * Documents copied by phases that bring documents into a library, which
+ * should build them in place or move them rather than copy them
+ */
+static unsigned long ingestCopies;
+
+
+class Phase {
+	public:
+	Phase (char const *name, guint const documents, bool const compressed, bool const ingest = false)
+		: name_ (name), documents_ (documents), compressed_ (compressed), ingest_ (ingest)
+	{
+		resetPeakRss ();
+		allocs_ = allocCount.load ();
+		bytes_ = allocBytes.load ();
+		copies_ = Document::getCopyCount ();
+		start_ = g_get_monotonic_time ();
+	}
+
+	~Phase ()
+	{
+		gint64 const elapsed = g_get_monotonic_time () - start_;
+		StringPool::Stats const pool = StringPool::getStats ();
+		unsigned long const copies = Document::getCopyCount () - copies_;
+		if (ingest_)
+			ingestCopies += copies;
+		std::cout
+			<< "{\"phase\": \"" << name_ << "\""
+			<< ", \"documents\": " << documents_
+			<< ", \"compressed\": " << (compressed_ ? "true" : "false")
+			<< ", \"wall_ms\": " << elapsed / 1000.0
+			<< ", \"allocations\": " << allocCount.load () - allocs_
+			<< ", \"allocated_bytes\": " << allocBytes.load () - bytes_
+			<< ", \"peak_rss_kb\": " << peakRssKb ()
+			<< ", \"pooled_strings\": " << pool.strings
+			<< ", \"pooled_bytes\": " << pool.bytes
+			<< ", \"pooled_folds\": " << pool.folds
+			<< ", \"pooled_fold_bytes\": " << pool.foldBytes
+			<< ", \"document_copies\": " << copies
+			<< "}" << std::endl;
+	}
+
+	private:
+	char const *name_;
+	guint documents_;
+	bool compressed_;
+	bool ingest_;
+	unsigned long allocs_;
+	unsigned long bytes_;
+	unsigned long copies_;
+	gint64 start_;
+};
+
+
+/*
+ * Synthetic libraries. The mix of fields loosely follows real libraries:
+ * every document has the core fields, most have an abstract and keywords,
+ * some have notes, and text is sprinkled with non-ASCII words.
+ */
+
+static char const *const words[] = {
+	"quantum", "field", "theory", "lattice", "spin", "model", "analysis",
+	"network", "dynamics", "protein", "folding", "stochastic", "process",
+	"entropy", "bayesian", "inference", "neural", "graph", "optimal",
+	"transport", "naïve", "Schrödinger", "Ångström", "Poincaré", "Gödel",
+	"Дирак", "量子", "κβαντικός", "état", "größe"};
+
+static char const *const surnames[] = {
+	"Smith", "Müller", "García", "Nakamura", "Ivanov", "O'Brien", "Zhang",
+	"Kowalski", "Ødegaard", "Dubois", "Rossi", "Novák", "Silva", "Kim"};
+
+static char const *const journals[] = {
+	"Physical Review Letters", "Nature", "Journal of Chemical Physics",
+	"Annalen der Physik", "Bioinformatics", "Communications of the ACM"};
+
+static char const *const extraKeys[] = {
+	"url", "publisher", "month", "isbn", "editor", "address", "eprint"};
+
+static guint const tagCount = 50;
+
+#define N_WORDS G_N_ELEMENTS (words)
+#define PICK(rand, array) array[g_rand_int_range (rand, 0, G_N_ELEMENTS (array))]
+
+static std::string sentence (GRand *rand, int const length)
+{
+	std::string text;
+	for (int i = 0; i < length; ++i) {
+		if (i)
+			text += ' ';
+		text += words[g_rand_int_range (rand, 0, N_WORDS)];
+	}
+	return text;
+}
+
+static void writeElement (xmlTextWriterPtr writer, char const *name, std::string const &text)
+{
+	xmlTextWriterWriteElement (writer, BAD_CAST name, BAD_CAST text.c_str ());
+}
+
+static void generateLibrary (std::string const &path, guint const documents, guint32 const seed)
+{
+	GRand *rand = g_rand_new_with_seed (seed);
+
+	xmlTextWriterPtr writer = xmlNewTextWriterFilename (path.c_str (), 0);
+	xmlTextWriterSetIndent (writer, true);
+	xmlTextWriterSetIndentString (writer, BAD_CAST "\t");
+	xmlTextWriterStartDocument (writer, NULL, "UTF-8", NULL);
+	xmlTextWriterStartElement (writer, BAD_CAST LIB_ELEMENT_LIBRARY);
+
+	xmlTextWriterStartElement (writer, BAD_CAST LIB_ELEMENT_TAGLIST);
+	for (guint i = 0; i < tagCount; ++i) {
+		xmlTextWriterStartElement (writer, BAD_CAST LIB_ELEMENT_TAG);
+		writeElement (writer, LIB_ELEMENT_TAG_UID, std::to_string (i));
+		writeElement (writer, LIB_ELEMENT_TAG_NAME, sentence (rand, 1) + " " + std::to_string (i));
+		xmlTextWriterEndElement (writer);
+	}
+	xmlTextWriterEndElement (writer);
+
+	xmlTextWriterStartElement (writer, BAD_CAST LIB_ELEMENT_DOCLIST);
+	for (guint i = 0; i < documents; ++i) {
+		std::string const surname = PICK (rand, surnames);
+		std::string const year = std::to_string (g_rand_int_range (rand, 1950, 2025));
+		std::string const key = surname + year + "-" + std::to_string (i);
+
+		xmlTextWriterStartElement (writer, BAD_CAST LIB_ELEMENT_DOC);
+		writeElement (writer, LIB_ELEMENT_DOC_FILENAME, "file:///home/user/papers/" + key + ".pdf");
+		writeElement (writer, LIB_ELEMENT_DOC_REL_FILENAME, "papers/" + key + ".pdf");
+		writeElement (writer, LIB_ELEMENT_DOC_KEY, key);
+		writeElement (writer, LIB_ELEMENT_DOC_NOTES,
+			g_rand_int_range (rand, 0, 5) == 0 ? sentence (rand, g_rand_int_range (rand, 5, 200)) : "");
+
+		int const tags = g_rand_int_range (rand, 0, 5);
+		for (int t = 0; t < tags; ++t)
+			writeElement (writer, LIB_ELEMENT_DOC_TAG, std::to_string (g_rand_int_range (rand, 0, tagCount)));
+
+		std::string authors = surname + ", A.";
+		int const coauthors = g_rand_int_range (rand, 0, 6);
+		for (int a = 0; a < coauthors; ++a)
+			authors += std::string (" and ") + PICK (rand, surnames) + ", B.";
+
+		writeElement (writer, LIB_ELEMENT_DOC_BIB_TYPE, "article");
+		writeElement (writer, LIB_ELEMENT_DOC_BIB_DOI, "10.1000/bench." + std::to_string (i));
+		writeElement (writer, LIB_ELEMENT_DOC_BIB_TITLE, sentence (rand, g_rand_int_range (rand, 4, 16)));
+		writeElement (writer, LIB_ELEMENT_DOC_BIB_AUTHORS, authors);
+		writeElement (writer, LIB_ELEMENT_DOC_BIB_JOURNAL, PICK (rand, journals));
+		writeElement (writer, LIB_ELEMENT_DOC_BIB_VOLUME, std::to_string (g_rand_int_range (rand, 1, 120)));
+		writeElement (writer, LIB_ELEMENT_DOC_BIB_NUMBER, std::to_string (g_rand_int_range (rand, 1, 12)));
+		writeElement (writer, LIB_ELEMENT_DOC_BIB_PAGES, "1-" + std::to_string (g_rand_int_range (rand, 2, 40)));
+		writeElement (writer, LIB_ELEMENT_DOC_BIB_YEAR, year);
+
+		std::vector<std::pair<std::string, std::string> > extras;
+		if (g_rand_int_range (rand, 0, 10) < 8)
+			extras.push_back (std::make_pair ("abstract", sentence (rand, g_rand_int_range (rand, 50, 300))));
+		if (g_rand_int_range (rand, 0, 10) < 6)
+			extras.push_back (std::make_pair ("keywords", sentence (rand, g_rand_int_range (rand, 2, 8))));
+		int const others = g_rand_int_range (rand, 0, G_N_ELEMENTS (extraKeys));
+		for (int e = 0; e < others; ++e)
+			extras.push_back (std::make_pair (extraKeys[e], sentence (rand, 3)));
+		for (size_t e = 0; e < extras.size (); ++e) {
+			xmlTextWriterStartElement (writer, BAD_CAST LIB_ELEMENT_DOC_BIB_EXTRA);
+			xmlTextWriterWriteAttribute (writer, BAD_CAST LIB_ELEMENT_DOC_BIB_EXTRA_KEY, BAD_CAST extras[e].first.c_str ());
+			xmlTextWriterWriteString (writer, BAD_CAST extras[e].second.c_str ());
+			xmlTextWriterEndElement (writer);
+		}
+
+		xmlTextWriterEndElement (writer);
+	}
+	xmlTextWriterEndElement (writer);
+
+	xmlTextWriterEndElement (writer);
+	xmlTextWriterEndDocument (writer);
+	xmlFreeTextWriter (writer);
+
+	g_rand_free (rand);
+}
+
+
+/* Keeps the compiler from dropping work whose result isn't used */
+static volatile size_t sink;
+
+
+static void benchmarkLibrary (std::string const &dir, guint const documents, guint32 const seed, bool const cold)
+{
+	std::string const sourcePath = Glib::build_filename (dir, "generated.reflib");
+	generateLibrary (sourcePath, documents, seed);
+
+	// Parsing alone, from a buffer, without any I/O
+	LibraryData *data;
+	{
+		gchar *contents;
+		gsize length;
+		if (!g_file_get_contents (sourcePath.c_str (), &contents, &length, NULL))
+			throw Glib::FileError (Glib::FileError::FAILED, "Couldn't read " + sourcePath);
+
+		Phase phase ("extract", documents, false, true);
+		xmlTextReaderPtr reader = xmlReaderForMemory (contents, length, NULL, NULL, 0);
+		data = new LibraryData ();
+		data->extractData (reader);
+		xmlFreeTextReader (reader);
+		g_free (contents);
+	}
+
+	bool const compressions[] = {false, true};
+	for (size_t c = 0; c < G_N_ELEMENTS (compressions); ++c) {
+		bool const compressed = compressions[c];
+		std::string const path = Glib::build_filename (
+			dir, compressed ? "compressed.reflib" : "plain.reflib");
+		Glib::ustring const uri = Glib::filename_to_uri (path);
+
+		{
+			Phase phase ("save", documents, compressed);
+			Library::writeReflib (uri, *data, compressed);
+		}
+
+		if (cold)
+			dropCache (path);
+		LibraryData *loaded;
+		{
+			Phase phase ("load", documents, compressed, true);
+			loaded = Library::readReflib (uri);
+		}
+		delete loaded;
+
+		{
+			Phase phase ("snapshot-write", documents, compressed);
+			LibrarySnapshot (uri).write (*data);
+		}
+
+		{
+			LibraryData snapshotData;
+			Phase phase ("snapshot-read", documents, compressed, true);
+			LibrarySnapshot (uri).read (snapshotData);
+		}
+	}
+
+	{
+		// What a background save copies on the main thread before it
+		// starts: the first time, one document_copy per document is
+		// expected, then only the edited ones are copied again
+		LibraryCopy copy;
+		{
+			Phase phase ("save-copy", documents, false);
+			copy.update (*data);
+		}
+
+		DocumentList::Container &container = data->doclist_->getDocs ();
+		DocumentList::Container::iterator it = container.begin ();
+		for (size_t i = 0; it != container.end (); ++it, ++i) {
+			if (i % 100 == 0)
+				it->setNotes ("Edited between saves");
+		}
+		{
+			Phase phase ("save-copy-edited", documents, false);
+			copy.update (*data);
+		}
+	}
+
+	{
+		std::vector<Document*> docs;
+		DocumentList::Container &container = data->doclist_->getDocs ();
+		DocumentList::Container::iterator it = container.begin ();
+		for (; it != container.end (); ++it)
+			docs.push_back (&(*it));
+
+		{
+			// A few keystrokes' worth of searching, over packed documents
+			char const *const terms[] = {"q", "qu", "quantum", "gödel", "no such text"};
+			Phase phase ("search", documents, false);
+			size_t matches = 0;
+			for (size_t t = 0; t < G_N_ELEMENTS (terms); ++t)
+				for (size_t d = 0; d < docs.size (); ++d)
+					matches += docs[d]->matchesSearch (terms[t]);
+			sink = matches;
+		}
+
+		{
+			// The same keystrokes through the list's index, which is built
+			// by the first of them
+			char const *const terms[] = {"q", "qu", "quantum", "gödel", "no such text"};
+			Phase phase ("search-index", documents, false);
+			size_t matches = 0;
+			for (size_t t = 0; t < G_N_ELEMENTS (terms); ++t)
+				matches += data->doclist_->search (terms[t]).size ();
+			sink = matches;
+		}
+
+		{
+			// Typing a word a letter at a time, each search narrowing down
+			// what the one before found
+			char const *const typed[] = {"q", "qu", "qua", "quan", "quant", "quantum"};
+			Phase phase ("search-narrowing", documents, false);
+			std::vector<Document*> found = data->doclist_->search (typed[0]);
+			for (size_t t = 1; t < G_N_ELEMENTS (typed); ++t)
+				found = data->doclist_->search (typed[t], found);
+			sink = found.size ();
+		}
+
+		{
+			// The keystrokes again, a document at a time, scanning the
+			// casefolded text the index keeps rather than casefolding
+			char const *const terms[] = {"q", "qu", "quantum", "gödel", "no such text"};
+			Phase phase ("search-text", documents, false);
+			size_t matches = 0;
+			for (size_t t = 0; t < G_N_ELEMENTS (terms); ++t)
+				for (size_t d = 0; d < docs.size (); ++d)
+					matches += data->doclist_->matchesSearch (docs[d], terms[t]);
+			sink = matches;
+		}
+
+		Phase phase ("bibtex", documents, false);
+		Library::writeBibtexFile (
+			Glib::filename_to_uri (Glib::build_filename (dir, "library.bib")),
+			docs, *data->taglist_, true, false);
+	}
+
+	{
+		// Importing the export back, through BibUtils and insertDocs()
+		std::string const bibPath = Glib::build_filename (dir, "library.bib");
+		gchar *contents;
+		if (!g_file_get_contents (bibPath.c_str (), &contents, NULL, NULL))
+			throw Glib::FileError (Glib::FileError::FAILED, "Couldn't read " + bibPath);
+		Glib::ustring const bibtex (contents);
+		g_free (contents);
+
+		DocumentList imported;
+		Phase phase ("import", documents, false, true);
+		imported.import (bibtex, BibUtils::FORMAT_BIBTEX);
+	}
+
+	delete data;
+}
+
+
+int main (int argc, char **argv)
+{
+	// Has to come before anything else in libxml2 allocates
+	xmlMemSetup (free, xmlCountingMalloc, xmlCountingRealloc, xmlCountingStrdup);
+	xmlInitParser ();
+
+	gchar *sizes = NULL;
+	gchar *dir = NULL;
+	gint seed = 1;
+	gboolean cold = FALSE;
+	gboolean keep = FALSE;
+	GOptionEntry const entries[] = {
+		{"sizes", 's', 0, G_OPTION_ARG_STRING, &sizes,
+			"Comma separated library sizes, in documents (default 1000,10000,100000)", "N,..."},
+		{"dir", 'd', 0, G_OPTION_ARG_FILENAME, &dir,
+			"Directory to write libraries in (default a new temporary one)", "DIR"},
+		{"seed", 0, 0, G_OPTION_ARG_INT, &seed, "Seed for the library generator", "SEED"},
+		{"cold", 'c', 0, G_OPTION_ARG_NONE, &cold,
+			"Drop each library from the page cache before loading it", NULL},
+		{"keep", 'k', 0, G_OPTION_ARG_NONE, &keep, "Keep the generated files", NULL},
+		{NULL}
+	};
+
+	GOptionContext *context = g_option_context_new ("- benchmark library loading and saving");
+	g_option_context_add_main_entries (context, entries, NULL);
+	GError *error = NULL;
+	if (!g_option_context_parse (context, &argc, &argv, &error)) {
+		std::cerr << error->message << std::endl;
+		return EXIT_FAILURE;
+	}
+	g_option_context_free (context);
+
+	// The wrappers have to be set up, but no display is needed
+	Gio::init ();
+	Gtk::Main::init_gtkmm_internals ();
+
+	std::string workdir;
+	if (dir) {
+		workdir = dir;
+	} else {
+		gchar *tmp = g_dir_make_tmp ("referencer-bench-XXXXXX", NULL);
+		if (!tmp) {
+			std::cerr << "Couldn't create a temporary directory" << std::endl;
+			return EXIT_FAILURE;
+		}
+		workdir = tmp;
+		g_free (tmp);
+	}
+
+	std::vector<guint> documentCounts;
+	std::istringstream sizeList (sizes ? sizes : "1000,10000,100000");
+	std::string size;
+	while (std::getline (sizeList, size, ','))
+		documentCounts.push_back (strtoul (size.c_str (), NULL, 10));
+
+	int status = EXIT_SUCCESS;
+	try {
+		for (size_t i = 0; i < documentCounts.size (); ++i)
+			benchmarkLibrary (workdir, documentCounts[i], seed, cold);
+	} catch (Glib::Exception const &ex) {
+		std::cerr << ex.what () << std::endl;
+		status = EXIT_FAILURE;
+	}
+
+	if (ingestCopies) {
+		std::cerr << "Loading and importing copied " << ingestCopies << " documents" << std::endl;
+		status = EXIT_FAILURE;
+	}
+
+	if (!keep) {
+		char const *const files[] = {
+			"generated.reflib", "plain.reflib", "compressed.reflib",
+			".plain.reflib.snapshot", ".compressed.reflib.snapshot", "library.bib"};
+		for (size_t i = 0; i < G_N_ELEMENTS (files); ++i)
+			g_unlink (Glib::build_filename (workdir, files[i]).c_str ());
+		if (!dir)
+			g_rmdir (workdir.c_str ());
+	}
+
+	g_free (sizes);
+	g_free (dir);
+
+	return status;
+}
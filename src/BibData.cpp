@@ -9,6 +9,7 @@
  */
 
 
+#include <cstring>
 #include <iostream>
 
 #include <time.h>
@@ -49,16 +50,16 @@ void BibData::print () const
 	DEBUG ("%1: %2\n", "DOI: ", doi_);
 	DEBUG ("%1: %2\n", "Title: ", title_);
 	DEBUG ("%1: %2\n", "Authors: ", authors_);
-	DEBUG ("%1: %2\n", "Journal: ", journal_);
+	DEBUG ("%1: %2\n", "Journal: ", journal_.str ());
 	DEBUG ("%1: %2\n", "Volume: ", volume_);
 	DEBUG ("%1: %2\n", "Number: ", issue_);
 	DEBUG ("%1: %2\n", "Pages: ", pages_);
-	DEBUG ("%1: %2\n", "Year: ", year_);
+	DEBUG ("%1: %2\n", "Year: ", year_.str ());
 	
 	ExtrasMap::const_iterator it = extras_.begin ();
 	ExtrasMap::const_iterator const end = extras_.end ();
 	for (; it != end; ++it) {
-		DEBUG ("%1: %2\n", it->first, it->second);
+		DEBUG ("%1: %2\n", it->first.str (), it->second);
 	}
 }
 
@@ -74,6 +75,7 @@ void BibData::clear ()
 	title_ = "";
 	year_ = "";
 	extras_.clear ();
+	changes_.touch (CHANGED_BIBDATA & ~CHANGED_TYPE);
 }
 
 
@@ -89,17 +91,134 @@ void BibData::addExtra (Glib::ustring const &key, Glib::ustring const &value)
 			std::string("Invalid UTF-8 in value in ") + std::string(__FUNCTION__)));
 	}
 
-	if ( key == "Keywords" && !extras_[key].empty() ) {
-		extras_[key] = extras_[key] + "; " + value;
+	Glib::ustring &extra = extras_[key];
+	if ( key == "Keywords" && !extra.empty() ) {
+		extra += "; " + value;
 	} else {
-		extras_[key] = value;
+		extra = value;
 	}
+	changes_.touch (CHANGED_EXTRAS);
+}
+
+
+/*
+ * The field names differ in length or first letter, so those two pick
+ * the one candidate, and a single comparison settles it.
+ */
+FieldId BibData::fieldId (char const *name)
+{
+	FieldId candidate = FIELD_EXTRA;
+	switch (strlen (name)) {
+		case 3:
+			switch (g_ascii_tolower (name[0])) {
+				case 'd': candidate = FIELD_DOI; break;
+				case 'k': candidate = FIELD_KEY; break;
+			}
+			break;
+		case 4:
+			candidate = FIELD_YEAR;
+			break;
+		case 5:
+			switch (g_ascii_tolower (name[0])) {
+				case 't': candidate = FIELD_TITLE; break;
+				case 'p': candidate = FIELD_PAGES; break;
+			}
+			break;
+		case 6:
+			switch (g_ascii_tolower (name[0])) {
+				case 'a': candidate = FIELD_AUTHOR; break;
+				case 'v': candidate = FIELD_VOLUME; break;
+				case 'n': candidate = FIELD_NUMBER; break;
+			}
+			break;
+		case 7:
+			candidate = FIELD_JOURNAL;
+			break;
+	}
+
+	if (candidate != FIELD_EXTRA && g_ascii_strcasecmp (name, fieldName (candidate)) == 0)
+		return candidate;
+	return FIELD_EXTRA;
+}
+
+
+char const *BibData::fieldName (FieldId id)
+{
+	static char const *const names[] = {
+		"doi", "title", "volume", "number", "journal", "author", "year",
+		"pages", "key"};
+
+	return size_t (id) < G_N_ELEMENTS (names) ? names[id] : "";
+}
+
+
+Glib::ustring const &BibData::getField (FieldId id) const
+{
+	switch (id) {
+		case FIELD_DOI: return doi_;
+		case FIELD_TITLE: return title_;
+		case FIELD_VOLUME: return volume_;
+		case FIELD_NUMBER: return issue_;
+		case FIELD_JOURNAL: return journal_;
+		case FIELD_AUTHOR: return authors_;
+		case FIELD_YEAR: return year_;
+		case FIELD_PAGES: return pages_;
+		default: break;
+	}
+
+	DEBUG ("BibData::getField: Warning: %1 is not a core field", id);
+	return *StringPool::empty ();
+}
+
+
+void BibData::setField (FieldId id, Glib::ustring const &value)
+{
+	switch (id) {
+		case FIELD_DOI: doi_ = value; break;
+		case FIELD_TITLE: title_ = value; break;
+		case FIELD_VOLUME: volume_ = value; break;
+		case FIELD_NUMBER: issue_ = value; break;
+		case FIELD_JOURNAL: journal_ = value; break;
+		case FIELD_AUTHOR: authors_ = value; break;
+		case FIELD_YEAR: year_ = value; break;
+		case FIELD_PAGES: pages_ = value; break;
+		default:
+			DEBUG ("BibData::setField: Warning: %1 is not a core field", id);
+			return;
+	}
+	changes_.touch (1 << id);
+}
+
+
+bool BibData::forEachField (FieldVisitor &visitor) const
+{
+	for (int id = FIELD_DOI; id <= FIELD_PAGES; ++id) {
+		Glib::ustring const &value = getField (FieldId (id));
+		if (!value.empty () && !visitor.visit (fieldName (FieldId (id)), value.c_str ()))
+			return false;
+	}
+
+	return forEachExtra (visitor);
+}
+
+
+bool BibData::forEachExtra (FieldVisitor &visitor) const
+{
+	ExtrasMap::const_iterator it = extras_.begin ();
+	ExtrasMap::const_iterator const end = extras_.end ();
+	for (; it != end; ++it) {
+		if (!visitor.visit (it->first.c_str (), it->second.c_str ()))
+			return false;
+	}
+
+	return true;
 }
 
 
 void BibData::clearExtras ()
 {
 	extras_.clear ();
+	changes_.touch (CHANGED_EXTRAS);
 }
 
 void BibData::writeXML (xmlTextWriterPtr writer)
@@ -267,29 +386,29 @@ void BibData::guessArxiv (Glib::ustring const &raw_)
  */
 void BibData::mergeIn (BibData const &source)
 {
-	type_ = source.getType ();
+	setType (source.getType ());
 	if (!source.getDoi ().empty ())
-		doi_ = source.getDoi ();
+		setDoi (source.getDoi ());
 	if (!source.getVolume().empty ())
-		volume_ = source.getVolume ();
+		setVolume (source.getVolume ());
 	if (!source.getIssue().empty ())
-		issue_ = source.getIssue ();
+		setIssue (source.getIssue ());
 	if (!source.getPages().empty ())
-		pages_ = source.getPages ();
+		setPages (source.getPages ());
 	if (!source.getAuthors().empty ())
-		authors_ = source.getAuthors ();
+		setAuthors (source.getAuthors ());
 	if (!source.getJournal().empty ())
-		journal_ = source.getJournal ();
+		setJournal (source.getJournal ());
 	if (!source.getTitle().empty ())
-		title_ = source.getTitle ();
+		setTitle (source.getTitle ());
 	if (!source.getYear().empty ())
-		year_ = source.getYear ();
+		setYear (source.getYear ());
 		
-	ExtrasMap sourceextras = source.getExtras();
-	ExtrasMap::iterator it = sourceextras.begin ();
-	ExtrasMap::iterator const end = sourceextras.end ();
+	ExtrasMap::const_iterator it = source.extras_.begin ();
+	ExtrasMap::const_iterator const end = source.extras_.end ();
 	for (; it != end; ++it) {
-		if (extras_[it->first].empty()) {
+		ExtrasMap::const_iterator const mine = extras_.find (it->first);
+		if (mine == extras_.end () || mine->second.empty ()) {
 			addExtra (it->first, it->second);
 		}
 	}
@@ -21,18 +21,68 @@
 #include <libxml/xmlwriter.h>
 
 #include "CaseFoldCompare.h"
+#include "ChangeStamp.h"
+#include "FieldStore.h"
+#include "StringPool.h"
+
+/**
+ * The fields documents keep in members of their own, rather than among the
+ * extras. Everything else is FIELD_EXTRA.
+ */
+enum FieldId {
+	FIELD_DOI,
+	FIELD_TITLE,
+	FIELD_VOLUME,
+	FIELD_NUMBER,
+	FIELD_JOURNAL,
+	FIELD_AUTHOR,
+	FIELD_YEAR,
+	FIELD_PAGES,
+	/* The document's key, which isn't part of its BibData */
+	FIELD_KEY,
+	FIELD_EXTRA
+};
+
+/**
+ * Bits of a document's change mask, as kept by \ref ChangeStamp. Each core
+ * field, and the key, is 1 << its FieldId.
+ */
+enum {
+	CHANGED_EXTRAS = 1 << FIELD_EXTRA,
+	CHANGED_TYPE = 1 << (FIELD_EXTRA + 1),
+	CHANGED_TAGS = 1 << (FIELD_EXTRA + 2),
+	CHANGED_NOTES = 1 << (FIELD_EXTRA + 3),
+	CHANGED_FILENAME = 1 << (FIELD_EXTRA + 4),
+	CHANGED_BIBDATA = ((1 << FIELD_KEY) - 1) | CHANGED_EXTRAS | CHANGED_TYPE,
+	CHANGED_ALL = CHANGED_BIBDATA | (1 << FIELD_KEY) | CHANGED_TAGS | CHANGED_NOTES | CHANGED_FILENAME
+};
+
+/**
+ * Shown each field of a \ref BibData or a \ref Document in turn, where it
+ * is stored, rather than copying them all out first. The strings are only
+ * good until the call returns.
+ */
+class FieldVisitor {
+	public:
+	virtual ~FieldVisitor () {}
+	/**
+	 * @return false to stop at this field.
+	 */
+	virtual bool visit (char const *name, char const *value) = 0;
+};
 
 class BibData {
 	private:
-	Glib::ustring type_;
+	InternedString type_;
 	Glib::ustring doi_;
 	Glib::ustring volume_;
 	Glib::ustring issue_;
 	Glib::ustring pages_;
 	Glib::ustring authors_;
-	Glib::ustring journal_;
+	InternedString journal_;
 	Glib::ustring title_;
-	Glib::ustring year_;
+	InternedString year_;
+	ChangeStamp changes_;
 
 	static std::vector<Glib::ustring> document_types;
 	static Glib::ustring default_document_type;
@@ -48,31 +98,68 @@ class BibData {
 
 	void mergeIn (BibData const &source);
 
-	typedef std::map <Glib::ustring, Glib::ustring, casefoldCompare> ExtrasMap;
+	/* Keys are case-insensitive, and come from a small set of names */
+	typedef FieldStore ExtrasMap;
 	ExtrasMap extras_;
 	void addExtra (Glib::ustring const &key, Glib::ustring const &value);
 	void clearExtras ();
-	ExtrasMap getExtras () const {return extras_;}
+	ExtrasMap const &getExtras () const {return extras_;}
 	bool hasExtras () {return !extras_.empty();}
 
-	void setDoi (Glib::ustring const &doi) {doi_ = doi;}
-	Glib::ustring getDoi () const {return doi_;}
-	void setType (Glib::ustring const &type) {type_ = type;}
-	Glib::ustring getType () const {return type_;} 
-	void setTitle (Glib::ustring const &title) {title_ = title;}
-	Glib::ustring getTitle () const {return title_;}
-	void setVolume (Glib::ustring const &vol) {volume_ = vol;}
-	Glib::ustring getVolume () const {return volume_;}
-	void setIssue (Glib::ustring const &issue) {issue_ = issue;}
-	Glib::ustring getIssue () const {return issue_;}
-	void setPages (Glib::ustring const &pages) {pages_ = pages;}
-	Glib::ustring getPages () const {return pages_;}
-	void setAuthors (Glib::ustring const &authors) {authors_ = authors;}
-	Glib::ustring getAuthors () const {return authors_;}
-	void setJournal (Glib::ustring const &journal) {journal_ = journal;}
-	Glib::ustring getJournal () const {return journal_;}
-	void setYear (Glib::ustring const &year) {year_ = year;}
-	Glib::ustring getYear () const {return year_;}
+	/**
+	 * @return which field a name means, ignoring case, for the names
+	 * Document::getField() takes.
+	 */
+	static FieldId fieldId (char const *name);
+	static FieldId fieldId (Glib::ustring const &name) {return fieldId (name.c_str ());}
+	/**
+	 * @return the name of a field other than FIELD_EXTRA, in lower case.
+	 */
+	static char const *fieldName (FieldId id);
+
+	/**
+	 * The value of one of the core fields, FIELD_DOI to FIELD_PAGES.
+	 */
+	Glib::ustring const &getField (FieldId id) const;
+	void setField (FieldId id, Glib::ustring const &value);
+
+	/**
+	 * Shows the visitor the non-empty core fields, under the names
+	 * Document::getField() knows them by, then the extras.
+	 *
+	 * @return false if the visitor stopped early.
+	 */
+	bool forEachField (FieldVisitor &visitor) const;
+	/**
+	 * @return false if the visitor stopped early.
+	 */
+	bool forEachExtra (FieldVisitor &visitor) const;
+
+	/**
+	 * When the fields last changed, and which, for \ref Document's own
+	 * change tracking. Changes made to extras_ directly aren't seen.
+	 */
+	ChangeStamp const &getChangeStamp () const {return changes_;}
+	void clearChanges () {changes_.clear ();}
+
+	void setDoi (Glib::ustring const &doi) {doi_ = doi; changes_.touch (1 << FIELD_DOI);}
+	Glib::ustring const &getDoi () const {return doi_;}
+	void setType (Glib::ustring const &type) {type_ = type; changes_.touch (CHANGED_TYPE);}
+	Glib::ustring const &getType () const {return type_;} 
+	void setTitle (Glib::ustring const &title) {title_ = title; changes_.touch (1 << FIELD_TITLE);}
+	Glib::ustring const &getTitle () const {return title_;}
+	void setVolume (Glib::ustring const &vol) {volume_ = vol; changes_.touch (1 << FIELD_VOLUME);}
+	Glib::ustring const &getVolume () const {return volume_;}
+	void setIssue (Glib::ustring const &issue) {issue_ = issue; changes_.touch (1 << FIELD_NUMBER);}
+	Glib::ustring const &getIssue () const {return issue_;}
+	void setPages (Glib::ustring const &pages) {pages_ = pages; changes_.touch (1 << FIELD_PAGES);}
+	Glib::ustring const &getPages () const {return pages_;}
+	void setAuthors (Glib::ustring const &authors) {authors_ = authors; changes_.touch (1 << FIELD_AUTHOR);}
+	Glib::ustring const &getAuthors () const {return authors_;}
+	void setJournal (Glib::ustring const &journal) {journal_ = journal; changes_.touch (1 << FIELD_JOURNAL);}
+	Glib::ustring const &getJournal () const {return journal_;}
+	void setYear (Glib::ustring const &year) {year_ = year; changes_.touch (1 << FIELD_YEAR);}
+	Glib::ustring const &getYear () const {return year_;}
 
 	void guessJournal (Glib::ustring const &raw);
 	void guessVolumeNumberPage (Glib::ustring const &raw);
@@ -0,0 +1,33 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#include <atomic>
+
+#include "ChangeStamp.h"
+
+
+namespace {
+
+std::atomic<guint64> revisions (0);
+
+}
+
+
+guint64 ChangeStamp::current ()
+{
+	return revisions.load (std::memory_order_relaxed);
+}
+
+
+guint64 ChangeStamp::next ()
+{
+	return revisions.fetch_add (1, std::memory_order_relaxed) + 1;
+}
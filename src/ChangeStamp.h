@@ -0,0 +1,50 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#ifndef CHANGESTAMP_H
+#define CHANGESTAMP_H
+
+#include <glib.h>
+
+/**
+ * <p>What changed in something, and when: a mask of the parts which changed
+ * since \ref clear() was last called, and the revision of the latest
+ * change.</p>
+ *
+ * <p>Revisions come from a single counter shared by every stamp, so no two
+ * changes get the same one, and a revision later than the one somebody
+ * last saw means that something changed since. Copies carry the revision
+ * of what they were copied from.</p>
+ */
+class ChangeStamp {
+	public:
+	ChangeStamp () : revision_ (next ()), changes_ (0) {}
+
+	guint64 getRevision () const {return revision_;}
+	guint32 getChanges () const {return changes_;}
+
+	void touch (guint32 const parts) {changes_ |= parts; revision_ = next ();}
+	void clear () {changes_ = 0;}
+
+	/**
+	 * @return the latest revision handed out so far, by any stamp.
+	 */
+	static guint64 current ();
+
+	private:
+	/* Safe from any thread: documents are made on loader threads */
+	static guint64 next ();
+
+	guint64 revision_;
+	guint32 changes_;
+};
+
+#endif
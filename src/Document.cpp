@@ -7,6 +7,7 @@
  *
  */
 
+#include <cstring>
 #include <iostream>
 #include <sstream>
 
@@ -18,10 +19,12 @@
 #include "config.h"
 
 #include "BibUtils.h"
+#include "DocumentList.h"
 #include "DocumentView.h"
 #include "Library.h"
 #include "PluginManager.h"
 #include "Preferences.h"
+#include "SearchIndex.h"
 #include "TagList.h"
 #include "ThumbnailGenerator.h"
 #include "Utility.h"
@@ -30,6 +33,56 @@
 #include "Library.h"
 
 const Glib::ustring Document::defaultKey_ = _("Unnamed");
+
+/*
+ * A packed payload is a run of entries, each a type byte followed by the
+ * extra field's key, if it is one, and the value, all NUL terminated. XML
+ * text can't contain NULs, so nothing needs escaping.
+ */
+#define PAYLOAD_NOTES 'n'
+#define PAYLOAD_EXTRA 'x'
+
+namespace {
+
+class PayloadReader {
+	public:
+	PayloadReader (std::string const &payload)
+		: pos_ (payload.c_str ()), end_ (payload.c_str () + payload.size ()) {}
+
+	bool next (char &type, char const *&key, char const *&value)
+	{
+		if (pos_ >= end_)
+			return false;
+
+		type = *pos_++;
+		key = NULL;
+		if (type == PAYLOAD_EXTRA) {
+			key = pos_;
+			pos_ += strlen (pos_) + 1;
+		}
+		value = pos_;
+		pos_ += strlen (pos_) + 1;
+
+		return true;
+	}
+
+	private:
+	char const *pos_;
+	char const *end_;
+};
+
+void appendEntry (std::string &payload, char const type, char const *key, char const *value)
+{
+	payload += type;
+	if (key) {
+		payload += key;
+		payload += '\0';
+	}
+	payload += value;
+	payload += '\0';
+}
+
+}
 Glib::RefPtr<Gdk::Pixbuf> Document::loadingthumb_;
 
 
@@ -43,8 +96,50 @@ Document::Document (Document const &x)
 	view_ = NULL;
 	*this = x;
 	setupThumbnail ();
+#ifdef REFERENCER_COUNT_COPIES
+	++copies_;
+#endif
 }
 
+Document::Document (Document const &x, bool const requestThumbnail)
+{
+	*this = x;
+	view_ = NULL;
+	if (requestThumbnail)
+		setupThumbnail ();
+#ifdef REFERENCER_COUNT_COPIES
+	++copies_;
+#endif
+}
+
+Document::Document (Document &&x)
+	: filename_ (std::move (x.filename_)),
+	  relfilename_ (std::move (x.relfilename_)),
+	  key_ (std::move (x.key_)),
+	  notes_ (std::move (x.notes_)),
+	  tagUids_ (std::move (x.tagUids_)),
+	  thumbnail_ (std::move (x.thumbnail_)),
+	  view_ (NULL),
+	  bib_ (std::move (x.bib_)),
+	  changes_ (x.changes_),
+	  payload_ (std::move (x.payload_))
+{
+	// Only documents which have had a thumbnail set up can have a request
+	// pending, and only those are moved on the main thread
+	if (thumbnail_)
+		ThumbnailGenerator::instance().moveRequest (&x, this);
+}
+
+
+#ifdef REFERENCER_COUNT_COPIES
+std::atomic<unsigned long> Document::copies_ (0);
+
+unsigned long Document::getCopyCount ()
+{
+	return copies_.load ();
+}
+#endif
+
 Document::Document (Glib::ustring const &filename)
 {
 	view_ = NULL;
@@ -64,21 +159,21 @@ Document::Document (
 	Glib::ustring const &relfilename,
 	Glib::ustring const &notes,
 	Glib::ustring const &key,
-	std::vector<int> const &tagUids,
-	BibData const &bib)
+	std::vector<int> tagUids,
+	BibData bib)
+	: tagUids_ (std::move (tagUids)), bib_ (std::move (bib))
 {
 	view_ = NULL;
 	setFileName (filename);
 	setNotes (notes);
 	key_ = key;
-	tagUids_ = tagUids;
-	bib_ = bib;
 	relfilename_ = relfilename;
 }
 
 Document::Document(xmlNodePtr docNode) 
 {
-    readXML(docNode);
+	view_ = NULL;
+	readXML(docNode);
 }
 
 Glib::ustring Document::keyReplaceDialogNotUnique (
@@ -258,22 +353,188 @@ void Document::setFileName (Glib::ustring const &filename)
 	ThumbnailGenerator::instance().deregisterRequest (this);
 
 	if (filename != filename_) {
+		if (list_.list)
+			list_.list->releaseFileName (*this);
 		filename_ = filename;
+		if (list_.list)
+			list_.list->addFileName (*this);
+		changes_.touch (CHANGED_FILENAME);
 		setupThumbnail ();
 	} else if (!thumbnail_) {
 		setupThumbnail ();
 	}
 }
 
-Glib::ustring const & Document::getNotes () const
+Glib::ustring Document::getNotes () const
 {
-	return notes_;
+	if (!notes_.empty ())
+		return notes_;
+
+	// Read packed notes in place, so that a const document is never unpacked
+	PayloadReader reader (payload_);
+	char type;
+	char const *key;
+	char const *value;
+	while (reader.next (type, key, value)) {
+		if (type == PAYLOAD_NOTES)
+			return value;
+	}
+
+	return Glib::ustring ();
 }
 
 void Document::setNotes (Glib::ustring const &notes)
 {
-	if (notes != notes_)
+	materialize ();
+	if (notes != notes_) {
 		notes_ = notes;
+		changes_.touch (CHANGED_NOTES);
+	}
+}
+
+
+std::string Document::getPayload () const
+{
+	if (!payload_.empty ())
+		return payload_;
+
+	std::string payload;
+	if (!notes_.empty ())
+		appendEntry (payload, PAYLOAD_NOTES, NULL, notes_.c_str ());
+	BibData::ExtrasMap::const_iterator it = bib_.extras_.begin ();
+	for (; it != bib_.extras_.end (); ++it)
+		appendEntry (payload, PAYLOAD_EXTRA, it->first.c_str (), it->second.c_str ());
+
+	return payload;
+}
+
+
+void Document::setPayload (std::string const &payload)
+{
+	notes_.clear ();
+	bib_.clearExtras ();
+	payload_ = payload;
+	changes_.touch (CHANGED_NOTES | CHANGED_EXTRAS);
+}
+
+
+void Document::materialize ()
+{
+	if (payload_.empty ())
+		return;
+
+	std::string payload;
+	payload.swap (payload_);
+
+	PayloadReader reader (payload);
+	char type;
+	char const *key;
+	char const *value;
+	while (reader.next (type, key, value)) {
+		// Unpacking isn't a change, so the extras are set directly:
+		// packed keys are distinct and packed text is valid already
+		if (type == PAYLOAD_NOTES)
+			notes_ = value;
+		else
+			bib_.extras_[key] = value;
+	}
+}
+
+
+bool Document::forEachField (FieldVisitor &visitor) const
+{
+	return bib_.forEachField (visitor) && forEachPackedExtra (visitor);
+}
+
+
+bool Document::forEachExtra (FieldVisitor &visitor) const
+{
+	return bib_.forEachExtra (visitor) && forEachPackedExtra (visitor);
+}
+
+
+bool Document::forEachPackedExtra (FieldVisitor &visitor) const
+{
+	PayloadReader reader (payload_);
+	char type;
+	char const *key;
+	char const *value;
+	while (reader.next (type, key, value)) {
+		if (type == PAYLOAD_EXTRA && !visitor.visit (key, value))
+			return false;
+	}
+
+	return true;
+}
+
+
+bool Document::forEachSearchable (FieldVisitor &visitor) const
+{
+	if (!forEachField (visitor))
+		return false;
+
+	if (!notes_.empty () && !visitor.visit ("notes", notes_.c_str ()))
+		return false;
+
+	/* The notes may be packed too */
+	PayloadReader reader (payload_);
+	char type;
+	char const *key;
+	char const *value;
+	while (reader.next (type, key, value)) {
+		if (type == PAYLOAD_NOTES && !visitor.visit ("notes", value))
+			return false;
+	}
+
+	return visitor.visit ("key", key_.c_str ());
+}
+
+
+/*
+ * Only text which unpacks the same way as it would have been read eagerly
+ * gets packed: anything else unpacks what there is and is stored directly.
+ */
+void Document::packNotes (char const *notes)
+{
+	bool packable = notes_.empty () && bib_.extras_.empty ()
+		&& g_utf8_validate (notes, -1, NULL);
+
+	PayloadReader reader (payload_);
+	char type;
+	char const *key;
+	char const *value;
+	while (packable && reader.next (type, key, value))
+		packable = type != PAYLOAD_NOTES;
+
+	if (packable) {
+		appendEntry (payload_, PAYLOAD_NOTES, NULL, notes);
+	} else {
+		materialize ();
+		setNotes (notes);
+	}
+}
+
+
+void Document::packExtra (char const *key, char const *value)
+{
+	// Extras are keyed case insensitively and repeated keys may be merged,
+	// so only distinct ASCII keys are packed
+	bool packable = key && notes_.empty () && bib_.extras_.empty ()
+		&& g_str_is_ascii (key) && g_utf8_validate (value, -1, NULL);
+
+	PayloadReader reader (payload_);
+	char type;
+	char const *otherKey;
+	char const *otherValue;
+	while (packable && reader.next (type, otherKey, otherValue))
+		packable = !otherKey || g_ascii_strcasecmp (key, otherKey) != 0;
+
+	if (packable) {
+		appendEntry (payload_, PAYLOAD_EXTRA, key, value);
+	} else {
+		materialize ();
+		bib_.addExtra (key, value);
+	}
 }
 
 
@@ -318,7 +579,12 @@ void Document::updateRelFileName (Glib::ustring const &libfilename)
 
 void Document::setKey (Glib::ustring const &key)
 {
+	if (list_.list)
+		list_.list->releaseKey (key_);
 	key_ = key;
+	if (list_.list)
+		list_.list->addKey (key_);
+	changes_.touch (1 << FIELD_KEY);
 }
 
 
@@ -334,6 +600,7 @@ void Document::setTag(int uid)
 		num << uid;
 	} else {
 		tagUids_.push_back(uid);
+		changes_.touch (CHANGED_TAGS);
 	}
 }
 
@@ -343,14 +610,19 @@ void Document::clearTag(int uid)
 	std::vector<int>::iterator location =
 		std::find(tagUids_.begin(), tagUids_.end(), uid);
 
-	if (location != tagUids_.end())
+	if (location != tagUids_.end()) {
 		tagUids_.erase(location);
+		changes_.touch (CHANGED_TAGS);
+	}
 }
 
 
 void Document::clearTags()
 {
-	tagUids_.clear();
+	if (!tagUids_.empty()) {
+		tagUids_.clear();
+		changes_.touch (CHANGED_TAGS);
+	}
 }
 
 
@@ -362,10 +634,34 @@ bool Document::hasTag(int uid)
 
 using Utility::writeBibKey;
 
+namespace {
+
+class BibtexFieldWriter : public FieldVisitor {
+	public:
+	BibtexFieldWriter (std::ostringstream &out, bool const usebraces, bool const utf8)
+		: out_ (out), usebraces_ (usebraces), utf8_ (utf8) {}
+
+	bool visit (char const *name, char const *value)
+	{
+		// Exceptions to usebraces are editor and author because we
+		// don't want "Foo, B.B. and John Bar" to be literal
+		writeBibKey (out_, name, value,
+			g_ascii_strcasecmp (name, "editor") != 0 && usebraces_, utf8_);
+		return true;
+	}
+
+	private:
+	std::ostringstream &out_;
+	bool const usebraces_;
+	bool const utf8_;
+};
+
+}
+
 /**
  * Temporarily duplicating functionality in printBibtex and 
  * writeBibtex -- the difference is that writeBibtex requires a 
- * Library reference in order to resolve tag uids to names.
+ * TagList reference in order to resolve tag uids to names.
  * In order to be usable from PythonDocument printBibtex just 
  * doesn't bother printing tags at all.
  *
@@ -382,18 +678,9 @@ Glib::ustring Document::printBibtex (
 	// We should strip illegal characters from key in a predictable way
 	out << "@" << bib_.getType() << "{" << key_ << ",\n";
 
-	BibData::ExtrasMap extras = bib_.getExtras ();
-	BibData::ExtrasMap::iterator it = extras.begin ();
-	BibData::ExtrasMap::iterator const end = extras.end ();
-	for (; it != end; ++it) {
-		// Exceptions to useBraces are editor and author because we
-		// don't want "Foo, B.B. and John Bar" to be literal
-		writeBibKey (
-			out,
-			(*it).first,
-			(*it).second,
-			((*it).first.lowercase () != "editor") && useBraces, utf8);
-	}
+	// Written from where the extras are, so exporting doesn't unpack them
+	BibtexFieldWriter extras (out, useBraces, utf8);
+	forEachExtra (extras);
 
 	// Ideally should know what's a list of human names and what's an
 	// institution name be doing something different for non-human-name authors?
@@ -413,7 +700,7 @@ Glib::ustring Document::printBibtex (
 
 
 void Document::writeBibtex (
-	Library const &lib,
+	TagList &tags,
 	std::ostringstream& out,
 	bool const usebraces,
 	bool const utf8)
@@ -422,18 +709,9 @@ void Document::writeBibtex (
 	// We should strip illegal characters from key in a predictable way
 	out << "@" << bib_.getType() << "{" << key_ << ",\n";
 
-	BibData::ExtrasMap extras = bib_.getExtras ();
-	BibData::ExtrasMap::iterator it = extras.begin ();
-	BibData::ExtrasMap::iterator const end = extras.end ();
-	for (; it != end; ++it) {
-		// Exceptions to usebraces are editor and author because we
-		// don't want "Foo, B.B. and John Bar" to be literal
-		writeBibKey (
-			out,
-			(*it).first,
-			(*it).second,
-			((*it).first.lowercase () != "editor") && usebraces, utf8);
-	}
+	// Written from where the extras are, so exporting doesn't unpack them
+	BibtexFieldWriter extras (out, usebraces, utf8);
+	forEachExtra (extras);
 
 	// Ideally should know what's a list of human names and what's an
 	// institution name be doing something different for non-human-name authors?
@@ -453,7 +731,7 @@ void Document::writeBibtex (
 		for (; tagit != tagend; ++tagit) {
 			if (tagit != tagUids_.begin ())
 				out << ", ";
-			out << lib.getTagList()->getName(*tagit);
+			out << tags.getName(*tagit);
 		}
 		out << "\"\n";
 	}
@@ -472,14 +750,35 @@ void Document::writeXML(xmlTextWriterPtr writer) {
     	xmlTextWriterWriteElement(writer, BAD_CAST LIB_ELEMENT_DOC_FILENAME, BAD_CAST filename_.c_str());
     }
     xmlTextWriterWriteElement(writer, BAD_CAST LIB_ELEMENT_DOC_KEY, BAD_CAST getKey().c_str());
-    xmlTextWriterWriteElement(writer, BAD_CAST LIB_ELEMENT_DOC_NOTES, BAD_CAST getNotes().c_str());
+
+    // A packed payload is written as it is, without unpacking it
+    char const *notes = notes_.c_str();
+    PayloadReader notesReader(payload_);
+    char type;
+    char const *key;
+    char const *value;
+    while (notesReader.next(type, key, value)) {
+        if (type == PAYLOAD_NOTES)
+            notes = value;
+    }
+    xmlTextWriterWriteElement(writer, BAD_CAST LIB_ELEMENT_DOC_NOTES, BAD_CAST notes);
 
 	std::vector<int> docvec = getTags();
     for (std::vector<int>::iterator it = docvec.begin(); it != docvec.end(); ++it) {
         xmlTextWriterWriteFormatElement(writer, BAD_CAST LIB_ELEMENT_DOC_TAG, "%d", (*it));
 	}
 
-    getBibData().writeXML(writer);
+    bib_.writeXML(writer);
+
+    PayloadReader extrasReader(payload_);
+    while (extrasReader.next(type, key, value)) {
+        if (type == PAYLOAD_EXTRA) {
+            xmlTextWriterStartElement(writer, BAD_CAST LIB_ELEMENT_DOC_BIB_EXTRA);
+            xmlTextWriterWriteAttribute(writer, BAD_CAST LIB_ELEMENT_DOC_BIB_EXTRA_KEY, BAD_CAST key);
+            xmlTextWriterWriteString(writer, BAD_CAST value);
+            xmlTextWriterEndElement(writer);
+        }
+    }
 
     xmlTextWriterEndElement(writer);
 }
@@ -492,35 +791,38 @@ void Document::readXML(xmlNodePtr docNode) {
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_REL_FILENAME)) {
             SET_FROM_NODE(setRelFileName, child);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_FILENAME)) {
-            SET_FROM_NODE(setFileName, child);
+            // Not setFileName: the thumbnail is only set up once the
+            // document has been added to the library (see Library::load),
+            // which lets documents be decoded off the main thread.
+            COPY_NODE(filename_, child);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_KEY)) {
             SET_FROM_NODE(setKey, child);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_NOTES)) {
-            SET_FROM_NODE(setNotes, child);
+            SET_FROM_NODE(packNotes, child);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_BIB_AUTHORS)) {
-            SET_FROM_NODE(getBibData().setAuthors, child);
+            SET_FROM_NODE(bib_.setAuthors, child);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_BIB_DOI)) {
-            SET_FROM_NODE(getBibData().setDoi, child);
+            SET_FROM_NODE(bib_.setDoi, child);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_BIB_EXTRA)) {
             char* extraKey = STR xmlGetProp(child, XSTR LIB_ELEMENT_DOC_BIB_EXTRA_KEY);
             char* extraText = STR xmlNodeGetContent(child);
-            getBibData().addExtra(extraKey, extraText);
+            packExtra(extraKey, extraText);
             xmlFree(extraKey);
             xmlFree(extraText);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_BIB_JOURNAL)) {
-            SET_FROM_NODE(getBibData().setJournal, child);
+            SET_FROM_NODE(bib_.setJournal, child);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_BIB_NUMBER)) {
-            SET_FROM_NODE(getBibData().setIssue, child);
+            SET_FROM_NODE(bib_.setIssue, child);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_BIB_PAGES)) {
-            SET_FROM_NODE(getBibData().setPages, child);
+            SET_FROM_NODE(bib_.setPages, child);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_BIB_TITLE)) {
-            SET_FROM_NODE(getBibData().setTitle, child);
+            SET_FROM_NODE(bib_.setTitle, child);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_BIB_TYPE)) {
-            SET_FROM_NODE(getBibData().setType, child);
+            SET_FROM_NODE(bib_.setType, child);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_BIB_VOLUME)) {
-            SET_FROM_NODE(getBibData().setVolume, child);
+            SET_FROM_NODE(bib_.setVolume, child);
         } else if (nodeNameEq(child, LIB_ELEMENT_DOC_BIB_YEAR)) {
-            SET_FROM_NODE(getBibData().setYear, child);
+            SET_FROM_NODE(bib_.setYear, child);
         }
     }
 }
@@ -605,78 +907,45 @@ bool Document::canGetMetadata ()
 }
 
 
-/* [bert] hack this to handle searches with a space like iTunes. For
- * now we just treat the whole search string as the boolean "AND" of
- * each individual component, and check the whole string against each
- * document.
- *
- * A better way to do this would be to change the whole search
- * procedure to narrow the search progressively by term, so that
- * additional terms search only through an already-filtered list.
- * But this would require changing higher-level code, for example, 
- * the DocumentView::isVisible() method that calls this function would
- * have to change substantially.
- */
+namespace {
 
-bool Document::matchesSearch (Glib::ustring const &search)
-{
-    /* This is a bit of a hack, I guess, but it's a low-impact way of 
-     * implementing the change. If the search term contains a space, I 
-     * iteratively decompose it into substrings and pass those onto
-     * this function. If anything doesn't match, we return a failure.
-     */
-    if (search.find(' ') != Glib::ustring::npos) {
-        Glib::ustring::size_type p1 = 0;
-        Glib::ustring::size_type p2;
-
-        do {
-
-            /* Find the next space in the string, if any.
-             */
-            p2 = search.find(' ', p1);
-
-            /* Extract the appropriate substring.
-             */
-            Glib::ustring const searchTerm = search.substr(p1, p2);
-
-            /* If the term is empty, ignore it and move on. It might just be a 
-             * trailing or duplicate space character.
-             */
-            if (searchTerm.empty()) {
-                break;
-            }
-
-            /* Now that we have the substring, which is guaranteed to be
-             * free of spaces, we can pass it recursively into this function.
-             * If the term does NOT match, fail the entire comparison right away.
-             */
-            if (!matchesSearch(searchTerm)) {
-                return false;
-            }
-
-            p1 = p2 + 1;		/* +1 to skip over the space */
-
-        } while (p2 != Glib::ustring::npos); /* Terminate at end of string */
-        return true;		/* All matched, so OK. */
-    }
+/* Stops at the first field containing the casefolded search term */
+class SearchVisitor : public FieldVisitor {
+	public:
+	SearchVisitor (std::string const &term)
+		: term_ (term) {}
 
-    Glib::ustring const searchNormalised = search.casefold();
+	bool visit (char const *, char const *value)
+	{
+		gchar *folded = g_utf8_casefold (value, -1);
+		bool const found = strstr (folded, term_.c_str ()) != NULL;
+		g_free (folded);
+		return !found;
+	}
 
-    FieldMap fields = getFields ();
-    FieldMap::iterator fieldIter = fields.begin ();
-    FieldMap::iterator const fieldEnd = fields.end ();
-    for (; fieldIter != fieldEnd; ++fieldIter) {
-        if (fieldIter->second.casefold().find(searchNormalised) != Glib::ustring::npos)
-            return true;
-    }
+	private:
+	std::string const &term_;
+};
 
-    if (notes_.casefold().find(searchNormalised) != Glib::ustring::npos)
-        return true;
+}
 
-    if (key_.casefold().find(searchNormalised) != Glib::ustring::npos)
-        return true;
 
-    return false;
+/*
+ * The search box text is the AND of its whitespace separated terms, each of
+ * which has to turn up somewhere in the document. DocumentList::search()
+ * answers the same question for a whole list at once, from its index.
+ */
+bool Document::matchesSearch (Glib::ustring const &search)
+{
+	std::vector<std::string> const terms = SearchIndex::splitTerms (search);
+	std::vector<std::string>::const_iterator term = terms.begin ();
+	for (; term != terms.end (); ++term) {
+		SearchVisitor visitor (*term);
+		if (forEachSearchable (visitor))
+			return false;
+	}
+
+	return true;
 }
 
 /*
@@ -739,145 +1008,159 @@ void Document::renameFromKey ()
 
 void Document::setField (Glib::ustring const &field, Glib::ustring const &value)
 {
+	FieldId const id = BibData::fieldId (field);
+	if (id != FIELD_EXTRA) {
+		setField (id, value);
+		return;
+	}
+
 	DEBUG ("%1 : %2", field, value);
-	if (field == "doi")
-		bib_.setDoi (value);
-	else if (field.lowercase() == "title")
-		bib_.setTitle (value);
-	else if (field.lowercase() == "volume")
-		bib_.setVolume (value);
-	else if (field.lowercase() == "number")
-		bib_.setIssue (value);
-	else if (field.lowercase() == "journal")
-		bib_.setJournal (value);
-	else if (field.lowercase() == "author")
-		bib_.setAuthors (value);
-	else if (field.lowercase() == "year")
-		bib_.setYear (value);
-	else if (field.lowercase() == "pages")
-		bib_.setPages (value);
-	else if (field == "key")
+	materialize ();
+	/* The extras map compares names case-insensitively */
+	bib_.extras_[field] = value;
+	changes_.touch (CHANGED_EXTRAS);
+
+	if (list_.list)
+		list_.list->updateIdentifiers (*this);
+}
+
+
+void Document::setField (FieldId const id, Glib::ustring const &value)
+{
+	DEBUG ("%1 : %2", BibData::fieldName (id), value);
+	if (id == FIELD_KEY) {
 		setKey (value);
-	else {
-		/* The extras map uses a case-folding comparator */
-		bib_.extras_[field] = value;
+		return;
 	}
+
+	bib_.setField (id, value);
+
+	if (list_.list)
+		list_.list->updateIdentifiers (*this);
+}
+
+
+void Document::setBibData (BibData &bib)
+{
+	materialize ();
+	bib_ = bib;
+	// The copy carries the revision of where it came from
+	changes_.touch (CHANGED_BIBDATA);
+
+	if (list_.list)
+		list_.list->updateIdentifiers (*this);
 }
 
 
-/* Can't be const because of std::map[] */
+/* Can't be const because it may unpack the payload */
 Glib::ustring Document::getField (Glib::ustring const &field)
 {
-	if (field == "doi")
-		return bib_.getDoi ();
-	else if (field == "title")
-		return bib_.getTitle ();
-	else if (field == "volume")
-		return bib_.getVolume ();
-	else if (field == "number")
-		return bib_.getIssue ();
-	else if (field == "journal")
-		return bib_.getJournal ();
-	else if (field == "author")
-		return bib_.getAuthors ();
-	else if (field == "year")
-		return bib_.getYear ();
-	else if (field == "pages")
-		return bib_.getPages ();
-	else if (field == "key")
-		return getKey();
-	else {
-		if (bib_.extras_.find(field) != bib_.extras_.end()) {
-			const Glib::ustring _field = field;
-			return bib_.extras_[_field];
-		} else {
-			DEBUG ("Document::getField: WARNING: unknown field %1", field);
-			throw std::range_error("Document::getField: unknown field");
-		}
+	FieldId const id = BibData::fieldId (field);
+	if (id != FIELD_EXTRA)
+		return getField (id);
+
+	materialize ();
+	BibData::ExtrasMap::const_iterator const it = bib_.extras_.find (field);
+	if (it != bib_.extras_.end()) {
+		return it->second;
+	} else {
+		DEBUG ("Document::getField: WARNING: unknown field %1", field);
+		throw std::range_error("Document::getField: unknown field");
 	}
 }
 
 
+Glib::ustring const &Document::getField (FieldId const id) const
+{
+	if (id == FIELD_KEY)
+		return key_;
+	return bib_.getField (id);
+}
+
+
 bool Document::hasField (Glib::ustring const &field) const
 {
-	if (field == "doi")
-		return !bib_.getDoi ().empty();
-	else if (field == "title")
-		return !bib_.getTitle ().empty();
-	else if (field == "volume")
-		return !bib_.getVolume ().empty();
-	else if (field == "number")
-		return !bib_.getIssue ().empty();
-	else if (field == "journal")
-		return !bib_.getJournal ().empty();
-	else if (field == "author")
-		return !bib_.getAuthors ().empty();
-	else if (field == "year")
-		return !bib_.getYear ().empty();
-	else if (field == "pages")
-		return !bib_.getPages ().empty();
-	else {
-		if (bib_.extras_.find(field) != bib_.extras_.end())
-			return true;
-		else
-			return false;
-	}
+	FieldId const id = BibData::fieldId (field);
+	if (id != FIELD_EXTRA)
+		return hasField (id);
+
+	return bib_.extras_.find(field) != bib_.extras_.end()
+		|| findPackedExtra (field.c_str ());
 }
 
 
-/*
- * Metadata fields.  Does not include document key or type
- */
-std::map <Glib::ustring, Glib::ustring> Document::getFields ()
+bool Document::hasField (FieldId const id) const
 {
-	std::map <Glib::ustring, Glib::ustring> fields;
+	return !getField (id).empty ();
+}
 
-	if (!bib_.getDoi ().empty())
-		fields["doi"] = bib_.getDoi();
 
-	if (!bib_.getTitle ().empty())
-		fields["title"] = bib_.getTitle();
+Glib::ustring Document::peekExtra (char const *key) const
+{
+	BibData::ExtrasMap::const_iterator const it = bib_.extras_.find (key);
+	if (it != bib_.extras_.end ())
+		return it->second;
+
+	char const *const value = findPackedExtra (key);
+	return value ? Glib::ustring (value) : Glib::ustring ();
+}
 
-	if (!bib_.getVolume ().empty())
-		fields["volume"] = bib_.getVolume();
 
-	if (!bib_.getIssue ().empty())
-		fields["number"] = bib_.getIssue();
+char const *Document::findPackedExtra (char const *key) const
+{
+	// Packed keys are all ASCII
+	PayloadReader reader (payload_);
+	char type;
+	char const *otherKey;
+	char const *value;
+	while (reader.next (type, otherKey, value)) {
+		if (otherKey && g_ascii_strcasecmp (key, otherKey) == 0)
+			return value;
+	}
 
-	if (!bib_.getJournal ().empty())
-		fields["journal"] = bib_.getJournal();
+	return NULL;
+}
 
-	if (!bib_.getAuthors ().empty())
-		fields["author"] = bib_.getAuthors();
 
-	if (!bib_.getYear ().empty())
-		fields["year"] = bib_.getYear();
+namespace {
 
-	if (!bib_.getPages ().empty())
-		fields["pages"] = bib_.getPages();
+class FieldCollector : public FieldVisitor {
+	public:
+	FieldCollector (Document::FieldMap &fields) : fields_ (fields) {}
 
-		
-	BibData::ExtrasMap::iterator it = bib_.extras_.begin ();
-	BibData::ExtrasMap::iterator end = bib_.extras_.end ();
-	for (; it != end; ++it) {
-		fields[(*it).first] = (*it).second;
+	bool visit (char const *name, char const *value)
+	{
+		fields_[name] = value;
+		return true;
 	}
 
+	private:
+	Document::FieldMap &fields_;
+};
+
+}
+
+
+/*
+ * Metadata fields.  Does not include document key or type
+ */
+std::map <Glib::ustring, Glib::ustring> Document::getFields ()
+{
+	std::map <Glib::ustring, Glib::ustring> fields;
+
+	FieldCollector collector (fields);
+	forEachField (collector);
+
 	return fields;
 }
 
 
 void Document::clearFields ()
 {
-	bib_.extras_.clear ();
-	setField ("doi", "");
-	setField ("title", "");
-	setField ("volume", "");
-	setField ("number", "");
-	setField ("journal", "");
-	setField ("author", "");
-	setField ("year", "");
-	setField ("pages", "");
+	materialize ();
+	bib_.clearExtras ();
+	for (int id = FIELD_DOI; id <= FIELD_PAGES; ++id)
+		setField (FieldId (id), "");
 }
 
 
@@ -13,13 +13,17 @@
 #ifndef DOCUMENT_H
 #define DOCUMENT_H
 
+#include <algorithm>
+#include <atomic>
+
 #include <glibmm.h>
 #include <libxml/xmlwriter.h>
 
 #include "BibData.h"
 
+class DocumentList;
 class DocumentView;
-class Library;
+class TagList;
 
 class Document {
 	private:
@@ -31,25 +35,81 @@ class Document {
 	Glib::RefPtr<Gdk::Pixbuf> thumbnail_;
 	static const Glib::ustring defaultKey_;
 	static Glib::RefPtr<Gdk::Pixbuf> loadingthumb_;
+#ifdef REFERENCER_COUNT_COPIES
+	static std::atomic<unsigned long> copies_;
+#endif
 
 	void setupThumbnail ();
 	DocumentView *view_;
 
 	BibData bib_;
+	/* Changes to everything but bib_, which keeps its own */
+	ChangeStamp changes_;
+
+	/*
+	 * The notes and extra bibliography fields as read from a library,
+	 * packed into a single string until something first needs them. While
+	 * this is non-empty, notes_ and bib_'s extras are empty.
+	 */
+	std::string payload_;
+	void materialize ();
+	void packNotes (char const *notes);
+	void packExtra (char const *key, char const *value);
+	bool forEachPackedExtra (FieldVisitor &visitor) const;
+	/* The packed value of an extra field, or NULL */
+	char const *findPackedExtra (char const *key) const;
+
+	/*
+	 * The list the document is in, which indexes it by key and filename,
+	 * and its slot in the list's storage. Copies of a document are never in
+	 * a list, and assigning over a document leaves it in its list, without
+	 * updating the list's indexes.
+	 */
+	class ListLink {
+		public:
+		ListLink () : list (NULL), slot (G_MAXUINT32) {}
+		ListLink (ListLink const &) : list (NULL), slot (G_MAXUINT32) {}
+		ListLink &operator= (ListLink const &) {return *this;}
+
+		DocumentList *list;
+		guint32 slot;
+	};
+	ListLink list_;
+	friend class DocumentList;
+	friend class DocumentSlab;
 
 	public:
 	~Document ();
 	Document ();
 	Document (Document const & x);
+	/**
+	 * Copies x without its view, and only requests a thumbnail for the copy if
+	 * asked to. A copy without a thumbnail request can be read from a worker
+	 * thread, though it must still be destroyed on the main thread.
+	 */
+	Document (Document const &x, bool const requestThumbnail);
+	/**
+	 * Takes over x's fields and any pending thumbnail request, leaving x
+	 * empty. Like a copy, the new document isn't in a list.
+	 */
+	Document (Document &&x);
 	Document& operator= (Document const &) = default;
+#ifdef REFERENCER_COUNT_COPIES
+	/**
+	 * How many times a document has been copied, to check that paths
+	 * which should only move documents don't copy them. Only counted in
+	 * the benchmarks' build.
+	 */
+	static unsigned long getCopyCount ();
+#endif
 	Document (Glib::ustring const &filename);
 	Document (
 		Glib::ustring const &filename,
 		Glib::ustring const &relfilename,
 		Glib::ustring const &notes,
 		Glib::ustring const &key,
-		std::vector<int> const &tagUids,
-		BibData const &bib);
+		std::vector<int> tagUids,
+		BibData bib);
         /**
          * Creates a document by extracting information from the provided XML
          * node.
@@ -58,6 +118,24 @@ class Document {
          * filename etc.
          */
         Document(xmlNodePtr docNode);
+	/**
+	 * The revision of the document's latest change, from the counter
+	 * shared by all \ref ChangeStamp "ChangeStamps". Changes made through
+	 * getTags() or directly to the BibData's extras_ aren't seen.
+	 */
+	guint64 getRevision () const
+		{return std::max (changes_.getRevision (), bib_.getChangeStamp ().getRevision ());}
+	/**
+	 * The CHANGED_ bits for what changed since \ref clearChanges().
+	 */
+	guint32 getChanges () const
+		{return changes_.getChanges () | bib_.getChangeStamp ().getChanges ();}
+	void clearChanges () {changes_.clear (); bib_.clearChanges ();}
+
+	/**
+	 * The list the document is in, if any.
+	 */
+	DocumentList *getList () const {return list_.list;}
 	Glib::ustring const & getKey() const;
 	Glib::ustring const & getFileName() const;
 	// RelFileName is NOT kept up to date in general, it's
@@ -76,7 +154,21 @@ class Document {
 	}
 	
 	//Notes set and get
-	Glib::ustring const & getNotes() const;
+	/**
+	 * The notes, read from the packed payload if they haven't been
+	 * unpacked, so that a const document is never changed.
+	 */
+	Glib::ustring getNotes() const;
+	/**
+	 * The notes and extra fields packed the way documents are loaded, which
+	 * is much smaller than keeping them as separate strings.
+	 */
+	std::string getPayload () const;
+	/**
+	 * Replaces the notes and extra fields with a packed payload from \ref
+	 * getPayload(), which is only unpacked when first needed.
+	 */
+	void setPayload (std::string const &payload);
 	void setNotes(Glib::ustring const &notes);
 
 	std::vector<int>& getTags ();
@@ -93,7 +185,7 @@ class Document {
 	bool matchesSearch (Glib::ustring const &search);
 
 	void writeBibtex (
-		Library const &lib,
+		TagList &tags,
 		std::ostringstream& out,
 		bool const usebraces,
 		bool const utf8);
@@ -104,7 +196,8 @@ class Document {
 		
 	void writeXML (xmlTextWriterPtr writer);
         /**
-         * Extracts document data from the given XML DOM node.
+         * Extracts document data from the given XML DOM node. This does not
+         * touch the thumbnail, so it is safe to call from a worker thread.
          * @param docNode the \c document node from the parsed library XML file.
          * It contains information about the document such as authors, title,
          * filename etc.
@@ -114,8 +207,13 @@ class Document {
 	bool getMetaData ();
 	void renameFromKey ();
 
-	BibData& getBibData () {return bib_;}
-	void setBibData (BibData& bib){bib_ = bib;}
+	BibData& getBibData () {materialize (); return bib_;}
+	/**
+	 * The bibliography data without unpacking the extra fields, which are
+	 * missing from it until something else does. Enough for display.
+	 */
+	BibData const& getCoreBibData () const {return bib_;}
+	void setBibData (BibData& bib);
 
 	Glib::ustring generateKey ();
 
@@ -123,10 +221,46 @@ class Document {
 
 	typedef std::map <Glib::ustring, Glib::ustring> FieldMap;
 
+	/*
+	 * Field names are case-insensitive. The core fields and the key are
+	 * told apart once, by BibData::fieldId(), and the rest are extras.
+	 */
 	void setField (Glib::ustring const &field, Glib::ustring const &value);
 	Glib::ustring getField (Glib::ustring const &field);
 	bool hasField (Glib::ustring const &field) const;
+	/* For any field but FIELD_EXTRA */
+	void setField (FieldId const id, Glib::ustring const &value);
+	Glib::ustring const &getField (FieldId const id) const;
+	bool hasField (FieldId const id) const;
+	/**
+	 * An extra field's value, read from the packed payload if the extras
+	 * haven't been unpacked yet. Empty if there is no such field.
+	 */
+	Glib::ustring peekExtra (char const *key) const;
+	/**
+	 * A copy of every field. Prefer \ref forEachField(), which neither
+	 * copies them nor unpacks the extras.
+	 */
 	FieldMap getFields ();
+	/**
+	 * Shows the visitor each non-empty field, core ones first, reading
+	 * packed extras in place.
+	 *
+	 * @return false if the visitor stopped early.
+	 */
+	bool forEachField (FieldVisitor &visitor) const;
+	/**
+	 * Like \ref forEachField(), for the extra fields only.
+	 */
+	bool forEachExtra (FieldVisitor &visitor) const;
+	/**
+	 * Shows the visitor everything the search box looks through: each
+	 * field, then the notes as "notes" and the key as "key", without
+	 * unpacking anything.
+	 *
+	 * @return false if the visitor stopped early.
+	 */
+	bool forEachSearchable (FieldVisitor &visitor) const;
 	void clearFields ();
 
 	static Glib::ustring keyReplaceDialogNotUnique (Glib::ustring const &, Glib::ustring const &);
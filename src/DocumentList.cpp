@@ -11,12 +11,15 @@
 
 
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <sstream>
 
 #include <giomm/inputstream.h>
 #include <giomm/file.h>
 #include <glibmm/i18n.h>
+#include <glibmm/threads.h>
 #include <libxml/xmlwriter.h>
 #include "ucompose.hpp"
 
@@ -25,33 +28,451 @@
 #include "Document.h"
 #include "Library.h"
 
+namespace {
+	Glib::Threads::Mutex listsLock;
+	guint32 nextSerial = 1;
+	std::unordered_map<guint32, DocumentList*> lists;
+}
+
+
+DocumentList::DocumentList ()
+{
+	Glib::Threads::Mutex::Lock lock (listsLock);
+	serial_ = nextSerial++;
+	lists[serial_] = this;
+}
+
+
+DocumentList::~DocumentList ()
+{
+	Glib::Threads::Mutex::Lock lock (listsLock);
+	lists.erase (serial_);
+}
+
+
+DocumentList *DocumentList::findBySerial (guint32 serial)
+{
+	Glib::Threads::Mutex::Lock lock (listsLock);
+	std::unordered_map<guint32, DocumentList*>::iterator it = lists.find (serial);
+	return it == lists.end () ? NULL : it->second;
+}
+
+
 DocumentList::Container& DocumentList::getDocs ()
 {
 	return docs_;
 }
 
 
-Document* DocumentList::newDocWithFile (Glib::ustring const &filename)
+std::vector<Document*> DocumentList::getChangedSince (guint64 const revision)
 {
+	std::vector<Document*> changed;
 	Container::iterator it = docs_.begin ();
-	Container::iterator const end = docs_.end ();
-	for (; it != end; ++it) {
-		if ((*it).getFileName() == filename) {
-			return NULL;
+	for (; it != docs_.end (); ++it) {
+		if (it->getRevision () > revision)
+			changed.push_back (&(*it));
+	}
+	return changed;
+}
+
+
+std::vector<Document*> DocumentList::search (Glib::ustring const &text)
+{
+	return searchIndex_.search (docs_, text);
+}
+
+
+std::vector<Document*> DocumentList::search (
+	Glib::ustring const &text,
+	std::vector<Document*> const &within)
+{
+	return searchIndex_.search (docs_, text, within);
+}
+
+
+void DocumentList::clearChanges (guint64 const revision)
+{
+	Container::iterator it = docs_.begin ();
+	for (; it != docs_.end (); ++it) {
+		if (it->getRevision () <= revision)
+			it->clearChanges ();
+	}
+}
+
+
+/*
+ * Splits a key of the form "stem-n", as made by uniqueKey, into its stem
+ * and suffix. Returns 0 for any other key.
+ */
+static int keySuffix (std::string const &key, std::string &stem)
+{
+	std::string::size_type const dash = key.rfind ('-');
+	if (dash == std::string::npos || dash + 1 == key.size ()
+	    || key[dash + 1] == '0' || key.size () - dash > 10)
+		return 0;
+
+	int suffix = 0;
+	for (std::string::size_type i = dash + 1; i < key.size (); ++i) {
+		if (!g_ascii_isdigit (key[i]))
+			return 0;
+		suffix = suffix * 10 + (key[i] - '0');
+	}
+
+	stem = key.substr (0, dash);
+	return suffix;
+}
+
+
+void DocumentList::addKey (Glib::ustring const &key)
+{
+	++keyCounts_[key.raw ()];
+}
+
+
+void DocumentList::releaseKey (Glib::ustring const &key)
+{
+	KeyCounts::iterator count = keyCounts_.find (key.raw ());
+	if (count == keyCounts_.end ())
+		return;
+	if (--count->second > 0)
+		return;
+	keyCounts_.erase (count);
+
+	// A suffix below the hint is free again
+	std::string stem;
+	int const suffix = keySuffix (key.raw (), stem);
+	if (suffix) {
+		SuffixHints::iterator hint = suffixHints_.find (stem);
+		if (hint != suffixHints_.end () && suffix < hint->second)
+			hint->second = suffix;
+	}
+}
+
+
+/*
+ * True if GIO would give back the URI as it is: nothing to escape or
+ * unescape, and no empty or dot segments in the path.
+ */
+static bool isCanonicalUri (std::string const &uri)
+{
+	std::string::size_type const path = uri.find ("://");
+	if (path == std::string::npos)
+		return false;
+
+	for (std::string::size_type i = path + 3; i < uri.size (); ++i) {
+		char const c = uri[i];
+		if (!g_ascii_isalnum (c) && !strchr ("-._~/:@!$&'()*+,;=", c))
+			return false;
+		if (c == '/' && i + 1 < uri.size ()
+		    && (uri[i + 1] == '/' || (uri[i + 1] == '.'
+			&& (i + 2 == uri.size () || uri[i + 2] == '/' || uri[i + 2] == '.'))))
+			return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * The form filenames are indexed by: GIO resolves escaping and dot
+ * segments, so that equivalent URIs compare equal. Most are already in
+ * that form, which is checked for first as making a GFile is slow.
+ */
+static std::string normalizedFileName (Glib::ustring const &filename)
+{
+	if (filename.empty () || isCanonicalUri (filename.raw ()))
+		return filename.raw ();
+
+	return Gio::File::create_for_uri (filename)->get_uri ();
+}
+
+
+void DocumentList::addFileName (Document &doc)
+{
+	std::string const filename = normalizedFileName (doc.getFileName ());
+	if (!filename.empty ())
+		files_.insert (std::make_pair (filename, &doc));
+}
+
+
+void DocumentList::releaseFileName (Document &doc)
+{
+	std::string const filename = normalizedFileName (doc.getFileName ());
+	if (filename.empty ())
+		return;
+
+	std::pair<FileIndex::iterator, FileIndex::iterator> range =
+		files_.equal_range (filename);
+	for (FileIndex::iterator it = range.first; it != range.second; ++it) {
+		if (it->second == &doc) {
+			files_.erase (it);
+			return;
 		}
 	}
+}
+
 
-	Document newdoc(filename);
-	docs_.push_back(newdoc);
-	return &(docs_.back());
+/*
+ * Lowercased, with surrounding whitespace and any of the given prefixes
+ * removed.
+ */
+static std::string strippedIdentifier (
+	Glib::ustring const &value,
+	char const * const prefixes[],
+	size_t const nPrefixes)
+{
+	std::string id = value.lowercase ().raw ();
+	std::string::size_type const first = id.find_first_not_of (" \t\r\n");
+	if (first == std::string::npos)
+		return std::string ();
+	id = id.substr (first, id.find_last_not_of (" \t\r\n") - first + 1);
+
+	for (size_t i = 0; i < nPrefixes; ++i) {
+		size_t const length = strlen (prefixes[i]);
+		if (id.compare (0, length, prefixes[i]) == 0) {
+			id.erase (0, length);
+			break;
+		}
+	}
+
+	return id;
+}
+
+
+/*
+ * DOIs are case insensitive, and often written as links
+ */
+static std::string normalizedDoi (Glib::ustring const &doi)
+{
+	static char const * const prefixes[] = {
+		"https://doi.org/", "http://doi.org/",
+		"https://dx.doi.org/", "http://dx.doi.org/", "doi:"};
+	std::string const id = strippedIdentifier (doi, prefixes, G_N_ELEMENTS (prefixes));
+	if (id.compare (0, 3, "10.") != 0 || id.find ('/') == std::string::npos)
+		return std::string ();
+
+	return "doi:" + id;
+}
+
+
+/*
+ * Every version of an arXiv paper is the same paper
+ */
+static std::string normalizedArxiv (Glib::ustring const &eprint)
+{
+	static char const * const prefixes[] = {
+		"https://arxiv.org/abs/", "http://arxiv.org/abs/", "arxiv:"};
+	std::string id = strippedIdentifier (eprint, prefixes, G_N_ELEMENTS (prefixes));
+
+	std::string::size_type const version = id.rfind ('v');
+	if (version != std::string::npos && version > 0 && version + 1 < id.size ()
+	    && g_ascii_isdigit (id[version - 1])
+	    && id.find_first_not_of ("0123456789", version + 1) == std::string::npos)
+		id.erase (version);
+
+	if (id.empty ())
+		return std::string ();
+
+	return "arxiv:" + id;
+}
+
+
+static std::string normalizedPmid (Glib::ustring const &pmid)
+{
+	static char const * const prefixes[] = {"pmid:"};
+	std::string id = strippedIdentifier (pmid, prefixes, G_N_ELEMENTS (prefixes));
+	id.erase (0, id.find_first_not_of (" 0"));
+	if (id.empty () || id.find_first_not_of ("0123456789") != std::string::npos)
+		return std::string ();
+
+	return "pmid:" + id;
+}
+
+
+/*
+ * The normalised identifiers a document has, read without unpacking its
+ * extra fields.
+ */
+static std::vector<std::string> documentIdentifiers (Document const &doc)
+{
+	std::string const ids[] = {
+		normalizedDoi (doc.getCoreBibData ().getDoi ()),
+		normalizedArxiv (doc.peekExtra ("eprint")),
+		normalizedPmid (doc.peekExtra ("pmid"))};
+
+	std::vector<std::string> identifiers;
+	for (size_t i = 0; i < G_N_ELEMENTS (ids); ++i) {
+		if (!ids[i].empty ())
+			identifiers.push_back (ids[i]);
+	}
+	return identifiers;
+}
+
+
+void DocumentList::addIdentifiers (Document &doc)
+{
+	// Documents are only indexed once they are in the slab
+	DocumentHandle const handle = docs_.getHandle (&doc);
+	if (handle.isNull ())
+		return;
+
+	std::vector<std::string> const ids = documentIdentifiers (doc);
+	std::vector<std::string>::const_iterator id = ids.begin ();
+	for (; id != ids.end (); ++id) {
+		std::pair<IdentifierIndex::iterator, IdentifierIndex::iterator> range =
+			identifiers_.equal_range (*id);
+		IdentifierIndex::iterator it = range.first;
+		while (it != range.second && it->second != handle)
+			++it;
+		if (it == range.second)
+			identifiers_.insert (std::make_pair (*id, handle));
+	}
+}
+
+
+void DocumentList::releaseIdentifiers (Document &doc)
+{
+	DocumentHandle const handle = docs_.getHandle (&doc);
+	std::vector<std::string> const ids = documentIdentifiers (doc);
+	std::vector<std::string>::const_iterator id = ids.begin ();
+	for (; id != ids.end (); ++id) {
+		std::pair<IdentifierIndex::iterator, IdentifierIndex::iterator> range =
+			identifiers_.equal_range (*id);
+		for (IdentifierIndex::iterator it = range.first; it != range.second; ++it) {
+			if (it->second == handle) {
+				identifiers_.erase (it);
+				break;
+			}
+		}
+	}
+}
+
+
+void DocumentList::adoptDoc (Document &doc)
+{
+	doc.list_.list = this;
+	addKey (doc.getKey ());
+	addFileName (doc);
+	addIdentifiers (doc);
+	// It may be older than the index's last look at the list
+	searchIndex_.invalidate ();
+}
+
+
+void DocumentList::releaseDoc (Document &doc)
+{
+	releaseKey (doc.getKey ());
+	releaseFileName (doc);
+	releaseIdentifiers (doc);
+	searchIndex_.remove (doc.list_.slot);
+	doc.list_.list = NULL;
+}
+
+
+void DocumentList::clear ()
+{
+	docs_.clear ();
+	keyCounts_.clear ();
+	suffixHints_.clear ();
+	files_.clear ();
+	identifiers_.clear ();
+	searchIndex_.clear ();
+}
+
+
+Document* DocumentList::findDuplicate (Document const &doc)
+{
+	std::vector<std::string> const ids = documentIdentifiers (doc);
+	std::vector<std::string>::const_iterator id = ids.begin ();
+	for (; id != ids.end (); ++id) {
+		std::pair<IdentifierIndex::iterator, IdentifierIndex::iterator> range =
+			identifiers_.equal_range (*id);
+		IdentifierIndex::iterator it = range.first;
+		while (it != range.second) {
+			Document *other = docs_.lookup (it->second);
+			if (other == &doc) {
+				++it;
+				continue;
+			}
+
+			// Drop entries for documents which have gone or changed
+			if (other) {
+				std::vector<std::string> const otherIds = documentIdentifiers (*other);
+				if (std::find (otherIds.begin (), otherIds.end (), *id) != otherIds.end ())
+					return other;
+			}
+			it = identifiers_.erase (it);
+		}
+	}
+
+	return NULL;
+}
+
+
+Document* DocumentList::resolveDuplicate (Document *doc, DuplicatePolicy policy)
+{
+	// Whatever set the identifiers may have gone around setField()
+	addIdentifiers (*doc);
+
+	Document *original = findDuplicate (*doc);
+	if (!original || policy == DUPLICATES_FLAG)
+		return original;
+
+	DEBUG ("'%1' duplicates '%2'", doc->getKey (), original->getKey ());
+	if (policy == DUPLICATES_MERGE)
+		mergeDoc (original, doc);
+	else
+		removeDoc (doc);
+
+	return original;
+}
+
+
+void DocumentList::mergeDoc (Document *into, Document *from)
+{
+	into->getBibData ().mergeIn (from->getBibData ());
+	addIdentifiers (*into);
+
+	std::vector<int> const &tags = from->getTags ();
+	std::vector<int>::const_iterator tag = tags.begin ();
+	for (; tag != tags.end (); ++tag)
+		into->setTag (*tag);
+
+	Glib::ustring const filename = from->getFileName ();
+	removeDoc (from);
+
+	// A copy of a document without its file brings the file along
+	if (into->getFileName ().empty () && !filename.empty ())
+		into->setFileName (filename);
+}
+
+
+Document* DocumentList::findByFileName (Glib::ustring const &filename)
+{
+	FileIndex::iterator const it = files_.find (normalizedFileName (filename));
+	if (it == files_.end ())
+		return NULL;
+
+	return it->second;
+}
+
+
+Document* DocumentList::newDocWithFile (Glib::ustring const &filename)
+{
+	if (findByFileName (filename))
+		return NULL;
+
+	Document &newdoc = docs_.emplace (filename);
+	adoptDoc (newdoc);
+	return &newdoc;
 }
 
 
 Document* DocumentList::newDocUnnamed ()
 {
-	Document newdoc;
-	docs_.push_back(newdoc);
-	return &(docs_.back());
+	Document &newdoc = docs_.emplace ();
+	adoptDoc (newdoc);
+	return &newdoc;
 }
 
 Glib::ustring DocumentList::sanitizedKey (
@@ -75,21 +496,40 @@ Glib::ustring DocumentList::uniqueKey (
 
 /**
  * Return a key mangled to be unique with respect to
- * all documents except 'exclusion'
+ * all documents except 'exclusion'. The lowest free
+ * suffix is used, as if they were tried in turn.
  */
 Glib::ustring DocumentList::uniqueKey (
 	Glib::ustring const &basename,
 	Document const *exclusion)
 {
+	if (!docExists (basename, exclusion))
+		return basename;
+
 	std::ostringstream name;
-	int extension = -1;
-	do {
-		++extension;
-		name.str ("") ;
-		name << basename;
-		if (extension)
-			name << "-" << extension;
-	} while (docExists(name.str(), exclusion));
+	SuffixHints::iterator hint = suffixHints_.find (basename.raw ());
+	int extension = hint == suffixHints_.end () ? 1 : hint->second;
+
+	// The exclusion's own key is free as far as it is concerned, even
+	// below the hint
+	std::string stem;
+	int const excluded = exclusion ? keySuffix (exclusion->getKey ().raw (), stem) : 0;
+	if (excluded && excluded < extension && stem == basename.raw ()) {
+		name << basename << "-" << excluded;
+		if (!docExists (name.str (), exclusion))
+			return name.str ();
+	}
+
+	for (;; ++extension) {
+		name.str ("");
+		name << basename << "-" << extension;
+		if (!docExists (name.str (), exclusion))
+			break;
+	}
+
+	// Every suffix tried was taken by some document, so this holds
+	// whether or not the caller goes on to use the key
+	suffixHints_[basename.raw ()] = extension;
 
 	return name.str();
 }
@@ -99,29 +539,97 @@ bool DocumentList::docExists (
 	Glib::ustring const &name,
 	Document const *exclusion)
 {
-	Container::iterator it = docs_.begin ();
-	Container::iterator const end = docs_.end ();
-	for (; it != end; ++it) {
-		if ((&(*it)) != exclusion && (*it).getKey() == name)
-			return true;
-	}
+	KeyCounts::const_iterator const count = keyCounts_.find (name.raw ());
+	if (count == keyCounts_.end ())
+		return false;
 
-	return false;
+	if (exclusion && exclusion->list_.list == this && exclusion->getKey ().raw () == name.raw ())
+		return count->second > 1;
+
+	return true;
 }
 
 
 Document* DocumentList::newDocWithName (Glib::ustring const &key)
 {
-	Document newdoc;
+	Document &newdoc = docs_.emplace ();
+	adoptDoc (newdoc);
 	newdoc.setKey (key);
-	docs_.push_back(newdoc);
-	return &(docs_.back());
+	return &newdoc;
 }
 
 Document *DocumentList::insertDoc (Document const &doc)
 {
-	docs_.push_back(doc);
-	return &(docs_.back());
+	Document &newdoc = docs_.emplace (doc);
+	adoptDoc (newdoc);
+	return &newdoc;
+}
+
+
+Document *DocumentList::insertDoc (Document &&doc)
+{
+	Document &newdoc = docs_.emplace (std::move (doc));
+	if (!newdoc.thumbnail_)
+		newdoc.setupThumbnail ();
+	adoptDoc (newdoc);
+	return &newdoc;
+}
+
+
+std::vector<Document*> DocumentList::adoptDocs (std::vector<Document> &docs)
+{
+	docs_.reserve (docs.size ());
+
+	std::vector<Document*> added;
+	added.reserve (docs.size ());
+	std::vector<Document>::iterator it = docs.begin ();
+	for (; it != docs.end (); ++it) {
+		Document &newdoc = docs_.emplace (std::move (*it));
+		// As a copy into the list would have
+		if (!newdoc.thumbnail_)
+			newdoc.setupThumbnail ();
+		adoptDoc (newdoc);
+		added.push_back (&newdoc);
+	}
+	docs.clear ();
+
+	return added;
+}
+
+
+std::vector<Document*> DocumentList::insertDocs (std::vector<Document> &&docs)
+{
+	std::vector<Document*> const added = adoptDocs (docs);
+	docsadded_.emit (added);
+	return added;
+}
+
+
+void DocumentList::appendDocs (Container &docs)
+{
+	std::vector<Document*> adopted;
+	adopted.reserve (docs.size ());
+	Container::iterator it = docs.begin ();
+	Container::iterator const end = docs.end ();
+	for (; it != end; ++it) {
+		adoptDoc (*it);
+		adopted.push_back (&*it);
+	}
+
+	docs_.splice (docs);
+
+	// Only now do they have handles in this list
+	std::vector<Document*>::iterator doc = adopted.begin ();
+	for (; doc != adopted.end (); ++doc)
+		addIdentifiers (**doc);
+}
+
+
+Document* DocumentList::loadDoc (xmlNodePtr docNode)
+{
+	Document &newdoc = docs_.emplace (docNode);
+	adoptDoc (newdoc);
+	return &newdoc;
 }
 
 
@@ -133,20 +641,17 @@ void DocumentList::loadDoc (
 	std::vector<int> const &taguids,
 	BibData const &bib)
 {
-	Document newdoc (filename, relfilename, notes, key, taguids, bib);
-	docs_.push_back(newdoc);
+	Document &newdoc = docs_.emplace (filename, relfilename, notes, key, taguids, bib);
+	adoptDoc (newdoc);
 }
 
 
 void DocumentList::removeDoc (Document * const addr)
 {
-	Container::iterator it = docs_.begin();
-	Container::iterator const end = docs_.end();
-	for (; it != end; it++) {
-		if (&(*it) == addr) {
-			docs_.erase(it);
-			return;
-		}
+	if (docs_.contains (addr)) {
+		releaseDoc (*addr);
+		docs_.erase (addr);
+		return;
 	}
 
 	DEBUG ("Warning: DocumentList::removeDoc: couldn't find '%1' to erase it", addr);
@@ -196,7 +701,9 @@ void DocumentList::writeXML (xmlTextWriterPtr writer)
 // Returns the number of references imported
 int DocumentList::importFromFile (
 	Glib::ustring const & filename,
-	BibUtils::Format format)
+	BibUtils::Format format,
+	DuplicatePolicy policy,
+	std::vector<Document*> *flagged)
 {
 	std::string rawtext;
 
@@ -257,14 +764,16 @@ int DocumentList::importFromFile (
 		DEBUG ("DocumentList::importFromFile: validated input as utf-8");
 	}
 
-	return import(utf8text, format);
+	return import(utf8text, format, policy, flagged);
 }
 
 
 // Returns the number of references imported
 int DocumentList::import (
 	Glib::ustring const & rawtext,
-	BibUtils::Format format)
+	BibUtils::Format format,
+	DuplicatePolicy policy,
+	std::vector<Document*> *flagged)
 {
 	if (format == BibUtils::FORMAT_UNKNOWN)
 		format = (BibUtils::Format) BIBL_BIBTEXIN;
@@ -288,10 +797,13 @@ int DocumentList::import (
 
 	// Make a copy to return after we free b	
 	int const nrefs = b.n;
-	
+
+	// Moved, along with their thumbnail requests, into the list
+	std::vector<Document> parsed;
+	parsed.reserve (nrefs);
 	for (int i = 0; i < nrefs; ++i) {
 		try {
-			docs_.push_back (BibUtils::parseBibUtils (b.ref[i]));
+			parsed.push_back (BibUtils::parseBibUtils (b.ref[i]));
 		} catch (Glib::Error& ex) {
 			BibUtils::bibl_free( &b );
 			Utility::exceptionDialog (&ex,
@@ -301,7 +813,34 @@ int DocumentList::import (
 	}
 
 	BibUtils::bibl_free( &b );
-	return nrefs;
+
+	std::vector<Document*> const inserted = adoptDocs (parsed);
+	std::vector<Document*> added;
+	std::vector<Document*> merged;
+	added.reserve (inserted.size ());
+	std::vector<Document*>::const_iterator it = inserted.begin ();
+	for (; it != inserted.end (); ++it) {
+		Document *original = resolveDuplicate (*it, policy);
+		if (!original || policy == DUPLICATES_FLAG) {
+			added.push_back (*it);
+			if (original && flagged) {
+				flagged->push_back (original);
+				flagged->push_back (*it);
+			}
+		} else if (policy == DUPLICATES_MERGE) {
+			merged.push_back (original);
+		}
+	}
+
+	int const skipped = nrefs - added.size () - merged.size ();
+	if (skipped)
+		DEBUG ("Skipped %1 duplicate references", skipped);
+
+	docsadded_.emit (added);
+	if (!merged.empty ())
+		docschanged_.emit (merged);
+
+	return nrefs - skipped;
 }
 
 
@@ -15,29 +15,204 @@
 
 #include <gtkmm.h>
 #include <sstream>
-#include <list>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <libxml/xmlwriter.h>
 
 #include "BibUtils.h"
 
 #include "Document.h"
+#include "DocumentSlab.h"
+#include "SearchIndex.h"
 
 
 
 class DocumentList {
 	public:
-	typedef std::list<Document> Container;
+	typedef DocumentSlab Container;
 
 	private:
 	Container docs_;
 
+	/*
+	 * How many documents have each key, and for each key stem the lowest
+	 * suffix uniqueKey() might still find free: every "stem-n" below it is
+	 * taken. Keyed by the raw bytes, as collating every lookup is slow.
+	 */
+	typedef std::unordered_map<std::string, unsigned int> KeyCounts;
+	KeyCounts keyCounts_;
+	typedef std::unordered_map<std::string, int> SuffixHints;
+	SuffixHints suffixHints_;
+	/*
+	 * Documents with a file, by their normalised URI
+	 */
+	typedef std::unordered_multimap<std::string, Document*> FileIndex;
+	FileIndex files_;
+	/*
+	 * Documents by their normalised DOI, arXiv id and PubMed id. Entries
+	 * are only added, as bibliographies can change behind the list's back
+	 * through Document::getBibData(): ones which no longer hold are dropped
+	 * when a lookup comes across them.
+	 */
+	typedef std::unordered_multimap<std::string, DocumentHandle> IdentifierIndex;
+	IdentifierIndex identifiers_;
+	/*
+	 * The tokens of every document's searchable text, which catches up
+	 * with edits when it is searched
+	 */
+	SearchIndex searchIndex_;
+
+	// Documents tell the list when their key or filename changes
+	friend class Document;
+	void addKey (Glib::ustring const &key);
+	void releaseKey (Glib::ustring const &key);
+	void addFileName (Document &doc);
+	void releaseFileName (Document &doc);
+	void addIdentifiers (Document &doc);
+	void releaseIdentifiers (Document &doc);
+	void adoptDoc (Document &doc);
+	void releaseDoc (Document &doc);
+	std::vector<Document*> adoptDocs (std::vector<Document> &docs);
+
+	sigc::signal<void, std::vector<Document*> const &> docsadded_;
+	sigc::signal<void, std::vector<Document*> const &> docschanged_;
+
+	/* Tells lists apart even once one has gone and another took its address */
+	guint32 serial_;
+	DocumentList (DocumentList const &);
+	DocumentList &operator= (DocumentList const &);
+
 	public:
+	/**
+	 * What to do with a document which shares an identifier with one
+	 * already in the list.
+	 */
+	enum DuplicatePolicy {
+		/* Keep the document that was there first, and drop the new one */
+		DUPLICATES_SKIP,
+		/* Merge the new one's bibliography into the existing document's */
+		DUPLICATES_MERGE,
+		/* Keep both, for the user to sort out */
+		DUPLICATES_FLAG
+	};
+
+	DocumentList ();
+	~DocumentList ();
+	guint32 getSerial () const {return serial_;}
+	/**
+	 * @return the list with the given serial, or NULL if it is gone.
+	 */
+	static DocumentList *findBySerial (guint32 serial);
+
 	Container& getDocs ();
 	int size () {return docs_.size();}
+	/**
+	 * The change feed: documents whose revision is later than
+	 * <c>revision</c>. Whatever wants to redo only what changed keeps
+	 * ChangeStamp::current() from when it last looked and asks for what
+	 * changed since. Removed documents aren't reported.
+	 */
+	std::vector<Document*> getChangedSince (guint64 revision);
+	/**
+	 * Clears the change masks of documents which haven't changed since
+	 * <c>revision</c>, once they are saved as they were then.
+	 */
+	void clearChanges (guint64 revision);
+	/**
+	 * The documents which match search box text, as
+	 * Document::matchesSearch() would, found from an index of the list
+	 * rather than by looking through every document.
+	 *
+	 * @return the matching documents, in no particular order.
+	 */
+	std::vector<Document*> search (Glib::ustring const &text);
+	/**
+	 * For searching off the main thread: bring the index up to date with
+	 * SearchIndex::refresh() on the main thread, then SearchIndex::find()
+	 * can run on a worker thread.
+	 */
+	SearchIndex &getSearchIndex () {return searchIndex_;}
+	/**
+	 * Whether a document in the list matches search box text, as
+	 * Document::matchesSearch() would, from the casefolded text the
+	 * index keeps for it.
+	 */
+	bool matchesSearch (Document *doc, Glib::ustring const &text)
+		{return searchIndex_.matches (docs_, doc, text);}
+	/**
+	 * Narrows down an earlier search: the documents of <c>within</c>,
+	 * which is what a search refined by <c>text</c> found, that match it.
+	 * See SearchIndex::refines().
+	 */
+	std::vector<Document*> search (
+		Glib::ustring const &text,
+		std::vector<Document*> const &within);
 	Document* newDocWithFile (Glib::ustring const &filename);
+	/**
+	 * Finds a document by its file's URI. URIs which differ only in how they
+	 * are escaped or in redundant path elements refer to the same file.
+	 *
+	 * @return NULL if no document has the file.
+	 */
+	Document* findByFileName (Glib::ustring const &filename);
+	/**
+	 * Finds another document in the list with the same DOI, arXiv id or
+	 * PubMed id as <c>doc</c>, which need not be in the list itself.
+	 *
+	 * @return NULL if there is none.
+	 */
+	Document* findDuplicate (Document const &doc);
+	/**
+	 * Deals with <c>doc</c>, a document in the list, according to
+	 * <c>policy</c> if it duplicates another one. Skipping or merging it
+	 * removes <c>doc</c> from the list.
+	 *
+	 * @return the document it duplicates, or NULL if it doesn't.
+	 */
+	Document* resolveDuplicate (Document *doc, DuplicatePolicy policy);
+	/**
+	 * Merges the bibliography and tags of <c>from</c> into <c>into</c>,
+	 * along with its file if <c>into</c> has none, and removes <c>from</c>.
+	 * Both must be in the list.
+	 */
+	void mergeDoc (Document *into, Document *from);
+	/**
+	 * Indexes the document's identifiers again, for when its bibliography
+	 * was changed directly rather than through Document::setField().
+	 */
+	void updateIdentifiers (Document &doc) {addIdentifiers (doc);}
 	Document* newDocWithName (Glib::ustring const &key);
 	Document* newDocUnnamed ();
 	Document* insertDoc (Document const &doc);
+	Document* insertDoc (Document &&doc);
+	/**
+	 * Moves a batch of documents into the list, and tells views about all
+	 * of them at once through the added signal.
+	 *
+	 * @return the documents as they are in the list.
+	 */
+	std::vector<Document*> insertDocs (std::vector<Document> &&docs);
+	/**
+	 * Emitted once for each batch of documents \ref insertDocs() or
+	 * \ref import() adds, but not for documents added one at a time.
+	 */
+	sigc::signal<void, std::vector<Document*> const &> &getDocsAddedSignal ()
+		{return docsadded_;}
+	/**
+	 * Emitted with the documents an import merged others into.
+	 */
+	sigc::signal<void, std::vector<Document*> const &> &getDocsChangedSignal ()
+		{return docschanged_;}
+	// Moves all of docs into the list without copying them
+	void appendDocs (Container &docs);
+	/**
+	 * A handle which can be held on to in place of a pointer to the document,
+	 * which must be in this list, and which \ref getDoc() turns back into
+	 * the document if it is still in the list.
+	 */
+	DocumentHandle getHandle (Document const *doc) const {return docs_.getHandle (doc);}
+	Document* getDoc (DocumentHandle const &handle) {return docs_.lookup (handle);}
 
 	bool docExists (
 		Glib::ustring const &name,
@@ -51,6 +226,11 @@ class DocumentList {
 		Glib::ustring const &key);
 
 	void removeDoc (Document* const addr);
+	/**
+	 * Adds a document read from a 'doc' element, without requesting its
+	 * thumbnail.
+	 */
+	Document* loadDoc (xmlNodePtr docNode);
 	void loadDoc (
 		Glib::ustring const &filename,
 		Glib::ustring const &relfilename,
@@ -61,10 +241,23 @@ class DocumentList {
 	void print ();
 	void clearTag (int uid);
 	void writeXML (xmlTextWriterPtr writer);
-	void clear () {docs_.clear ();}
+	void clear ();
 
-	int importFromFile (Glib::ustring const &filename, BibUtils::Format format);
-	int import (Glib::ustring const &rawtext, BibUtils::Format format);
+	int importFromFile (
+		Glib::ustring const &filename,
+		BibUtils::Format format,
+		DuplicatePolicy policy = DUPLICATES_FLAG,
+		std::vector<Document*> *flagged = NULL);
+	/**
+	 * Imports references, dealing with those which duplicate documents
+	 * already in the list according to <c>policy</c>. When flagging them,
+	 * both documents of each duplicate pair are added to <c>flagged</c>.
+	 */
+	int import (
+		Glib::ustring const &rawtext,
+		BibUtils::Format format,
+		DuplicatePolicy policy = DUPLICATES_FLAG,
+		std::vector<Document*> *flagged = NULL);
 	Document parseBibUtils (BibUtils::fields *ref);
 };
 
@@ -139,6 +139,28 @@ bool DocumentProperties::show (Document *doc)
 }
 
 
+class DocumentProperties::FieldLoader : public FieldVisitor {
+	public:
+	FieldLoader (DocumentProperties &dialog) : dialog_ (dialog) {}
+
+	bool visit (char const *key, char const *value)
+	{
+		FieldEntryMap::iterator const entry = dialog_.fieldEntries_.find (key);
+		if (entry != dialog_.fieldEntries_.end ()) {
+			entry->second->set_text (value);
+		} else {
+			Gtk::ListStore::iterator row = dialog_.extrafieldsstore_->append ();
+			(*row)[dialog_.extrakeycol_] = Glib::ustring (key);
+			(*row)[dialog_.extravalcol_] = Glib::ustring (value);
+		}
+		return true;
+	}
+
+	private:
+	DocumentProperties &dialog_;
+};
+
+
 void DocumentProperties::update (Document &doc)
 {
     DEBUG ("Setting uri '%1'", doc.getFileName());
@@ -172,21 +194,8 @@ void DocumentProperties::update (Document &doc)
 
 	extrafieldsstore_->clear ();
 
-	std::map<Glib::ustring, Glib::ustring> fields = doc.getFields();
-	std::map<Glib::ustring, Glib::ustring>::iterator field = fields.begin ();
-	std::map<Glib::ustring, Glib::ustring>::iterator const endField = fields.end ();
-	for (; field != endField; ++field) {
-		Glib::ustring const key = (*field).first;
-		Glib::ustring const value = (*field).second;
-
-		if (fieldEntries_.find(key) != fieldEntries_.end()) {
-			fieldEntries_[key]->set_text (value);
-		} else {
-			Gtk::ListStore::iterator row = extrafieldsstore_->append ();
-			(*row)[extrakeycol_] = key;
-			(*row)[extravalcol_] = value;
-		}
-	}
+	FieldLoader loader (*this);
+	doc.forEachField (loader);
 
 	updateSensitivity ();
 }
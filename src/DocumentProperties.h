@@ -60,6 +60,8 @@ class DocumentProperties {
 	Gtk::TreeModel::ColumnRecord cols_;
 	Glib::RefPtr< Gtk::ListStore > extrafieldsstore_;
 
+	/* Fills in the entries from each field of a document */
+	class FieldLoader;
 	void update (Document &doc);
 	void save (Document &doc);
 	void setupFields (Glib::ustring const &docType);
@@ -0,0 +1,212 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#include <algorithm>
+
+#include "Utility.h"
+
+#include "DocumentSlab.h"
+
+
+DocumentSlab::DocumentSlab ()
+	: size_ (0), head_ (none), tail_ (none), firstGeneration_ (0)
+{
+}
+
+
+DocumentSlab::~DocumentSlab ()
+{
+	clear ();
+}
+
+
+void DocumentSlab::grow (size_t chunks)
+{
+	guint32 const first = capacity ();
+	for (size_t i = 0; i < chunks; ++i) {
+		// Value-initialised, so every slot starts out free
+		Chunk *chunk = new Chunk ();
+		for (guint32 j = 0; j < chunkSize; ++j)
+			chunk->slots[j].generation = firstGeneration_;
+		chunks_.push_back (chunk);
+	}
+
+	// New slots go underneath any free ones, so that those are used first,
+	// and backwards, so that they fill up in order
+	std::vector<guint32> slots;
+	slots.reserve (capacity () - first);
+	for (guint32 index = capacity (); index > first; --index)
+		slots.push_back (index - 1);
+	free_.insert (free_.begin (), slots.begin (), slots.end ());
+}
+
+
+void DocumentSlab::reserve (size_t count)
+{
+	if (free_.size () < count)
+		grow ((count - free_.size () + chunkSize - 1) / chunkSize);
+}
+
+
+guint32 DocumentSlab::allocate ()
+{
+	if (free_.empty ())
+		grow (1);
+
+	guint32 const index = free_.back ();
+	free_.pop_back ();
+	return index;
+}
+
+
+void DocumentSlab::link (guint32 const index)
+{
+	Slot &slot = slotAt (index);
+	slot.prev = tail_;
+	slot.next = none;
+	if (tail_ == none)
+		head_ = index;
+	else
+		slotAt (tail_).next = index;
+	tail_ = index;
+}
+
+
+void DocumentSlab::unlink (guint32 const index)
+{
+	Slot &slot = slotAt (index);
+	if (slot.prev == none)
+		head_ = slot.next;
+	else
+		slotAt (slot.prev).next = slot.next;
+	if (slot.next == none)
+		tail_ = slot.prev;
+	else
+		slotAt (slot.next).prev = slot.prev;
+}
+
+
+void DocumentSlab::erase (Document *doc)
+{
+	if (!contains (doc)) {
+		DEBUG ("Warning: DocumentSlab::erase: %1 isn't in this slab", doc);
+		return;
+	}
+
+	guint32 const index = doc->list_.slot;
+	Slot &slot = slotAt (index);
+	doc->~Document ();
+	unlink (index);
+	slot.live = false;
+	// Outstanding handles to the slot are stale from now on
+	++slot.generation;
+	free_.push_back (index);
+	--size_;
+}
+
+
+void DocumentSlab::clear ()
+{
+	// Documents go in order, as a list's would
+	for (guint32 index = head_; index != none; index = slotAt (index).next)
+		at (index)->~Document ();
+
+	// The chunks go, so the slots made next must start past every
+	// generation handed out so far to keep old handles stale
+	std::vector<Chunk*>::iterator chunk = chunks_.begin ();
+	for (; chunk != chunks_.end (); ++chunk) {
+		for (guint32 i = 0; i < chunkSize; ++i)
+			firstGeneration_ = std::max (firstGeneration_, (*chunk)->slots[i].generation + 1);
+		delete *chunk;
+	}
+
+	chunks_.clear ();
+	free_.clear ();
+	size_ = 0;
+	head_ = none;
+	tail_ = none;
+}
+
+
+void DocumentSlab::splice (DocumentSlab &other)
+{
+	guint32 const offset = capacity ();
+	std::vector<Chunk*>::iterator chunk = other.chunks_.begin ();
+	for (; chunk != other.chunks_.end (); ++chunk) {
+		guint32 const first = capacity ();
+		chunks_.push_back (*chunk);
+		for (guint32 i = chunkSize; i > 0; --i) {
+			guint32 const index = first + i - 1;
+			Slot &slot = slotAt (index);
+			// Handles this slab made before a clear() may name the slot
+			slot.generation = std::max (slot.generation, firstGeneration_);
+			if (slot.live) {
+				at (index)->list_.slot = index;
+				if (slot.prev != none)
+					slot.prev += offset;
+				if (slot.next != none)
+					slot.next += offset;
+			} else {
+				free_.push_back (index);
+			}
+		}
+	}
+
+	// Other's documents follow this slab's own, in their order
+	if (other.head_ != none) {
+		guint32 const head = other.head_ + offset;
+		slotAt (head).prev = tail_;
+		if (tail_ == none)
+			head_ = head;
+		else
+			slotAt (tail_).next = head;
+		tail_ = other.tail_ + offset;
+	}
+	size_ += other.size_;
+
+	other.chunks_.clear ();
+	other.free_.clear ();
+	other.size_ = 0;
+	other.head_ = none;
+	other.tail_ = none;
+}
+
+
+bool DocumentSlab::contains (Document const *doc) const
+{
+	guint32 const index = doc->list_.slot;
+	return index < capacity ()
+		&& slotAt (index).live
+		&& reinterpret_cast<Document const*> (&slotAt (index).storage) == doc;
+}
+
+
+DocumentHandle DocumentSlab::getHandle (Document const *doc) const
+{
+	if (!contains (doc))
+		return DocumentHandle ();
+
+	guint32 const index = doc->list_.slot;
+	return DocumentHandle (index, slotAt (index).generation);
+}
+
+
+Document *DocumentSlab::lookup (DocumentHandle const &handle)
+{
+	if (handle.index >= capacity ())
+		return NULL;
+
+	Slot const &slot = slotAt (handle.index);
+	if (!slot.live || slot.generation != handle.generation)
+		return NULL;
+
+	return at (handle.index);
+}
@@ -0,0 +1,183 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#ifndef DOCUMENTSLAB_H
+#define DOCUMENTSLAB_H
+
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <glib.h>
+
+#include "Document.h"
+
+/**
+ * Names a document in a \ref DocumentSlab for as long as it is there. Unlike
+ * a pointer, a handle to a document which has since been removed can be told
+ * apart, as the slot it names has moved on to a later generation.
+ */
+struct DocumentHandle {
+	guint32 index;
+	guint32 generation;
+
+	DocumentHandle () : index (G_MAXUINT32), generation (0) {}
+	DocumentHandle (guint32 index_, guint32 generation_)
+		: index (index_), generation (generation_) {}
+
+	bool isNull () const {return index == G_MAXUINT32;}
+	bool operator== (DocumentHandle const &other) const
+		{return index == other.index && generation == other.generation;}
+	bool operator!= (DocumentHandle const &other) const
+		{return !(*this == other);}
+};
+
+/**
+ * <p>Storage for documents in fixed size chunks of slots. Documents never
+ * move once constructed, so pointers to them stay valid until they are
+ * erased, and they sit side by side in a chunk rather than each in a list
+ * node of its own.</p>
+ *
+ * <p>Each document knows its own slot, so erasing it and making a handle for
+ * it take constant time. The slots of erased documents are reused, but
+ * iterating visits documents in the order they were added, as a list does,
+ * so a document added after one is erased still comes last. The slots are
+ * linked in that order.</p>
+ */
+class DocumentSlab {
+	public:
+	static const guint32 chunkSize = 256;
+
+	DocumentSlab ();
+	~DocumentSlab ();
+
+	class iterator : public std::iterator<std::forward_iterator_tag, Document> {
+		public:
+		iterator () : slab_ (NULL), index_ (0) {}
+
+		Document &operator* () const {return *slab_->at (index_);}
+		Document *operator-> () const {return slab_->at (index_);}
+		iterator &operator++ () {index_ = slab_->slotAt (index_).next; return *this;}
+		iterator operator++ (int) {iterator old = *this; ++*this; return old;}
+		bool operator== (iterator const &other) const {return index_ == other.index_;}
+		bool operator!= (iterator const &other) const {return index_ != other.index_;}
+
+		private:
+		friend class DocumentSlab;
+		iterator (DocumentSlab *slab, guint32 index) : slab_ (slab), index_ (index) {}
+
+		DocumentSlab *slab_;
+		guint32 index_;
+	};
+
+	iterator begin () {return iterator (this, head_);}
+	iterator end () {return iterator (this, none);}
+	size_t size () const {return size_;}
+	bool empty () const {return size_ == 0;}
+	/**
+	 * Makes room for <c>count</c> more documents at once, rather than a
+	 * chunk at a time as they are added.
+	 */
+	void reserve (size_t count);
+
+	/**
+	 * Constructs a document in a free slot, from whatever arguments one of
+	 * Document's constructors takes.
+	 */
+	template <typename... Args>
+	Document &emplace (Args&&... args)
+	{
+		guint32 const index = allocate ();
+		Slot &slot = slotAt (index);
+		Document *doc;
+		try {
+			doc = new (&slot.storage) Document (std::forward<Args> (args)...);
+		} catch (...) {
+			free_.push_back (index);
+			throw;
+		}
+		doc->list_.slot = index;
+		slot.live = true;
+		link (index);
+		++size_;
+		return *doc;
+	}
+	/**
+	 * Destroys a document held by this slab.
+	 */
+	void erase (Document *doc);
+	/**
+	 * Destroys every document and frees the chunks. Handles to them stay
+	 * stale, as slots made afterwards start at a later generation.
+	 */
+	void clear ();
+	/**
+	 * Moves all of <c>other</c>'s documents into this slab, after its own
+	 * and without copying or moving any of them, leaving <c>other</c>
+	 * empty.
+	 */
+	void splice (DocumentSlab &other);
+
+	/**
+	 * True if <c>doc</c> is one of the documents held by this slab.
+	 */
+	bool contains (Document const *doc) const;
+	DocumentHandle getHandle (Document const *doc) const;
+	/**
+	 * @return the document the handle names, or NULL if it has been erased.
+	 */
+	Document *lookup (DocumentHandle const &handle);
+
+	private:
+	/* The index of no slot, which ends the order links */
+	static const guint32 none = G_MAXUINT32;
+
+	struct Slot {
+		std::aligned_storage<sizeof (Document), alignof (Document)>::type storage;
+		guint32 generation;
+		bool live;
+		/* The live slots before and after this one, in the order their
+		 * documents were added */
+		guint32 prev;
+		guint32 next;
+	};
+	struct Chunk {
+		Slot slots[chunkSize];
+	};
+
+	DocumentSlab (DocumentSlab const &);
+	DocumentSlab &operator= (DocumentSlab const &);
+
+	guint32 capacity () const {return chunks_.size () * chunkSize;}
+	Slot &slotAt (guint32 index) {return chunks_[index / chunkSize]->slots[index % chunkSize];}
+	Slot const &slotAt (guint32 index) const
+		{return chunks_[index / chunkSize]->slots[index % chunkSize];}
+	Document *at (guint32 index) {return reinterpret_cast<Document*> (&slotAt (index).storage);}
+	void grow (size_t chunks);
+	guint32 allocate ();
+	void link (guint32 index);
+	void unlink (guint32 index);
+
+	std::vector<Chunk*> chunks_;
+	/* Free slots, the next one to use last */
+	std::vector<guint32> free_;
+	size_t size_;
+	/* The first and last live slots, in order */
+	guint32 head_;
+	guint32 tail_;
+	/* What the generations of new slots start at: past that of every
+	 * slot this slab has let go of */
+	guint32 firstGeneration_;
+};
+
+#endif
@@ -8,7 +8,10 @@
  *
  */
 
+#include <algorithm>
 #include <iostream>
+#include <set>
+#include <unordered_set>
 
 #include <gtk/gtk.h>
 #include <gtkmm.h>
@@ -17,6 +20,7 @@
 #include <giomm/fileinfo.h>
 #include <giomm/error.h>
 
+#include "ChangeStamp.h"
 #include "Document.h"
 #include "DocumentList.h"
 #include "Library.h"
@@ -111,6 +115,7 @@ void DocumentView::doEditTagsDialog(Document *doc) {
 
 DocumentView::~DocumentView ()
 {
+	cancelSearch ();
 }
 
 
@@ -145,8 +150,11 @@ DocumentView::DocumentView (
 	Library &lib,
 	bool const uselistview)
 	
- : win_ (refwin), lib_(lib)
+ : win_ (refwin), lib_(lib),
+   searchJob_ (NULL), searchGeneration_ (0)
 {
+	searchDone_.connect (sigc::mem_fun (*this, &DocumentView::onSearchDone));
+
 	hoverdoc_ = NULL;
 	ignoreSelectionChanged_ = false;
 
@@ -212,6 +220,9 @@ DocumentView::DocumentView (
 		NULL);
 	
 	icons->add_events (Gdk::ALL_EVENTS_MASK);
+	// Fills in the tooltip column on demand, so must run first
+	icons->signal_query_tooltip().connect (
+		sigc::mem_fun (*this, &DocumentView::onIconsQueryTooltip), false);
 	// Nasty, gtkmm doesn't have a binding for passing the column object
 	icons->set_tooltip_column (3);
 	icons->signal_item_activated().connect (
@@ -768,6 +779,66 @@ void DocumentView::docActivated (const Gtk::TreeModel::Path& path)
 }
 
 
+namespace {
+
+class TooltipWriter : public FieldVisitor {
+	public:
+	TooltipWriter (Glib::ustring &text) : text_ (text) {}
+
+	bool visit (char const *name, char const *value)
+	{
+		Glib::ustring const full (value);
+		text_ += "\n";
+		text_ += Glib::Markup::escape_text (name);
+		text_ += ": ";
+		text_ += Glib::Markup::escape_text (full.substr(0,64));
+		if (full.size() > 64)
+			text_ += "...";
+		return true;
+	}
+
+	private:
+	Glib::ustring &text_;
+};
+
+}
+
+
+Glib::ustring DocumentView::tooltipText (Document *doc)
+{
+	Glib::ustring tooltipText =
+		String::ucompose(
+				"<b>%1</b>\n",
+				Glib::Markup::escape_text(doc->getKey()));
+
+	TooltipWriter writer (tooltipText);
+	doc->forEachField (writer);
+
+	return tooltipText;
+}
+
+
+bool DocumentView::onIconsQueryTooltip (
+	int x, int y, bool keyboardTooltip,
+	Glib::RefPtr<Gtk::Tooltip> const &tooltip)
+{
+	Gtk::TreeModel::iterator sortIter;
+	if (!docsiconview_->get_tooltip_context_iter (x, y, keyboardTooltip, sortIter))
+		return false;
+
+	Gtk::TreeModel::iterator filterIter =
+		docstoresort_->convert_iter_to_child_iter (sortIter);
+	Gtk::TreeModel::iterator iter =
+		docstorefilter_->convert_iter_to_child_iter (filterIter);
+
+	if (Glib::ustring ((*iter)[doctooltipcol_]).empty ())
+		(*iter)[doctooltipcol_] = tooltipText ((*iter)[docpointercol_]);
+
+	// Leave showing it to the tooltip column
+	return false;
+}
+
+
 /*
  * Populate a row in docstore_ from a Document
  */
@@ -778,29 +849,12 @@ void DocumentView::loadRow (
 	(*item)[docpointercol_] = doc;
 	(*item)[dockeycol_] = doc->getKey();
 	(*item)[docthumbnailcol_] = doc->getThumbnail();
-	(*item)[doctitlecol_] = doc->getBibData().getTitle ();
-	(*item)[docauthorscol_] = doc->getBibData().getAuthors ();
-	(*item)[docyearcol_] = doc->getBibData().getYear ();
-
-	Glib::ustring tooltipText =
-		String::ucompose(
-				"<b>%1</b>\n",
-				Glib::Markup::escape_text(doc->getKey()));
+	(*item)[doctitlecol_] = doc->getCoreBibData().getTitle ();
+	(*item)[docauthorscol_] = doc->getCoreBibData().getAuthors ();
+	(*item)[docyearcol_] = doc->getCoreBibData().getYear ();
 
-	typedef std::map <Glib::ustring, Glib::ustring> StringMap;
-	StringMap fields = doc->getFields ();
-	StringMap::iterator fieldIter = fields.begin();
-	StringMap::iterator const fieldEnd = fields.end();
-	for (; fieldIter != fieldEnd; ++fieldIter) {
-		tooltipText += "\n";
-		tooltipText += Glib::Markup::escape_text (fieldIter->first);
-		tooltipText += ": ";
-		tooltipText += Glib::Markup::escape_text (fieldIter->second.substr(0,64));
-		if (fieldIter->second.size() > 64)
-			tooltipText += "...";
-	}
-
-	(*item)[doctooltipcol_] = tooltipText;
+	// Built when first hovered, as it needs all of the document's fields
+	(*item)[doctooltipcol_] = "";
 	(*item)[docvisiblecol_] = isVisible (doc);
 
 	Glib::ustring title = Utility::wrap (doc->getField ("title"), 35, 1, false);
@@ -844,39 +898,135 @@ void DocumentView::loadRow (
 		align);
 }
 
+namespace {
+
 /*
- * Return whether a document matches searches and tag filters
+ * Return whether a document has the tags the filter asks for
  */
 
-bool DocumentView::isVisible (Document * const doc)
+bool matchesTags (Document * const doc, std::vector<int> const &filtertags)
 {
-	Glib::ustring const searchtext = searchentry_->get_text ();
-	bool const search = !searchtext.empty ();
-
-	bool visible = true;
-	for (std::vector<int>::iterator tagit = win_.filtertags_.begin();
-	     tagit != win_.filtertags_.end(); ++tagit) {
+	for (std::vector<int>::const_iterator tagit = filtertags.begin();
+	     tagit != filtertags.end(); ++tagit) {
 		if (!(*tagit == ALL_TAGS_UID
 		    || (*tagit == NO_TAGS_UID && doc->getTags().empty())
 		    || doc->hasTag(*tagit))) {
 		    	// A tag is selected that we do not match
-			visible = false;
-			break;
+			return false;
 		}
 	}
 
-	if (search && visible) {
-		if (!doc->matchesSearch (searchtext))
-			visible = false;
-	}
-	
 	/*
 	 * TODO iterate over taggerUris 
 	 */
 	 
+	return true;
+}
+
+}
+
+/*
+ * Return whether a document matches searches and tag filters
+ */
+
+bool DocumentView::isVisible (Document * const doc)
+{
+	Glib::ustring const searchtext = searchentry_->get_text ();
+	bool const search = !searchtext.empty ();
+
+	bool visible = matchesTags (doc, win_.filtertags_);
+
+	if (search && visible) {
+		if (!lib_.getDocList()->matchesSearch (doc, searchtext))
+			visible = false;
+	}
+
 	return visible;
 }
 
+/*
+ * What an earlier search for the same terms found, moved to the back as
+ * the latest, or NULL if none is remembered
+ */
+std::vector<Document*> const *DocumentView::recallSearch (std::vector<std::string> const &terms)
+{
+	// Documents may have changed since
+	if (!searchHistory_.empty () && searchHistory_.back ().revision != ChangeStamp::current ())
+		searchHistory_.clear ();
+
+	std::deque<SearchResult>::iterator it = searchHistory_.begin ();
+	for (; it != searchHistory_.end (); ++it) {
+		if (it->terms == terms) {
+			SearchResult result (std::move (*it));
+			searchHistory_.erase (it);
+			return &rememberSearch (std::move (result));
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * What the remembered search which the terms refine, and which found the
+ * fewest, found, or NULL if they refine none
+ */
+std::vector<Document*> const *DocumentView::narrowestSearch (std::vector<std::string> const &terms)
+{
+	std::deque<SearchResult>::const_iterator narrowest = searchHistory_.end ();
+	std::deque<SearchResult>::const_iterator it = searchHistory_.begin ();
+	for (; it != searchHistory_.end (); ++it) {
+		if (SearchIndex::refines (terms, it->terms)
+		    && (narrowest == searchHistory_.end ()
+		        || it->matches.size () < narrowest->matches.size ()))
+			narrowest = it;
+	}
+
+	return narrowest != searchHistory_.end () ? &narrowest->matches : NULL;
+}
+
+std::vector<Document*> const &DocumentView::rememberSearch (SearchResult &&result)
+{
+	static size_t const historySize = 8;
+
+	searchHistory_.push_back (std::move (result));
+	if (searchHistory_.size () > historySize)
+		searchHistory_.pop_front ();
+	return searchHistory_.back ().matches;
+}
+
+/*
+ * For when documents come or go: searches that are remembered or under
+ * way may name documents which are gone
+ */
+void DocumentView::forgetSearches ()
+{
+	searchHistory_.clear ();
+	++searchGeneration_;
+}
+
+/*
+ * The documents which match the search text, narrowed down from what an
+ * earlier search found where the text refines it
+ */
+std::vector<Document*> const &DocumentView::findMatches (Glib::ustring const &searchtext)
+{
+	std::vector<std::string> const terms = SearchIndex::splitTerms (searchtext);
+	std::vector<Document*> const *recalled = recallSearch (terms);
+	if (recalled)
+		return *recalled;
+
+	SearchResult result;
+	result.terms = terms;
+	result.revision = ChangeStamp::current ();
+	std::vector<Document*> const *narrowest = narrowestSearch (terms);
+	if (narrowest)
+		result.matches = lib_.getDocList()->search (searchtext, *narrowest);
+	else
+		result.matches = lib_.getDocList()->search (searchtext);
+
+	return rememberSearch (std::move (result));
+}
+
 /*
  * Update the visibility of all rows
  *
@@ -890,12 +1040,44 @@ bool DocumentView::isVisible (Document * const doc)
  */
 void DocumentView::updateVisible ()
 {
+	// Searches right away, rather than once typing pauses
+	cancelSearch ();
+	setSearching (false);
+
+	Glib::ustring const searchtext = searchentry_->get_text ();
+	if (searchtext.empty ())
+		showMatches (NULL);
+	else
+		showMatches (&findMatches (searchtext));
+}
+
+/*
+ * Shows the rows of documents with the filter's tags which are among
+ * found, or all of them if it is NULL, and hides the rest
+ */
+void DocumentView::showMatches (std::vector<Document*> const *found)
+{
+	bool const search = found != NULL;
+
+	// The list's index finds the matches, rather than each row searching
+	std::unordered_set<Document const*> matches;
+	if (search)
+		matches.insert (found->begin (), found->end ());
+
+	// Only rows which change are written, so the models on top of the
+	// store only hear about those. Working out the rest is a lookup in
+	// matches and a look at the tags, too little to hand out to threads.
+	std::vector<int> const &filtertags = win_.filtertags_;
 	ignoreSelectionChanged_ = true;
 	Gtk::TreeModel::iterator item = docstore_->children().begin();
 	Gtk::TreeModel::iterator const end = docstore_->children().end();
 	for (; item != end; ++item) {
 		Document * const doc = (*item)[docpointercol_];
-		(*item)[docvisiblecol_] = isVisible (doc);
+		bool const wasVisible = (*item)[docvisiblecol_];
+		bool const visible =
+			(!search || matches.count (doc)) && matchesTags (doc, filtertags);
+		if (visible != wasVisible)
+			(*item)[docvisiblecol_] = visible;
 	}
 	ignoreSelectionChanged_ = false;
 
@@ -934,6 +1116,7 @@ void DocumentView::updateDoc (Document * const doc)
 	for (; item != end; ++item) {
 		if ((*item)[docpointercol_] == doc) {
 			loadRow (item, doc);
+			docchangedsignal_.emit (doc);
 			return;
 		}
 	}
@@ -942,11 +1125,35 @@ void DocumentView::updateDoc (Document * const doc)
 }
 
 
+/*
+ * Optimisation: O(N), once for the lot
+ */
+void DocumentView::updateDocs (std::vector<Document*> const &docs)
+{
+	std::set<Document*> remaining (docs.begin (), docs.end ());
+
+	Gtk::TreeModel::iterator item = docstore_->children().begin();
+	Gtk::TreeModel::iterator const end = docstore_->children().end();
+	for (; item != end && !remaining.empty (); ++item) {
+		Document *doc = (*item)[docpointercol_];
+		if (remaining.erase (doc)) {
+			loadRow (item, doc);
+			docchangedsignal_.emit (doc);
+		}
+	}
+
+	if (!remaining.empty ())
+		DEBUG ("DocumentView::updateDocs: Warning: %1 docs not found",
+			remaining.size ());
+}
+
+
 /*
  * Remove the row with docpointercol_ == doc from docstore_
  */
 void DocumentView::removeDoc (Document * const doc)
 {
+	forgetSearches ();
 	bool found = false;
 
 	ignoreSelectionChanged_ = true;
@@ -971,10 +1178,9 @@ void DocumentView::removeDoc (Document * const doc)
  */
 void DocumentView::addDoc (Document * doc, bool userTriggered)
 {
-	doc->setView(this);
-
-	Gtk::TreeModel::iterator item = docstore_->append();
-	loadRow (item, doc);
+	forgetSearches ();
+	Gtk::TreeModel::iterator item = appendRow (doc);
+	docchangedsignal_.emit (doc);
   
 	if (userTriggered) {
 		Gtk::TreeModel::Path path =
@@ -993,6 +1199,41 @@ void DocumentView::addDoc (Document * doc, bool userTriggered)
 }
 
 
+/*
+ * Append a row for a document without telling anybody
+ */
+Gtk::TreeModel::iterator DocumentView::appendRow (Document *doc)
+{
+	doc->setView(this);
+
+	Gtk::TreeModel::iterator item = docstore_->append();
+	loadRow (item, doc);
+	return item;
+}
+
+
+/*
+ * Append rows for a batch of documents added to the list, leaving the
+ * selection alone, and tell listeners about them all at once
+ */
+void DocumentView::addDocs (std::vector<Document*> const &docs)
+{
+	if (docs.empty ())
+		return;
+
+	forgetSearches ();
+	ignoreSelectionChanged_ = true;
+	std::vector<Document*>::const_iterator it = docs.begin ();
+	for (; it != docs.end (); ++it)
+		appendRow (*it);
+	ignoreSelectionChanged_ = false;
+	docsaddedsignal_.emit (docs);
+
+	win_.actiongroup_->get_action("ExportBibtex")
+		->set_sensitive (lib_.getDocList()->size() > 0);
+}
+
+
 /*
  * Please, please populate tags etc before calling this with 
  * a tag-related handler connected to the selectionchanged
@@ -1002,6 +1243,16 @@ void DocumentView::populateDocStore ()
 {
 	//DEBUG ("RefWindow::populateDocStore >>");
 	ignoreSelectionChanged_ = true;
+	cancelSearch ();
+	forgetSearches ();
+
+	// The library may have swapped in a different list since last time
+	docsaddedconnection_.disconnect ();
+	docschangedconnection_.disconnect ();
+	docsaddedconnection_ = lib_.getDocList()->getDocsAddedSignal ().connect (
+		sigc::mem_fun (*this, &DocumentView::addDocs));
+	docschangedconnection_ = lib_.getDocList()->getDocsChangedSignal ().connect (
+		sigc::mem_fun (*this, &DocumentView::updateDocs));
 
 	/* XXX not the only one any more! */
 	// This is our notification that something about the documentlist
@@ -1028,9 +1279,13 @@ void DocumentView::populateDocStore ()
 	DocumentList::Container& docvec = lib_.getDocList()->getDocs();
 	DocumentList::Container::iterator docit = docvec.begin();
 	DocumentList::Container::iterator const docend = docvec.end();
+	std::vector<Document*> added;
+	added.reserve (docvec.size ());
 	for (; docit != docend; ++docit) {
-		addDoc (&(*docit), false);
+		appendRow (&(*docit));
+		added.push_back (&(*docit));
 	}
+	docsaddedsignal_.emit (added);
 
 	// Restore initial selection
 	if (uselistview_) {
@@ -1051,13 +1306,178 @@ void DocumentView::populateDocStore ()
  */
 void DocumentView::clear ()
 {
+	cancelSearch ();
 	docstore_->clear ();
+	forgetSearches ();
 }
 
 
+/**
+ * A search run on a worker thread, for terms and among candidates taken
+ * on the main thread. The thread first indexes what changed, as collected
+ * on the main thread.
+ */
+struct DocumentView::SearchJob {
+	SearchJob ()
+		: thread (NULL), index (NULL), collected (false), caughtUp (false),
+		  revision (0), generation (0), narrowing (false), cancelled (0),
+		  finished (0) {}
+
+	Glib::Threads::Thread *thread;
+	SearchIndex *index;
+	/* What the index is behind on, if anything */
+	bool collected;
+	SearchIndex::Changes changes;
+	/* Set once the changes have been applied in full */
+	bool caughtUp;
+	std::vector<std::string> terms;
+	/* ChangeStamp::current() when it started */
+	guint64 revision;
+	guint32 generation;
+	/* Only within can match: handles, as the documents may go meanwhile */
+	bool narrowing;
+	std::vector<DocumentHandle> within;
+	gint cancelled;
+	gint finished;
+
+	std::vector<Document*> matches;
+};
+
+
 void DocumentView::onSearchChanged ()
 {
-	updateVisible ();
+	// Whatever is being searched for is out of date
+	cancelSearch ();
+
+	// Small libraries are searched at each keystroke, as they always were.
+	// Bigger ones wait for a pause in typing, longer the more there is.
+	int const delay = std::min (lib_.getDocList()->size () / 1000, 250);
+	if (!delay) {
+		updateVisible ();
+		return;
+	}
+
+	setSearching (true);
+	searchTimeout_ = Glib::signal_timeout ().connect (
+		sigc::mem_fun (*this, &DocumentView::startSearch), delay);
+}
+
+
+bool DocumentView::startSearch ()
+{
+	std::vector<std::string> terms =
+		SearchIndex::splitTerms (searchentry_->get_text ());
+	std::vector<Document*> const *recalled =
+		terms.empty () ? NULL : recallSearch (terms);
+	if (terms.empty () || recalled) {
+		setSearching (false);
+		showMatches (recalled);
+		return false;
+	}
+
+	// Only reading the documents has to happen here, indexing them doesn't
+	DocumentList *doclist = lib_.getDocList ();
+	SearchIndex &index = doclist->getSearchIndex ();
+	searchJob_ = new SearchJob ();
+	searchJob_->index = &index;
+	searchJob_->collected = index.collect (doclist->getDocs (), searchJob_->changes);
+	searchJob_->revision = ChangeStamp::current ();
+	searchJob_->generation = searchGeneration_;
+	std::vector<Document*> const *narrowest = narrowestSearch (terms);
+	if (narrowest) {
+		searchJob_->narrowing = true;
+		searchJob_->within.reserve (narrowest->size ());
+		std::vector<Document*>::const_iterator it = narrowest->begin ();
+		for (; it != narrowest->end (); ++it)
+			searchJob_->within.push_back (doclist->getHandle (*it));
+	}
+	searchJob_->terms.swap (terms);
+
+	try {
+		searchJob_->thread = Glib::Threads::Thread::create (
+			sigc::bind (sigc::mem_fun (*this, &DocumentView::runSearch), searchJob_));
+	} catch (Glib::Threads::ThreadError const &ex) {
+		DEBUG ("Couldn't start the search thread: %1", ex.what ());
+		runSearch (searchJob_);
+	}
+
+	// Just the once
+	return false;
+}
+
+
+void DocumentView::runSearch (SearchJob *job)
+{
+	if (job->collected)
+		job->caughtUp = job->index->apply (job->changes, &job->cancelled);
+	if (!job->collected || job->caughtUp)
+		job->matches = job->index->find (
+			job->terms, job->narrowing ? &job->within : NULL, &job->cancelled);
+	g_atomic_int_set (&job->finished, 1);
+	searchDone_.emit ();
+}
+
+
+void DocumentView::onSearchDone ()
+{
+	// A search that was cancelled has already been waited for, and its
+	// notification may arrive after another has started
+	if (!searchJob_ || !g_atomic_int_get (&searchJob_->finished))
+		return;
+
+	SearchJob *job = searchJob_;
+	searchJob_ = NULL;
+	if (job->thread)
+		job->thread->join ();
+	if (job->caughtUp)
+		job->index->caughtUp (job->changes);
+
+	if (job->generation != searchGeneration_) {
+		// Documents came or went meanwhile, so the matches may name ones
+		// which are gone
+		delete job;
+		startSearch ();
+		return;
+	}
+
+	setSearching (false);
+	if (job->revision == ChangeStamp::current ()) {
+		SearchResult result;
+		result.terms.swap (job->terms);
+		result.revision = job->revision;
+		result.matches.swap (job->matches);
+		showMatches (&rememberSearch (std::move (result)));
+	} else {
+		// Documents changed meanwhile: the matches are shown, as they would
+		// have been had the search been quicker, but not narrowed down later
+		showMatches (&job->matches);
+	}
+	delete job;
+}
+
+
+void DocumentView::cancelSearch ()
+{
+	searchTimeout_.disconnect ();
+	if (searchJob_) {
+		g_atomic_int_set (&searchJob_->cancelled, 1);
+		if (searchJob_->thread)
+			searchJob_->thread->join ();
+		// If it caught up before it stopped, the next search needn't
+		if (searchJob_->caughtUp)
+			searchJob_->index->caughtUp (searchJob_->changes);
+		DELETE_AND_NULL (searchJob_);
+	}
+}
+
+
+void DocumentView::setSearching (bool const searching)
+{
+	searchentry_->set_icon_from_icon_name (
+		searching ? "process-working-symbolic" : "edit-find-symbolic",
+		Gtk::ENTRY_ICON_PRIMARY);
+	searchentry_->set_icon_tooltip_text (
+		searching ? _("Searching...") : "", Gtk::ENTRY_ICON_PRIMARY);
 }
 
 
@@ -8,10 +8,14 @@
  *
  */
 
+#include <deque>
 #include <map>
+#include <string>
+#include <vector>
 
 #include <gtkmm.h>
 
+
 class Document;
 class Library;
 class Linker;
@@ -29,7 +33,14 @@ class DocumentView : public Gtk::VBox
 	void updateDoc (Document * const doc);
 	void removeDoc (Document * const doc);
 	void addDoc (Document * doc, bool userTriggered = true);
+	void addDocs (std::vector<Document*> const &docs);
+	void updateDocs (std::vector<Document*> const &docs);
 	void updateVisible ();
+	/**
+	 * Stops any search waiting for typing to pause or under way, as one
+	 * must be before the library's document list goes away.
+	 */
+	void cancelSearch ();
 	void clear ();
 
 	Document *getSelectedDoc ();
@@ -61,6 +72,13 @@ class DocumentView : public Gtk::VBox
 	
 	sigc::signal<void>& getSelectionChangedSignal ()
 		{return selectionchangedsignal_;}
+	/* Fired for each document added to the view or updated in it */
+	sigc::signal<void, Document*>& getDocChangedSignal ()
+		{return docchangedsignal_;}
+	/* Fired once for each batch of documents added to the view at once,
+	 * instead of the above */
+	sigc::signal<void, std::vector<Document*> const &>& getDocsAddedSignal ()
+		{return docsaddedsignal_;}
 	
 	// This is Gtk::Managed so when it gets packed that's it
 	Gtk::Entry &getSearchEntry ()
@@ -85,10 +103,50 @@ class DocumentView : public Gtk::VBox
 	/* The search box */
 	Gtk::Entry *searchentry_;
 	void onSearchChanged ();
+	/*
+	 * The last few searches and what they found, latest last. Typing more
+	 * of a search narrows down what the last one found, and deleting some
+	 * goes back to what an earlier one found. They only hold until anything
+	 * changes.
+	 */
+	struct SearchResult {
+		std::vector<std::string> terms;
+		guint64 revision;
+		std::vector<Document*> matches;
+	};
+	std::deque<SearchResult> searchHistory_;
+	std::vector<Document*> const *recallSearch (std::vector<std::string> const &terms);
+	std::vector<Document*> const *narrowestSearch (std::vector<std::string> const &terms);
+	std::vector<Document*> const &rememberSearch (SearchResult &&result);
+	void forgetSearches ();
+	std::vector<Document*> const &findMatches (Glib::ustring const &searchtext);
+	void showMatches (std::vector<Document*> const *found);
+	/*
+	 * Once typing pauses, searches run on a worker thread. Each keystroke
+	 * cancels the one under way.
+	 */
+	struct SearchJob;
+	SearchJob *searchJob_;
+	/* Counts forgetSearches(), to tell searches which started before */
+	guint32 searchGeneration_;
+	Glib::Dispatcher searchDone_;
+	sigc::connection searchTimeout_;
+	bool startSearch ();
+	void runSearch (SearchJob *job);
+	void onSearchDone ();
+	void setSearching (bool const searching);
+
+	Gtk::TreeModel::iterator appendRow (Document *doc);
 	friend void end_search (GPtrArray * out_array, GError * error, gpointer user_data);
 
 	/* Signal that we fire whenever selection changes in one of our views */
 	sigc::signal<void> selectionchangedsignal_;
+	sigc::signal<void, Document*> docchangedsignal_;
+	sigc::signal<void, std::vector<Document*> const &> docsaddedsignal_;
+
+	/* To the document list the store was populated from */
+	sigc::connection docsaddedconnection_;
+	sigc::connection docschangedconnection_;
 
 	/* This is the actual store */
 	Glib::RefPtr<Gtk::ListStore> docstore_;
@@ -140,6 +198,10 @@ class DocumentView : public Gtk::VBox
 	void loadRow (
 		Gtk::TreeModel::iterator item,
 		Document * const doc);
+	Glib::ustring tooltipText (Document *doc);
+	bool onIconsQueryTooltip (
+		int x, int y, bool keyboardTooltip,
+		Glib::RefPtr<Gtk::Tooltip> const &tooltip);
 
 	bool docClicked (GdkEventButton* event);
 
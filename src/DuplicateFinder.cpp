@@ -0,0 +1,542 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#include <algorithm>
+#include <string>
+#include <unordered_set>
+
+#include "Document.h"
+#include "DocumentList.h"
+#include "Library.h"
+#include "Utility.h"
+
+#include "DuplicateFinder.h"
+
+
+namespace {
+
+/* Pairs less similar than this aren't offered */
+double const threshold = 0.6;
+
+/* Buckets this full hold a common title, like "Introduction", rather than
+ * copies of one paper */
+size_t const maxBucket = 64;
+
+/* Characters in each title shingle */
+size_t const shingleLength = 4;
+
+guint64 const fnvOffset = 14695981039346656037ULL;
+guint64 const fnvPrime = 1099511628211ULL;
+
+guint64 hashBytes (char const *bytes, size_t length, guint64 hash = fnvOffset)
+{
+	for (size_t i = 0; i < length; ++i) {
+		hash ^= (unsigned char) bytes[i];
+		hash *= fnvPrime;
+	}
+	return hash;
+}
+
+
+/* The splitmix64 finaliser, which makes a family of hash functions out of
+ * one when applied to the hash plus a different constant for each */
+guint64 mix (guint64 x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+
+guint64 packHandle (DocumentHandle const &handle)
+{
+	return (guint64 (handle.index) << 32) | handle.generation;
+}
+
+
+/*
+ * Casefolded words, so that capitalisation and punctuation don't matter
+ */
+std::vector<std::string> words (Glib::ustring const &text)
+{
+	std::vector<std::string> result;
+	Glib::ustring word;
+	Glib::ustring const folded = text.casefold ();
+	Glib::ustring::const_iterator it = folded.begin ();
+	for (;; ++it) {
+		if (it != folded.end () && g_unichar_isalnum (*it)) {
+			word += *it;
+			continue;
+		}
+		if (!word.empty ())
+			result.push_back (word.raw ());
+		word.clear ();
+		if (it == folded.end ())
+			break;
+	}
+	return result;
+}
+
+
+/*
+ * Sorted and unique hashes of the title's character shingles and of the
+ * authors' names, leaving out initials. Empty for a document without a
+ * title, as authors alone don't make a duplicate.
+ */
+std::vector<guint64> shingles (Glib::ustring const &title, Glib::ustring const &authors)
+{
+	std::vector<guint64> result;
+
+	std::vector<std::string> const titleWords = words (Utility::removeLeadingArticle (title));
+	if (titleWords.empty ())
+		return result;
+
+	std::string text;
+	std::vector<std::string>::const_iterator word = titleWords.begin ();
+	for (; word != titleWords.end (); ++word) {
+		if (!text.empty ())
+			text += ' ';
+		text += *word;
+	}
+
+	if (text.size () <= shingleLength) {
+		result.push_back (hashBytes (text.c_str (), text.size ()));
+	} else {
+		for (size_t i = 0; i + shingleLength <= text.size (); ++i)
+			result.push_back (hashBytes (text.c_str () + i, shingleLength));
+	}
+
+	// Kept apart from title shingles by hashing a separator first
+	std::vector<std::string> const authorWords = words (authors);
+	for (word = authorWords.begin (); word != authorWords.end (); ++word) {
+		if (g_utf8_strlen (word->c_str (), -1) > 1 && *word != "and")
+			result.push_back (hashBytes (word->c_str (), word->size (), hashBytes ("\1", 1)));
+	}
+
+	std::sort (result.begin (), result.end ());
+	result.erase (std::unique (result.begin (), result.end ()), result.end ());
+	return result;
+}
+
+
+/*
+ * The MinHash signature of a set of shingles, as the keys of its bands
+ */
+void sign (std::vector<guint64> const &shingles, guint64 bandKeys[])
+{
+	unsigned int const hashes = DuplicateFinder::bands * DuplicateFinder::rows;
+	guint32 mins[hashes];
+	std::fill (mins, mins + hashes, G_MAXUINT32);
+
+	std::vector<guint64>::const_iterator shingle = shingles.begin ();
+	for (; shingle != shingles.end (); ++shingle) {
+		for (unsigned int i = 0; i < hashes; ++i) {
+			guint32 const value = mix (*shingle + (i + 1) * 0x9e3779b97f4a7c15ULL);
+			mins[i] = std::min (mins[i], value);
+		}
+	}
+
+	for (unsigned int band = 0; band < DuplicateFinder::bands; ++band) {
+		guint64 key = mix (band);
+		for (unsigned int row = 0; row < DuplicateFinder::rows; ++row)
+			key = mix (key ^ mins[band * DuplicateFinder::rows + row]);
+		bandKeys[band] = key;
+	}
+}
+
+
+guint64 textHash (Glib::ustring const &title, Glib::ustring const &authors)
+{
+	return hashBytes (authors.c_str (), authors.bytes (),
+		hashBytes (title.c_str (), title.bytes () + 1));
+}
+
+
+double jaccard (std::vector<guint64> const &a, std::vector<guint64> const &b)
+{
+	if (a.empty () || b.empty ())
+		return 0.0;
+
+	size_t common = 0;
+	std::vector<guint64>::const_iterator i = a.begin ();
+	std::vector<guint64>::const_iterator j = b.begin ();
+	while (i != a.end () && j != b.end ()) {
+		if (*i < *j) {
+			++i;
+		} else if (*j < *i) {
+			++j;
+		} else {
+			++common;
+			++i;
+			++j;
+		}
+	}
+
+	return double (common) / double (a.size () + b.size () - common);
+}
+
+
+std::vector<guint64> documentShingles (Document const &doc)
+{
+	BibData const &bib = doc.getCoreBibData ();
+	return shingles (bib.getTitle (), bib.getAuthors ());
+}
+
+
+bool moreSimilar (
+	DuplicateFinder::Candidate const &a,
+	DuplicateFinder::Candidate const &b)
+{
+	return a.similarity > b.similarity;
+}
+
+}
+
+
+/**
+ * A snapshot of every document's title and authors, taken on the main
+ * thread, and what the worker thread makes of them.
+ */
+struct DuplicateFinder::Job {
+	struct Item {
+		DocumentHandle handle;
+		Glib::ustring title;
+		Glib::ustring authors;
+	};
+
+	Job () : thread (NULL), listSerial (0), cancelled (0), finished (0) {}
+
+	std::vector<Item> items;
+	Glib::Threads::Thread *thread;
+	guint32 listSerial;
+	gint cancelled;
+	gint finished;
+
+	Signatures signatures;
+	Buckets buckets;
+	std::vector<Candidate> candidates;
+};
+
+
+DuplicateFinder::DuplicateFinder (Library &library)
+	: library_ (library), listSerial_ (0), job_ (NULL)
+{
+	jobDone_.connect (sigc::mem_fun (*this, &DuplicateFinder::onJobDone));
+}
+
+
+DuplicateFinder::~DuplicateFinder ()
+{
+	reset ();
+}
+
+
+bool DuplicateFinder::isReady () const
+{
+	return !job_ && listSerial_ && listSerial_ == library_.getDocList ()->getSerial ();
+}
+
+
+void DuplicateFinder::reset ()
+{
+	if (job_) {
+		g_atomic_int_set (&job_->cancelled, 1);
+		if (job_->thread)
+			job_->thread->join ();
+		DELETE_AND_NULL (job_);
+	}
+
+	listSerial_ = 0;
+	signatures_.clear ();
+	buckets_.clear ();
+	candidates_.clear ();
+	seen_.clear ();
+	pending_.clear ();
+}
+
+
+void DuplicateFinder::start ()
+{
+	if (job_ || isReady ())
+		return;
+
+	reset ();
+
+	DocumentList *doclist = library_.getDocList ();
+	job_ = new Job ();
+	job_->listSerial = doclist->getSerial ();
+	job_->items.reserve (doclist->size ());
+
+	// Only the core fields are read, so nothing gets unpacked
+	DocumentList::Container &docs = doclist->getDocs ();
+	DocumentList::Container::iterator it = docs.begin ();
+	DocumentList::Container::iterator const end = docs.end ();
+	for (; it != end; ++it) {
+		Job::Item item;
+		item.handle = doclist->getHandle (&*it);
+		item.title = it->getCoreBibData ().getTitle ();
+		item.authors = it->getCoreBibData ().getAuthors ();
+		job_->items.push_back (item);
+	}
+
+	try {
+		job_->thread = Glib::Threads::Thread::create (
+			sigc::bind (sigc::mem_fun (*this, &DuplicateFinder::runJob), job_));
+	} catch (Glib::Threads::ThreadError const &ex) {
+		DEBUG ("Couldn't start the duplicate finder thread: %1", ex.what ());
+		runJob (job_);
+	}
+}
+
+
+void DuplicateFinder::runJob (Job *job)
+{
+	std::vector<std::vector<guint64> > itemShingles (job->items.size ());
+	// Band keys to items, by index
+	std::unordered_multimap<guint64, size_t> buckets;
+
+	for (size_t i = 0; i < job->items.size (); ++i) {
+		if (g_atomic_int_get (&job->cancelled))
+			return;
+
+		Job::Item const &item = job->items[i];
+		itemShingles[i] = shingles (item.title, item.authors);
+		if (itemShingles[i].empty ())
+			continue;
+
+		Signature signature;
+		sign (itemShingles[i], signature.keys);
+		signature.text = textHash (item.title, item.authors);
+		job->signatures[packHandle (item.handle)] = signature;
+
+		for (unsigned int band = 0; band < bands; ++band) {
+			buckets.insert (std::make_pair (signature.keys[band], i));
+			job->buckets.insert (std::make_pair (signature.keys[band], item.handle));
+		}
+	}
+
+	// Compare documents which share a bucket, each pair only once
+	std::unordered_set<guint64> compared;
+	std::unordered_multimap<guint64, size_t>::const_iterator bucket = buckets.begin ();
+	while (bucket != buckets.end ()) {
+		if (g_atomic_int_get (&job->cancelled))
+			return;
+
+		std::pair<std::unordered_multimap<guint64, size_t>::const_iterator,
+			std::unordered_multimap<guint64, size_t>::const_iterator> const range =
+			buckets.equal_range (bucket->first);
+		bucket = range.second;
+		if (std::distance (range.first, range.second) > (std::ptrdiff_t) maxBucket)
+			continue;
+
+		std::unordered_multimap<guint64, size_t>::const_iterator a = range.first;
+		for (; a != range.second; ++a) {
+			std::unordered_multimap<guint64, size_t>::const_iterator b = a;
+			for (++b; b != range.second; ++b) {
+				size_t const first = std::min (a->second, b->second);
+				size_t const second = std::max (a->second, b->second);
+				if (first == second
+				    || !compared.insert (guint64 (first) * job->items.size () + second).second)
+					continue;
+
+				double const similarity = jaccard (itemShingles[first], itemShingles[second]);
+				if (similarity >= threshold) {
+					Candidate candidate;
+					candidate.first = job->items[first].handle;
+					candidate.second = job->items[second].handle;
+					candidate.similarity = similarity;
+					job->candidates.push_back (candidate);
+				}
+			}
+		}
+	}
+
+	g_atomic_int_set (&job->finished, 1);
+	jobDone_.emit ();
+}
+
+
+void DuplicateFinder::onJobDone ()
+{
+	// A job that was reset has already been waited for, and its
+	// notification may arrive after another job has started
+	if (!job_ || !g_atomic_int_get (&job_->finished))
+		return;
+
+	Job *job = job_;
+	job_ = NULL;
+	if (job->thread)
+		job->thread->join ();
+
+	listSerial_ = job->listSerial;
+	signatures_.swap (job->signatures);
+	buckets_.swap (job->buckets);
+	std::vector<Candidate>::const_iterator it = job->candidates.begin ();
+	for (; it != job->candidates.end (); ++it)
+		addCandidate (*it);
+	delete job;
+
+	DEBUG ("Signed %1 documents, found %2 possible duplicates",
+		signatures_.size (), candidates_.size ());
+
+	std::vector<DocumentHandle> pending;
+	pending.swap (pending_);
+	DocumentList *doclist = library_.getDocList ();
+	std::vector<DocumentHandle>::const_iterator handle = pending.begin ();
+	for (; handle != pending.end (); ++handle) {
+		Document *doc = doclist->getDoc (*handle);
+		if (doc)
+			update (doc);
+	}
+
+	changed_.emit ();
+}
+
+
+void DuplicateFinder::addCandidate (Candidate const &candidate)
+{
+	guint64 const first = packHandle (candidate.first);
+	guint64 const second = packHandle (candidate.second);
+	if (!seen_.insert (PairKey (std::min (first, second), std::max (first, second))).second)
+		return;
+
+	std::vector<Candidate>::iterator const pos = std::upper_bound (
+		candidates_.begin (), candidates_.end (), candidate, moreSimilar);
+	candidates_.insert (pos, candidate);
+}
+
+
+void DuplicateFinder::update (Document *doc)
+{
+	if (resign (doc))
+		changed_.emit ();
+}
+
+
+void DuplicateFinder::updateDocs (std::vector<Document*> const &docs)
+{
+	bool found = false;
+	std::vector<Document*>::const_iterator it = docs.begin ();
+	for (; it != docs.end (); ++it)
+		found |= resign (*it);
+
+	if (found)
+		changed_.emit ();
+}
+
+
+bool DuplicateFinder::resign (Document *doc)
+{
+	DocumentList *doclist = library_.getDocList ();
+	DocumentHandle const handle = doclist->getHandle (doc);
+	if (handle.isNull ())
+		return false;
+
+	if (job_) {
+		pending_.push_back (handle);
+		return false;
+	}
+	if (!isReady ())
+		return false;
+
+	BibData const &bib = doc->getCoreBibData ();
+	guint64 const key = packHandle (handle);
+	guint64 const text = textHash (bib.getTitle (), bib.getAuthors ());
+	Signatures::iterator old = signatures_.find (key);
+	if (old != signatures_.end () && old->second.text == text)
+		return false;
+
+	// Out of its old buckets
+	if (old != signatures_.end ()) {
+		for (unsigned int band = 0; band < bands; ++band) {
+			std::pair<Buckets::iterator, Buckets::iterator> range =
+				buckets_.equal_range (old->second.keys[band]);
+			for (Buckets::iterator it = range.first; it != range.second; ++it) {
+				if (it->second == handle) {
+					buckets_.erase (it);
+					break;
+				}
+			}
+		}
+		signatures_.erase (old);
+	}
+
+	std::vector<guint64> const docShingles = documentShingles (*doc);
+	if (docShingles.empty ())
+		return false;
+
+	Signature signature;
+	sign (docShingles, signature.keys);
+	signature.text = text;
+	signatures_[key] = signature;
+
+	bool found = false;
+	for (unsigned int band = 0; band < bands; ++band) {
+		std::pair<Buckets::iterator, Buckets::iterator> range =
+			buckets_.equal_range (signature.keys[band]);
+		if (std::distance (range.first, range.second) < (std::ptrdiff_t) maxBucket) {
+			Buckets::iterator it = range.first;
+			while (it != range.second) {
+				Document *other = doclist->getDoc (it->second);
+				if (!other) {
+					// Removed since it was signed
+					signatures_.erase (packHandle (it->second));
+					it = buckets_.erase (it);
+					continue;
+				}
+
+				double const similarity = jaccard (docShingles, documentShingles (*other));
+				if (similarity >= threshold) {
+					Candidate candidate;
+					candidate.first = it->second;
+					candidate.second = handle;
+					candidate.similarity = similarity;
+					addCandidate (candidate);
+					found = true;
+				}
+				++it;
+			}
+		}
+		buckets_.insert (std::make_pair (signature.keys[band], handle));
+	}
+
+	return found;
+}
+
+
+std::vector<DuplicateFinder::Candidate> DuplicateFinder::getCandidates ()
+{
+	if (listSerial_ && listSerial_ != library_.getDocList ()->getSerial ())
+		reset ();
+
+	DocumentList *doclist = library_.getDocList ();
+	std::vector<Candidate>::iterator it = candidates_.begin ();
+	while (it != candidates_.end ()) {
+		if (doclist->getDoc (it->first) && doclist->getDoc (it->second))
+			++it;
+		else
+			it = candidates_.erase (it);
+	}
+
+	return candidates_;
+}
+
+
+void DuplicateFinder::dismiss (Candidate const &candidate)
+{
+	std::vector<Candidate>::iterator it = candidates_.begin ();
+	for (; it != candidates_.end (); ++it) {
+		if (it->first == candidate.first && it->second == candidate.second) {
+			candidates_.erase (it);
+			return;
+		}
+	}
+}
@@ -0,0 +1,138 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#ifndef DUPLICATEFINDER_H
+#define DUPLICATEFINDER_H
+
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <glibmm/dispatcher.h>
+#include <glibmm/threads.h>
+#include <sigc++/sigc++.h>
+
+#include "DocumentSlab.h"
+
+class Document;
+class Library;
+
+/**
+ * <p>Finds documents which are probably the same paper, going by their
+ * titles and authors, without comparing every pair of documents.</p>
+ *
+ * <p>Each document's title and author surnames are casefolded and cut into
+ * shingles, which are summarised by a MinHash signature. Documents whose
+ * signatures agree on any band of rows share a bucket, and only documents
+ * sharing a bucket are compared, by the Jaccard similarity of their
+ * shingles.</p>
+ *
+ * <p>The whole library is signed on a worker thread by \ref start(). After
+ * that, \ref update() re-signs documents one at a time as they change.</p>
+ */
+class DuplicateFinder {
+	public:
+	struct Candidate {
+		DocumentHandle first;
+		DocumentHandle second;
+		/* Jaccard similarity of the two documents' shingles */
+		double similarity;
+	};
+
+	static const unsigned int bands = 8;
+	static const unsigned int rows = 4;
+
+	DuplicateFinder (Library &library);
+	~DuplicateFinder ();
+
+	/**
+	 * Starts signing every document in the library in the background, if
+	 * that isn't already done or under way. The changed signal is emitted
+	 * once it finishes.
+	 */
+	void start ();
+	bool isRunning () const {return job_ != NULL;}
+	/**
+	 * True once the library has been signed, after which candidates are
+	 * kept up to date.
+	 */
+	bool isReady () const;
+	/**
+	 * Forgets everything, for when another library is opened.
+	 */
+	void reset ();
+
+	/**
+	 * Re-signs a document which was added or changed. Does nothing until
+	 * \ref start() has been called.
+	 */
+	void update (Document *doc);
+	/**
+	 * Like \ref update(), for a batch of documents at once, which tells
+	 * listeners about new candidates once for the lot.
+	 */
+	void updateDocs (std::vector<Document*> const &docs);
+
+	/**
+	 * The pairs found so far, most similar first, leaving out any whose
+	 * documents have since been removed.
+	 */
+	std::vector<Candidate> getCandidates ();
+	/**
+	 * Drops a pair the user says is not a duplicate, so it isn't offered
+	 * again.
+	 */
+	void dismiss (Candidate const &candidate);
+
+	sigc::signal<void> &getChangedSignal () {return changed_;}
+
+	private:
+	/* What is indexed for each document */
+	struct Signature {
+		/* The key of each band */
+		guint64 keys[bands];
+		/* Of the text signed, to tell when it has changed */
+		guint64 text;
+	};
+	typedef std::unordered_map<guint64, Signature> Signatures;
+	/* Documents by band key */
+	typedef std::unordered_multimap<guint64, DocumentHandle> Buckets;
+	typedef std::pair<guint64, guint64> PairKey;
+
+	struct Job;
+	void runJob (Job *job);
+	void onJobDone ();
+	void addCandidate (Candidate const &candidate);
+	/* Does update()'s work, and says whether new candidates turned up */
+	bool resign (Document *doc);
+
+	DuplicateFinder (DuplicateFinder const &);
+	DuplicateFinder &operator= (DuplicateFinder const &);
+
+	Library &library_;
+	/* The document list which was signed */
+	guint32 listSerial_;
+
+	Signatures signatures_;
+	Buckets buckets_;
+	std::vector<Candidate> candidates_;
+	/* Pairs offered or dismissed already */
+	std::set<PairKey> seen_;
+	/* Documents which changed while the library was being signed */
+	std::vector<DocumentHandle> pending_;
+
+	Job *job_;
+	Glib::Dispatcher jobDone_;
+	sigc::signal<void> changed_;
+};
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#include <algorithm>
+#include <cstring>
+
+#include "FieldStore.h"
+
+
+namespace {
+
+/* By bytes, which is stable and needs no collation */
+bool idLess (Glib::ustring const *lhs, Glib::ustring const *rhs)
+{
+	return lhs != rhs && std::strcmp (lhs->c_str (), rhs->c_str ()) < 0;
+}
+
+}
+
+
+size_t FieldStore::lowerBound (Glib::ustring const *id) const
+{
+	return std::lower_bound (ids_.begin (), ids_.end (), id, idLess)
+		- ids_.begin ();
+}
+
+
+size_t FieldStore::indexOf (Glib::ustring const &key) const
+{
+	Glib::ustring const *id = StringPool::findFolded (key);
+	// Nothing folds like it, so it can't be here
+	if (!id)
+		return ids_.size ();
+
+	size_t const index = lowerBound (id);
+	if (index < ids_.size () && ids_[index] == id)
+		return index;
+	return ids_.size ();
+}
+
+
+FieldStore::iterator FieldStore::find (Glib::ustring const &key)
+{
+	return fields_.begin () + indexOf (key);
+}
+
+
+FieldStore::const_iterator FieldStore::find (Glib::ustring const &key) const
+{
+	return fields_.begin () + indexOf (key);
+}
+
+
+Glib::ustring &FieldStore::operator[] (Glib::ustring const &key)
+{
+	InternedString const name (key);
+	Glib::ustring const *id = StringPool::folded (&name.str ());
+
+	size_t const index = lowerBound (id);
+	if (index == ids_.size () || ids_[index] != id) {
+		ids_.insert (ids_.begin () + index, id);
+		fields_.insert (fields_.begin () + index,
+			value_type (name, Glib::ustring ()));
+	}
+
+	return fields_[index].second;
+}
+
+
+FieldStore::iterator FieldStore::erase (iterator it)
+{
+	ids_.erase (ids_.begin () + (it - fields_.begin ()));
+	return fields_.erase (it);
+}
@@ -0,0 +1,70 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#ifndef FIELDSTORE_H
+#define FIELDSTORE_H
+
+#include <utility>
+#include <vector>
+
+#include <glibmm/ustring.h>
+
+#include "StringPool.h"
+
+/**
+ * <p>Field names to values, with the names compared case-insensitively,
+ * for the extra fields of a \ref BibData.</p>
+ *
+ * <p>It looks like the std::map it replaces, but it is a vector sorted by
+ * the casefolds of the names, and those are pooled and looked up once per
+ * name, so finding a field only compares pointers and bytes and doesn't
+ * allocate.</p>
+ *
+ * <p>Each field keeps the spelling of the name it was first set with.
+ * Inserting or erasing a field invalidates iterators, as it would for a
+ * vector.</p>
+ */
+class FieldStore {
+	public:
+	typedef std::pair<InternedString, Glib::ustring> value_type;
+	typedef std::vector<value_type>::iterator iterator;
+	typedef std::vector<value_type>::const_iterator const_iterator;
+
+	iterator begin () {return fields_.begin ();}
+	iterator end () {return fields_.end ();}
+	const_iterator begin () const {return fields_.begin ();}
+	const_iterator end () const {return fields_.end ();}
+
+	bool empty () const {return fields_.empty ();}
+	size_t size () const {return fields_.size ();}
+	void clear () {fields_.clear (); ids_.clear ();}
+
+	iterator find (Glib::ustring const &key);
+	const_iterator find (Glib::ustring const &key) const;
+	/**
+	 * @return the value of the field, which is added empty if there is
+	 * none yet.
+	 */
+	Glib::ustring &operator[] (Glib::ustring const &key);
+	iterator erase (iterator it);
+
+	private:
+	/* Where the field with this folded name is, or would go */
+	size_t lowerBound (Glib::ustring const *id) const;
+	/* The index of the field with this folded name, or size () */
+	size_t indexOf (Glib::ustring const &key) const;
+
+	std::vector<value_type> fields_;
+	/* The pooled casefold of each field's name, in the same order */
+	std::vector<Glib::ustring const*> ids_;
+};
+
+#endif
@@ -7,7 +7,9 @@
  *
  */
 
+#include <algorithm>
 #include <iostream>
+#include <set>
 #include <cstring>
 
 #include "RefWindow.h"
@@ -15,13 +17,25 @@
 #include <glibmm/i18n.h>
 #include <libxml/xmlreader.h>
 #include <libxml/xmlwriter.h>
+#include <giomm/bufferedinputstream.h>
+#include <giomm/converterinputstream.h>
+#include <giomm/converteroutputstream.h>
 #include <giomm/fileinfo.h>
 #include <giomm/error.h>
+#include <giomm/zlibcompressor.h>
+#include <giomm/zlibdecompressor.h>
 
 #include "TagList.h"
+#include "ChangeStamp.h"
 #include "DocumentList.h"
+#include "LibraryCopy.h"
+#include "LibraryJournal.h"
+#include "LibrarySnapshot.h"
+#include "Preferences.h"
 #include "Progress.h"
+#include "StringPool.h"
 #include "Utility.h"
+#include "WorkQueue.h"
 
 #include "Library.h"
 
@@ -83,6 +97,28 @@ static int vfsWrite(void * context, const char * buffer, int len) {
     return in->write(buffer, len);
 }
 
+/**
+ * <p>Opens a 'reflib' file for reading. A gzip compressed reflib is recognised
+ * by its magic bytes and decompressed as it is read, so the uncompressed XML
+ * is never held in memory as a whole.</p>
+ */
+static Glib::RefPtr<Gio::InputStream> openReflib(Glib::RefPtr<Gio::File> libfile) {
+    Glib::RefPtr<Gio::BufferedInputStream> in =
+            Gio::BufferedInputStream::create(libfile->read());
+
+    // A short read just means the file is too small to be compressed
+    in->fill(2);
+    gsize available = 0;
+    guchar const *magic = static_cast<guchar const*>(in->peek_buffer(available));
+    if (available >= 2 && magic[0] == 0x1f && magic[1] == 0x8b) {
+        DEBUG("Reading compressed library");
+        return Gio::ConverterInputStream::create(in,
+                Gio::ZlibDecompressor::create(Gio::ZLIB_COMPRESSOR_FORMAT_GZIP));
+    }
+
+    return in;
+}
+
 /**
  * Compares the two strings and returns \c true if they equal.
  * @param strA The first string (note that it is of type <tt>const
@@ -109,28 +145,96 @@ static inline bool parseBoolAttr(const xmlNodePtr node, const char* attrName,
     return def;
 }
 
+/**
+ * Compares the name of the node the reader is currently positioned on with the
+ * given string and returns \c true if they equal.
+ */
+static inline bool readerNameEq(xmlTextReaderPtr reader, const char* name) {
+    cxStr nodeName = xmlTextReaderConstName(reader);
+    return nodeName && xStrEq(nodeName, name);
+}
+
+/**
+ * <p>Advances the reader to the next node. If <c>skipSubtree</c> is set, the
+ * children of the current node are skipped.</p>
+ *
+ * @return \c true if a node was read, \c false at the end of the input.
+ *
+ * @exception Glib::MarkupError this exception is thrown if the underlying XML
+ * is malformed.
+ */
+static bool readNode(xmlTextReaderPtr reader, bool skipSubtree) {
+    int const ret = skipSubtree ? xmlTextReaderNext(reader)
+            : xmlTextReaderRead(reader);
+    if (ret < 0) {
+        throw Glib::MarkupError(Glib::MarkupError::PARSE, _(
+                "Could not parse the 'reflib' file."));
+    }
+    return ret == 1;
+}
+
+/**
+ * <p>Builds the DOM subtree of the element the reader is currently positioned
+ * on.</p>
+ * <p>The subtree is owned by the reader and only stays valid until the reader
+ * is advanced, so only one element is resident at a time.</p>
+ */
+static xmlNodePtr expandNode(xmlTextReaderPtr reader) {
+    xmlNodePtr node = xmlTextReaderExpand(reader);
+    if (!node) {
+        throw Glib::MarkupError(Glib::MarkupError::PARSE, _(
+                "Could not parse the 'reflib' file."));
+    }
+    return node;
+}
+
 /**
  * <p>Callbacks of this type are used in the function \ref
- * forEachChild(xmlNodePtr,LibraryData*) to process all child elements of a
- * node.</p>
+ * forEachChild(xmlTextReaderPtr,Context*,typename ForEachChild<Context>::Callback)
+ * to process all child elements of a node.</p>
  * <p>This function is called for each child of the parent node</p>
  *
  * @param child The current child.
  *
- * @param data The context data object to which to store parsed data.
+ * @param context The context object to which to store parsed data.
  */
-typedef void (*forEachChildCallback)(xmlNodePtr child, LibraryData* data);
+template <typename Context>
+struct ForEachChild {
+    typedef void (*Callback)(xmlNodePtr child, Context* context);
+};
 
 /**
- * Goes through every child element of the node and calls the <c>func</c>
- * callback function for each child.
+ * <p>Goes through every child element of the element the reader is currently
+ * positioned on and calls the <c>func</c> callback function for each child.
+ * Each child is expanded on its own, so the whole parent is never held in
+ * memory at once.</p>
+ *
+ * <p>Afterwards the reader is positioned on the node following the parent
+ * element.</p>
+ *
+ * @return \c false if the end of the input has been reached.
  */
-static inline void forEachChild(xmlNodePtr node, LibraryData* data,
-        forEachChildCallback func) {
-    for (xmlNodePtr child = xmlFirstElementChild(node); child; child
-            = xmlNextElementSibling(child)) {
-        func(child, data);
+template <typename Context>
+static bool forEachChild(xmlTextReaderPtr reader, Context* context,
+        typename ForEachChild<Context>::Callback func) {
+    if (xmlTextReaderIsEmptyElement(reader))
+        return readNode(reader, true);
+
+    int const depth = xmlTextReaderDepth(reader);
+    bool more = readNode(reader, false);
+    while (more && xmlTextReaderDepth(reader) > depth) {
+        if (xmlTextReaderNodeType(reader) == XML_READER_TYPE_ELEMENT) {
+            func(expandNode(reader), context);
+            more = readNode(reader, true);
+        } else {
+            more = readNode(reader, false);
+        }
     }
+
+    // Step over the closing tag of the parent element.
+    if (more && xmlTextReaderNodeType(reader) == XML_READER_TYPE_END_ELEMENT)
+        more = readNode(reader, false);
+    return more;
 }
 
 /**
@@ -188,13 +292,149 @@ static void parseTagElement(xmlNodePtr tagElement, LibraryData* data) {
     }
 }
 
+/**
+ * <p>Decodes the 'doc' elements of a 'reflib' file into \ref Document
+ * "documents" on a pool of worker threads.</p>
+ *
+ * <p>Elements are copied out of the reader and handed to the pool in chunks
+ * while the rest of the file is still being read. \ref finish() then splices
+ * the decoded chunks into the document list in their original order, so the
+ * documents come back in the same order as in the file.</p>
+ */
+class DocListLoader {
+public:
+    DocListLoader(DocumentList &doclist);
+    ~DocListLoader();
+
+    /**
+     * Queues a copy of the given 'doc' element for decoding.
+     */
+    void add(xmlNodePtr docElement);
+    /**
+     * Waits for all chunks to be decoded and appends them to the document
+     * list.
+     *
+     * @exception Glib::MarkupError this exception is thrown if any of the
+     * documents could not be decoded.
+     */
+    void finish();
+
+private:
+    /**
+     * The number of 'doc' elements decoded by a single job.
+     */
+    static const unsigned int chunkSize_ = 256;
+
+    struct Chunk {
+        std::vector<xmlNodePtr> nodes;
+        DocumentList::Container docs;
+        Glib::ustring error;
+    };
+
+    static void decode(Chunk *chunk);
+    void dispatch();
+
+    DocumentList &doclist_;
+    std::vector<Chunk*> chunks_;
+    Chunk *current_;
+    WorkQueue queue_;
+};
+
+DocListLoader::DocListLoader(DocumentList &doclist) :
+doclist_(doclist), current_(NULL), queue_(WorkQueue::defaultThreadCount()) {
+    // Lazily initialised, so make sure that happens before the workers race
+    // for it.
+    BibData::getDefaultDocType();
+}
+
+DocListLoader::~DocListLoader() {
+    // Nothing may be freed while a worker could still be using it.
+    queue_.wait();
+
+    DELETE(current_)
+    std::vector<Chunk*>::iterator it = chunks_.begin();
+    std::vector<Chunk*>::iterator const end = chunks_.end();
+    for (; it != end; ++it) {
+        std::vector<xmlNodePtr>::iterator node = (*it)->nodes.begin();
+        for (; node != (*it)->nodes.end(); ++node)
+            xmlFreeNode(*node);
+        delete *it;
+    }
+}
+
+void DocListLoader::add(xmlNodePtr docElement) {
+    if (!current_)
+        current_ = new Chunk();
+
+    // The reader frees the expanded element as soon as it moves on, so the
+    // job gets a copy of its own.
+    current_->nodes.push_back(xmlCopyNode(docElement, 1));
+    if (current_->nodes.size() >= chunkSize_)
+        dispatch();
+}
+
+void DocListLoader::dispatch() {
+    chunks_.push_back(current_);
+    queue_.push(sigc::bind(sigc::ptr_fun(&DocListLoader::decode), current_));
+    current_ = NULL;
+}
+
+void DocListLoader::decode(Chunk *chunk) {
+    try {
+        std::vector<xmlNodePtr>::iterator it = chunk->nodes.begin();
+        std::vector<xmlNodePtr>::iterator const end = chunk->nodes.end();
+        for (; it != end; ++it) {
+            // Constructed in place: copying a Document would register it
+            // with the (main loop only) ThumbnailGenerator.
+            chunk->docs.emplace(*it);
+            xmlFreeNode(*it);
+            *it = NULL;
+        }
+    } catch (const Glib::Exception& ex) {
+        chunk->error = ex.what();
+    } catch (const std::exception& ex) {
+        chunk->error = ex.what();
+    } catch (const std::exception* ex) {
+        // BibData::addExtra throws by pointer
+        chunk->error = ex->what();
+        delete ex;
+    }
+
+    // Anything not decoded is freed by the loader on the main thread.
+    std::vector<xmlNodePtr>::iterator it = chunk->nodes.begin();
+    std::vector<xmlNodePtr>::iterator const end = chunk->nodes.end();
+    chunk->nodes.erase(std::remove(it, end, (xmlNodePtr) NULL), end);
+}
+
+void DocListLoader::finish() {
+    if (current_)
+        dispatch();
+    // A job which threw something the decoder doesn't catch has left its
+    // chunk short of documents, with no error to show for it.
+    if (!queue_.wait()) {
+        throw Glib::MarkupError(Glib::MarkupError::PARSE,
+                _("Could not read a document"));
+    }
+
+    std::vector<Chunk*>::iterator it = chunks_.begin();
+    std::vector<Chunk*>::iterator const end = chunks_.end();
+    for (; it != end; ++it) {
+        if (!(*it)->error.empty()) {
+            throw Glib::MarkupError(Glib::MarkupError::PARSE,
+                    String::ucompose(_("Could not read a document: %1"),
+                    (*it)->error));
+        }
+        doclist_.appendDocs((*it)->docs);
+    }
+}
+
 /**
  * Extracts the data from the 'doc' elements in the 'reflib' XML
  * file.
  */
-static void parseDocElement(xmlNodePtr docElement, LibraryData* data) {
+static void parseDocElement(xmlNodePtr docElement, DocListLoader* loader) {
     if (nodeNameEq(docElement, LIB_ELEMENT_DOC))
-        data->doclist_->insertDoc(Document(docElement));
+        loader->add(docElement);
 }
 
 //
@@ -224,94 +464,174 @@ void LibraryData::clear() {
     library_folder_uri_ = "";
 }
 
-void LibraryData::extractData(xmlDocPtr libDocument) {
+void LibraryData::extractData(xmlTextReaderPtr reader) {
     this->clear();
-    xmlNodePtr node = xmlDocGetRootElement(libDocument);
-    if (node && node->type == XML_ELEMENT_NODE && nodeNameEq(node,
-            LIB_ELEMENT_LIBRARY)) {
-        for (xmlNodePtr child = xmlFirstElementChild(node); child; child
-                = xmlNextElementSibling(child)) {
-            if (nodeNameEq(child, LIB_ELEMENT_DOCLIST)) {
-                // We have found the 'document list' element.
-                forEachChild(child, this, &parseDocElement);
-            } else if (nodeNameEq(child, LIB_ELEMENT_MANAGE_TARGET)) {
-                // We have found the 'manage target' element.
-                parseManageTargetElement(child, this);
-            } else if (nodeNameEq(child, LIB_ELEMENT_LIBRARY_FOLDER)) {
-                // We have found the 'library folder' element.
-                parseLibraryFolderElement(child, this);
-            } else if (nodeNameEq(child, LIB_ELEMENT_TAGLIST)) {
-                // We have found the 'tag list' element.
-                forEachChild(child, this, &parseTagElement);
-            }
+
+    // Find the root element.
+    bool more = readNode(reader, false);
+    while (more && xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT)
+        more = readNode(reader, false);
+    if (!more || !readerNameEq(reader, LIB_ELEMENT_LIBRARY)
+            || xmlTextReaderIsEmptyElement(reader))
+        return;
+
+    more = readNode(reader, false);
+    while (more && xmlTextReaderDepth(reader) > 0) {
+        if (xmlTextReaderNodeType(reader) != XML_READER_TYPE_ELEMENT) {
+            more = readNode(reader, false);
+        } else if (readerNameEq(reader, LIB_ELEMENT_DOCLIST)) {
+            // We have found the 'document list' element.
+            DocListLoader loader(*doclist_);
+            more = forEachChild(reader, &loader, &parseDocElement);
+            loader.finish();
+        } else if (readerNameEq(reader, LIB_ELEMENT_MANAGE_TARGET)) {
+            // We have found the 'manage target' element.
+            parseManageTargetElement(expandNode(reader), this);
+            more = readNode(reader, true);
+        } else if (readerNameEq(reader, LIB_ELEMENT_LIBRARY_FOLDER)) {
+            // We have found the 'library folder' element.
+            parseLibraryFolderElement(expandNode(reader), this);
+            more = readNode(reader, true);
+        } else if (readerNameEq(reader, LIB_ELEMENT_TAGLIST)) {
+            // We have found the 'tag list' element.
+            more = forEachChild(reader, this, &parseTagElement);
+        } else {
+            more = readNode(reader, true);
         }
     }
 }
 
+void LibraryData::writeSettingsXML(xmlTextWriterPtr writer) {
+    xmlTextWriterStartElement(writer, XSTR LIB_ELEMENT_MANAGE_TARGET);
+    xmlTextWriterWriteAttribute(writer, XSTR LIB_ATTR_MANAGE_TARGET_BRACES, XSTR(manage_braces_ ? "true" : "false"));
+    xmlTextWriterWriteAttribute(writer, XSTR LIB_ATTR_MANAGE_TARGET_UTF8, XSTR(manage_utf8_ ? "true" : "false"));
+    xmlTextWriterWriteString(writer, XSTR manage_target_.c_str());
+    xmlTextWriterEndElement(writer);
+
+    xmlTextWriterStartElement(writer, XSTR LIB_ELEMENT_LIBRARY_FOLDER);
+    xmlTextWriterWriteAttribute(writer, XSTR LIB_ATTR_LIBRARY_FOLDER_MONITOR, XSTR(library_folder_monitor_ ? "true" : "false"));
+    xmlTextWriterWriteString(writer, XSTR library_folder_uri_.c_str());
+    xmlTextWriterEndElement(writer);
+
+    taglist_->writeXML(writer);
+}
+
+void LibraryData::writeXML(xmlTextWriterPtr writer) {
+    xmlTextWriterStartElement(writer, XSTR LIB_ELEMENT_LIBRARY);
+
+    writeSettingsXML(writer);
+    doclist_->writeXML(writer);
+
+    xmlTextWriterEndElement(writer);
+}
+
 //
 // Library implementation
 //
 
+/**
+ * Everything one save works on and reports back. For a background save the
+ * data is the library's save copy, which nothing else touches until the
+ * save is complete.
+ */
+struct Library::SaveJob {
+    SaveJob(Glib::ustring const &filename, LibraryData *libdata) :
+    libfilename(filename), data(libdata),
+    journal(_global_prefs->getJournalSave()),
+    compress(_global_prefs->getCompressLibrary()), async(false), thread(NULL),
+    revision(ChangeStamp::current()), success(false), finished(0) {
+    }
+
+    Glib::ustring const libfilename;
+    LibraryData *data;
+    bool const journal;
+    bool const compress;
+    bool async;
+    Glib::Threads::Thread *thread;
+    sigc::slot<void, bool> done;
+    /* Everything up to this revision is in what is being saved */
+    guint64 const revision;
+
+    bool success;
+    Glib::ustring error;
+    Glib::ustring errorContext;
+    gint finished;
+};
+
 Library::Library(RefWindow &tagwindow) :
 tagwindow_(tagwindow) {
     data = new LibraryData();
+    journal_ = NULL;
+    saveCopy_ = NULL;
+    saveJob_ = NULL;
+    saveDone_.connect(sigc::mem_fun(*this, &Library::onSaveDone));
 }
 
 Library::~Library() {
+    // Nobody is left to tell
+    if (saveJob_)
+        saveJob_->done = sigc::slot<void, bool>();
+    finishSave();
+
+    delete journal_;
+    delete saveCopy_;
     delete data;
 }
 
 void Library::writeXML(xmlTextWriterPtr writer) {
-    xmlTextWriterStartElement(writer, XSTR LIB_ELEMENT_LIBRARY);
-
-    xmlTextWriterStartElement(writer, XSTR LIB_ELEMENT_MANAGE_TARGET);
-    xmlTextWriterWriteAttribute(writer, XSTR LIB_ATTR_MANAGE_TARGET_BRACES, XSTR(data->manage_braces_ ? "true" : "false"));
-    xmlTextWriterWriteAttribute(writer, XSTR LIB_ATTR_MANAGE_TARGET_UTF8, XSTR(data->manage_utf8_ ? "true" : "false"));
-    xmlTextWriterWriteString(writer, XSTR data->manage_target_.c_str());
-    xmlTextWriterEndElement(writer);
-
-    xmlTextWriterStartElement(writer, XSTR LIB_ELEMENT_LIBRARY_FOLDER);
-    xmlTextWriterWriteAttribute(writer, XSTR LIB_ATTR_LIBRARY_FOLDER_MONITOR, XSTR(data->library_folder_monitor_ ? "true" : "false"));
-    xmlTextWriterWriteString(writer, XSTR data->library_folder_uri_.c_str());
-    xmlTextWriterEndElement(writer);
-
-    data->taglist_->writeXML(writer);
-    data->doclist_->writeXML(writer);
-
-    xmlTextWriterEndElement(writer);
+    data->writeXML(writer);
 }
 
-bool Library::readXML(Gio::InputStream *inputStream) {
-    if (inputStream == NULL)
-        return false;
-
+/**
+ * Parses a whole 'reflib' stream into a new LibraryData, throwing a
+ * Glib::Exception on failure.
+ */
+static LibraryData *parseReflib(Gio::InputStream *inputStream) {
     LibraryData* tmpData = NULL;
-    xmlDocPtr libDoc = NULL;
+    xmlTextReaderPtr reader = NULL;
     try {
-        // Parse the library XML file to get the DOM tree.
-        xmlDocPtr libDoc =
-                xmlReadIO(vfsRead, vfsCloseInputStream, inputStream, NULL, NULL, 0);
-        if (!libDoc) {
+        // Stream the library XML file, building documents and tags as their
+        // elements go past rather than parsing the whole DOM tree up front.
+        reader = xmlReaderForIO(vfsRead, vfsCloseInputStream, inputStream,
+                NULL, NULL, 0);
+        if (!reader) {
             throw Glib::MarkupError(Glib::MarkupError::PARSE, _(
                     "Could not parse the 'reflib' file."));
         }
         // Fetch the data and store it in a new LibraryData instance.
         tmpData = new LibraryData();
-        tmpData->extractData(libDoc);
+        tmpData->extractData(reader);
     } catch (const Glib::Exception& ex) {
         DELETE(tmpData)
-        if (libDoc != NULL)
-            xmlFreeDoc(libDoc);
+        if (reader != NULL)
+            xmlFreeTextReader(reader);
         throw;
     }
-    
-    xmlFreeDoc(libDoc);
+
+    xmlFreeTextReader(reader);
+    return tmpData;
+}
+
+LibraryData *Library::readReflib(Glib::ustring const &libfilename) {
+    Glib::RefPtr<Gio::InputStream> in =
+            openReflib(Gio::File::create_for_uri(libfilename));
+    return parseReflib(in.operator ->());
+}
+
+bool Library::readXML(Gio::InputStream *inputStream) {
+    if (inputStream == NULL)
+        return false;
+
+    LibraryData* tmpData = parseReflib(inputStream);
     DELETE(this->data);
     this->data = tmpData;
     return tmpData != NULL;
 }
 
 void Library::clear() {
+    finishSave();
+    DELETE_AND_NULL(journal_);
+    DELETE_AND_NULL(saveCopy_);
     data->clear();
 }
 
@@ -355,12 +675,32 @@ bool Library::libraryFolderDialog ()
 
 
 
+/**
+ * Resolves a freshly read document's relative filename against the library,
+ * and requests its thumbnail.
+ */
+static void resolveFileName(Document &doc, Glib::ustring const &libfilename) {
+    if (!doc.getRelFileName().empty()) {
+        doc.setFileName(Glib::build_filename (
+            Glib::path_get_dirname (libfilename),
+            doc.getRelFileName()));
+    } else {
+        // Documents are decoded without their thumbnail set up, this
+        // registers it for the absolute filename.
+        doc.setFileName(doc.getFileName());
+    }
+}
+
 // True on success
 bool Library::load (Glib::ustring const &libfilename)
 {
     Glib::RefPtr<Gio::File> libfile = Gio::File::create_for_uri (libfilename);
   	Glib::RefPtr<Gio::FileInfo> fileinfo;
 
+	finishSave ();
+	// Its copies are of documents which are about to go
+	DELETE_AND_NULL (saveCopy_);
+
 	try{
   		fileinfo = libfile->query_info ();
 	} catch (const Gio::Error& ex) {
@@ -375,52 +715,84 @@ bool Library::load (Glib::ustring const &libfilename)
             _("Opening %1"),
             fileinfo->get_display_name ()));
 
-    try {
-		Glib::RefPtr<Gio::FileInputStream> libfile_is = libfile->read();
-        // We have opened the file for reading, now try to parse the XML library
-        // file into this->data
-        if (!readXML(libfile_is.operator ->())) {
-            return false;
+    // An up to date snapshot already has every filename resolved and the
+    // thumbnails requested
+    LibrarySnapshot snapshot (libfilename);
+    LibraryData *snapshotData = new LibraryData ();
+    bool const fromSnapshot = snapshot.read (*snapshotData);
+    bool parsed = false;
+    if (fromSnapshot) {
+        DELETE (data);
+        data = snapshotData;
+        DEBUG("Done, got %1 docs from the snapshot", data->doclist_->getDocs().size());
+    } else {
+        delete snapshotData;
+
+        try {
+            Glib::RefPtr<Gio::InputStream> libfile_is = openReflib(libfile);
+            // We have opened the file for reading, now try to parse the XML library
+            // file into this->data
+            if (!readXML(libfile_is.operator ->())) {
+                return false;
+            }
+            parsed = true;
+        } catch (const Glib::Exception& ex) {
+            Utility::exceptionDialog(&ex, "opening library '"
+                    + fileinfo->get_display_name () + "'");
         }
-    } catch (const Glib::Exception& ex) {
-        Utility::exceptionDialog(&ex, "opening library '"
-                + fileinfo->get_display_name () + "'");
+        DEBUG("Done, got %1 docs", data->doclist_->getDocs().size());
     }
-    DEBUG("Done, got %1 docs", data->doclist_->getDocs().size());
+    StringPool::logStats ();
     //XXX: progress calls commented out, since they flush events,
     //causing the thumbnail generator to run but with invalid filenames
     // -mchro
 
     //progress.update(0.2);
 
-    DocumentList::Container &docs = data->doclist_->getDocs();
-    DocumentList::Container::iterator docit = docs.begin();
-    DocumentList::Container::iterator const docend = docs.end();
-    for (; docit != docend; ++docit) {
-		//progress.update (0.2 + ((double)(i++) / (double)docs.size ()) * 0.8);
-
-        if (!docit->getRelFileName().empty()) {
-			Glib::ustring full_filename;
-			full_filename = Glib::build_filename (
-				Glib::path_get_dirname (libfilename),
-				docit->getRelFileName());
-			docit->setFileName(full_filename);
-		}
-	}
+    if (parsed) {
+        DocumentList::Container &docs = data->doclist_->getDocs();
+        DocumentList::Container::iterator docit = docs.begin();
+        DocumentList::Container::iterator const docend = docs.end();
+        for (; docit != docend; ++docit) {
+            //progress.update (0.2 + ((double)(i++) / (double)docs.size ()) * 0.8);
+            resolveFileName(*docit, libfilename);
+        }
+
+        snapshot.write (*data);
+    }
+
+    // Replay whatever was saved since the reflib was last written in full
+    DELETE_AND_NULL (journal_);
+    if (fromSnapshot || parsed) {
+        LibraryJournal *journal = new LibraryJournal (libfilename);
+        std::set<Document*> journalled;
+        bool const replayed = journal->replay (*data, journalled);
+        std::set<Document*>::iterator it = journalled.begin ();
+        for (; it != journalled.end (); ++it)
+            resolveFileName (**it, libfilename);
+
+        if (replayed || _global_prefs->getJournalSave ()) {
+            journal->setBaseline (*data);
+            journal_ = journal;
+        } else {
+            delete journal;
+        }
+    }
+
+    // What was just loaded is what is on disk
+    data->doclist_->clearChanges (ChangeStamp::current ());
 
 	progress.finish ();
 
     return true;
 }
 
-// True on success
-
-bool Library::save(Glib::ustring const &libfilename) {
-    DEBUG("Saving to %1", libfilename);
+void Library::writeReflib(Glib::ustring const &libfilename, LibraryData &libdata,
+        bool compress) {
     Glib::RefPtr<Gio::File> libfile = Gio::File::create_for_uri (libfilename);
 
     DEBUG("Updating relative filenames...");
-    DocumentList::Container &docs = data->doclist_->getDocs();
+    DocumentList::Container &docs = libdata.doclist_->getDocs();
     DocumentList::Container::iterator docit = docs.begin();
     DocumentList::Container::iterator const docend = docs.end();
     for (; docit != docend; ++docit) {
@@ -429,56 +801,167 @@ bool Library::save(Glib::ustring const &libfilename) {
     DEBUG("Done.");
 
     DEBUG("Generating XML...");
-    try {
-        Glib::RefPtr<Gio::FileOutputStream> oStream = libfile->replace ();
-        xmlOutputBufferPtr outBuf = xmlOutputBufferCreateIO(&vfsWrite,
-                &vfsCloseOutputStream, (Gio::OutputStream*)(oStream.operator ->()), NULL);
-        xmlTextWriterPtr writer = xmlNewTextWriter(outBuf);
-        if (writer) {
-            xmlTextWriterSetIndent(writer, true);
-            xmlTextWriterSetIndentString(writer, CXSTR"\t");
-            xmlTextWriterStartDocument(writer, NULL, "UTF-8", NULL);
-            writeXML(writer);
-            xmlTextWriterEndDocument(writer);
-            xmlTextWriterFlush(writer);
-            xmlFreeTextWriter(writer);
-        } else
-            throw Glib::FileError(Glib::FileError::FAILED, _("Could not create an XML writer."));
-    } catch (const Glib::Exception& ex) {
-        Utility::exceptionDialog(&ex, "Generating 'reflib' XML file '" + libfilename + "'");
-        return false;
+    Glib::RefPtr<Gio::OutputStream> oStream = libfile->replace ();
+    if (compress) {
+        // Closing the converter writes the gzip trailer and closes the file
+        oStream = Gio::ConverterOutputStream::create(oStream,
+                Gio::ZlibCompressor::create(Gio::ZLIB_COMPRESSOR_FORMAT_GZIP, -1));
     }
+    xmlOutputBufferPtr outBuf = xmlOutputBufferCreateIO(&vfsWrite,
+            &vfsCloseOutputStream, (Gio::OutputStream*)(oStream.operator ->()), NULL);
+    xmlTextWriterPtr writer = xmlNewTextWriter(outBuf);
+    if (writer) {
+        xmlTextWriterSetIndent(writer, true);
+        xmlTextWriterSetIndentString(writer, CXSTR"\t");
+        xmlTextWriterStartDocument(writer, NULL, "UTF-8", NULL);
+        libdata.writeXML(writer);
+        xmlTextWriterEndDocument(writer);
+        xmlTextWriterFlush(writer);
+        xmlFreeTextWriter(writer);
+    } else
+        throw Glib::FileError(Glib::FileError::FAILED, _("Could not create an XML writer."));
     DEBUG("Done.");
+}
 
-    DEBUG("Writing bibtex, manage_target_ = %1", data->manage_target_);
-	// Having successfully saved the library, write the bibtex if needed
-    if (!data->manage_target_.empty()) {
-		// manage_target_ is either an absolute URI or a relative URI
-		Glib::ustring bibtextarget_uri;
-		if (Glib::uri_parse_scheme(data->manage_target_) != "") //absolute URI
-			bibtextarget_uri = data->manage_target_;
-		else
-			bibtextarget_uri = libfile->get_parent()->resolve_relative_path(data->manage_target_)->get_uri();
-
-		DEBUG ("bibtextarget_uri = %1", bibtextarget_uri);
-
-		std::vector<Document*> docs;
-        DocumentList::Container &docrefs = data->doclist_->getDocs();
-		DocumentList::Container::iterator it = docrefs.begin();
-		DocumentList::Container::iterator const end = docrefs.end();
-		for (; it != end; it++) {
-			docs.push_back(&(*it));
-		}
-		try {
-		    writeBibtex (bibtextarget_uri, docs, data->manage_braces_, data->manage_utf8_);
-		} catch (Glib::Exception const &ex) {
-			Utility::exceptionDialog (&ex, "writing bibtex to " + bibtextarget_uri);
-			return false;
-		}
-	}
-	DEBUG ("Done.");
+void Library::runSave(SaveJob *job) {
+    Glib::ustring const &libfilename = job->libfilename;
+    LibraryData &libdata = *job->data;
+    Glib::RefPtr<Gio::File> libfile = Gio::File::create_for_uri (libfilename);
+
+    try {
+        if (job->journal && journal_
+                && journal_->getLibFilename() == libfilename
+                && journal_->append(libdata)) {
+            DEBUG("Appended changes to the journal");
+        } else {
+            job->errorContext = "Generating 'reflib' XML file '" + libfilename + "'";
+            writeReflib(libfilename, libdata, job->compress);
+
+            LibrarySnapshot (libfilename).write (libdata);
+
+            // The reflib now holds everything the journal did
+            if (journal_ && journal_->getLibFilename() != libfilename)
+                DELETE_AND_NULL (journal_);
+            if (journal_ || job->journal) {
+                if (!journal_)
+                    journal_ = new LibraryJournal (libfilename);
+                journal_->discard ();
+                journal_->setBaseline (libdata);
+            }
+        }
+
+        DEBUG("Writing bibtex, manage_target_ = %1", libdata.manage_target_);
+        // Having successfully saved the library, write the bibtex if needed
+        if (!libdata.manage_target_.empty()) {
+            // manage_target_ is either an absolute URI or a relative URI
+            Glib::ustring bibtextarget_uri;
+            if (Glib::uri_parse_scheme(libdata.manage_target_) != "") //absolute URI
+                bibtextarget_uri = libdata.manage_target_;
+            else
+                bibtextarget_uri = libfile->get_parent()->resolve_relative_path(libdata.manage_target_)->get_uri();
+
+            DEBUG ("bibtextarget_uri = %1", bibtextarget_uri);
+
+            std::vector<Document*> docs;
+            DocumentList::Container &docrefs = libdata.doclist_->getDocs();
+            DocumentList::Container::iterator it = docrefs.begin();
+            DocumentList::Container::iterator const end = docrefs.end();
+            for (; it != end; it++) {
+                docs.push_back(&(*it));
+            }
 
-	return true;
+            job->errorContext = "writing bibtex to " + bibtextarget_uri;
+            writeBibtexFile (bibtextarget_uri, docs, *libdata.taglist_,
+                    libdata.manage_braces_, libdata.manage_utf8_);
+        }
+        DEBUG ("Done.");
+
+        job->success = true;
+    } catch (Glib::Exception const &ex) {
+        job->error = ex.what ();
+    } catch (std::exception const &ex) {
+        job->error = ex.what ();
+    } catch (...) {
+        // Nothing may escape the save thread, and the main thread must
+        // still hear that it finished
+        job->error = _("Unknown error");
+    }
+
+    g_atomic_int_set (&job->finished, 1);
+    if (job->async)
+        saveDone_.emit ();
+}
+
+bool Library::completeSave() {
+    SaveJob *job = saveJob_;
+    saveJob_ = NULL;
+
+    if (job->thread)
+        job->thread->join ();
+
+    if (!job->success) {
+        Glib::FileError const error (Glib::FileError::FAILED, job->error);
+        Utility::exceptionDialog (&error, job->errorContext);
+    }
+
+    if (job->success)
+        data->doclist_->clearChanges (job->revision);
+
+    bool const success = job->success;
+    sigc::slot<void, bool> const done = job->done;
+    delete job;
+
+    if (!done.empty ())
+        done (success);
+
+    return success;
+}
+
+void Library::onSaveDone() {
+    // The save may already have been waited for by finishSave
+    if (saveJob_ && g_atomic_int_get (&saveJob_->finished))
+        completeSave ();
+}
+
+void Library::finishSave() {
+    if (saveJob_)
+        completeSave ();
+}
+
+// True on success
+
+bool Library::save(Glib::ustring const &libfilename) {
+    DEBUG("Saving to %1", libfilename);
+    finishSave ();
+
+    saveJob_ = new SaveJob (libfilename, data);
+    runSave (saveJob_);
+
+    return completeSave ();
+}
+
+void Library::saveAsync(
+        Glib::ustring const &libfilename,
+        sigc::slot<void, bool> const &done) {
+    DEBUG("Saving to %1 in the background", libfilename);
+    finishSave ();
+
+    // Copy everything the save reads, so that the library may be edited
+    // while it runs. Only what was edited since the last time is copied.
+    if (!saveCopy_)
+        saveCopy_ = new LibraryCopy ();
+    saveJob_ = new SaveJob (libfilename, &saveCopy_->update (*data));
+    saveJob_->done = done;
+    saveJob_->async = true;
+    try {
+        saveJob_->thread = Glib::Threads::Thread::create (
+            sigc::bind (sigc::mem_fun (*this, &Library::runSave), saveJob_));
+    } catch (Glib::Threads::ThreadError const &ex) {
+        DEBUG ("Couldn't start the save thread: %1", ex.what ());
+        saveJob_->async = false;
+        runSave (saveJob_);
+        completeSave ();
+    }
 }
 
 
@@ -487,6 +970,22 @@ void Library::writeBibtex (
 	std::vector<Document*> const &docs,
 	bool const usebraces,
 	bool const utf8)
+{
+	try {
+		writeBibtexFile (biburi, docs, *data->taglist_, usebraces, utf8);
+	} catch (const Gio::Error& ex) {
+		Utility::exceptionDialog (&ex, "writing to BibTex file");
+		return;
+	}
+}
+
+
+void Library::writeBibtexFile (
+	Glib::ustring const &biburi,
+	std::vector<Document*> const &docs,
+	TagList &tags,
+	bool const usebraces,
+	bool const utf8)
 {
 	DEBUG ("Writing BibTex to %1", biburi);
 
@@ -497,16 +996,11 @@ void Library::writeBibtex (
 	std::vector<Document*>::const_iterator it = docs.begin ();
 	std::vector<Document*>::const_iterator const end = docs.end ();
 	for (; it != end; ++it) {
-		(*it)->writeBibtex (*this, bibtext, usebraces, utf8);
+		(*it)->writeBibtex (tags, bibtext, usebraces, utf8);
 	}
 
-	try {
-		std::string new_etag;
-		bibfile->replace_contents (bibtext.str(), "", new_etag);
-	} catch (const Gio::Error& ex) {
-		Utility::exceptionDialog (&ex, "writing to BibTex file");
-		return;
-	}
+	std::string new_etag;
+	bibfile->replace_contents (bibtext.str(), "", new_etag);
 }
 
 void Library::manageBibtex(Glib::ustring const &target, bool const braces,
@@ -516,3 +1010,18 @@ void Library::manageBibtex(Glib::ustring const &target, bool const braces,
     data->manage_utf8_ = utf8;
 }
 
+
+void Library::flagDuplicates (std::vector<Document*> const &docs)
+{
+	if (docs.empty ())
+		return;
+
+	std::string const name = _("Possible duplicate");
+	TagList *tags = data->taglist_;
+	int const uid = tags->tagExists (name) ? tags->getTagUid (name) : tags->newTag (name);
+
+	std::vector<Document*>::const_iterator it = docs.begin ();
+	std::vector<Document*>::const_iterator const end = docs.end ();
+	for (; it != end; ++it)
+		(*it)->setTag (uid);
+}
@@ -13,12 +13,17 @@
 #ifndef LIBRARY_H
 #define LIBRARY_H
 
+#include <glibmm/dispatcher.h>
+#include <glibmm/threads.h>
 #include <glibmm/ustring.h>
 #include <libxml/tree.h>
+#include <libxml/xmlreader.h>
 #include <libxml/xmlwriter.h>
 
 class Document;
 class DocumentList;
+class LibraryCopy;
+class LibraryJournal;
 class TagList;
 class RefWindow;
 
@@ -188,20 +193,31 @@ struct LibraryData {
      */
     void clear();
     /**
-     * <p>Extracts information about a referencer library from a parsed XML
-     * document tree. Upon success, this method will set the fields of this
-     * instance accordingly.</p>
+     * <p>Extracts information about a referencer library from a streaming XML
+     * reader. Documents and tags are built as their elements are read, and
+     * the reader only expands one element's subtree at a time rather than
+     * building a tree of the whole file. Upon success, this method will set
+     * the fields of this instance accordingly.</p>
      * <p>Upon failure, however, this method will throw an exception and the
      * state of this instance will be in an undefined state (partially read
      * data).</p>
      *
-     * @param libDocument the XML DOM tree extracted from the referencer's
+     * @param reader a reader positioned at the start of the referencer's
      * library XML file (the 'reflib' file).
      *
      * @exception Glib::Exception this exception is thrown if the parsing fails
      * for any reason.
      */
-    void extractData(xmlDocPtr libDocument);
+    void extractData(xmlTextReaderPtr reader);
+    /**
+     * Writes the library's settings and tag list, that is all of the library
+     * element's children apart from the document list.
+     */
+    void writeSettingsXML(xmlTextWriterPtr writer);
+    /**
+     * Writes the whole library element.
+     */
+    void writeXML(xmlTextWriterPtr writer);
 };
 
 class Library {
@@ -212,6 +228,20 @@ class Library {
 	void clear ();
 	bool load (Glib::ustring const &libfilename);
 	bool save (Glib::ustring const &libfilename);
+	/**
+	 * Saves a copy of the library as it is now on a worker thread, so it can
+	 * go on being edited meanwhile. <c>done</c> is called from the main loop
+	 * with whether the save succeeded, after any error has been shown.
+	 */
+	void saveAsync (
+		Glib::ustring const &libfilename,
+		sigc::slot<void, bool> const &done);
+	bool isSaving () const {return saveJob_ != NULL;}
+	/**
+	 * Waits for a save started by \ref saveAsync(), if there is one, and
+	 * reports its result.
+	 */
+	void finishSave ();
 
 	void writeXML(xmlTextWriterPtr writer);
 	bool readXML(Gio::InputStream *inputStream);
@@ -221,6 +251,30 @@ class Library {
 		std::vector<Document*> const &docs,
 		bool const usebraces,
 		bool const utf8);
+	/**
+	 * Like \ref writeBibtex(), but throws a Glib::Exception on failure
+	 * instead of telling the user, so it may run on a worker thread.
+	 */
+	static void writeBibtexFile (
+		Glib::ustring const &bibfilename,
+		std::vector<Document*> const &docs,
+		TagList &tags,
+		bool const usebraces,
+		bool const utf8);
+	/**
+	 * Reads a whole 'reflib' file, compressed or not, into a new
+	 * LibraryData, throwing a Glib::Exception on failure. Filenames are left
+	 * as they are in the file and no thumbnails are requested.
+	 */
+	static LibraryData *readReflib (Glib::ustring const &libfilename);
+	/**
+	 * Writes the whole 'reflib' file for libdata, gzip compressed if
+	 * <c>compress</c> is set, throwing a Glib::Exception on failure.
+	 */
+	static void writeReflib (
+		Glib::ustring const &libfilename,
+		LibraryData &libdata,
+		bool compress);
 
 	// The naming is BibtexFoo everywhere else, but in Library
 	// we use the manage_ prefix to be consistent with the file format
@@ -261,24 +315,45 @@ class Library {
 
     bool libraryFolderDialog();
 
-	private:
     /**
-     * Extracts information about a library from the given DOM tree.
-     *
-     * @param libDocument the XML DOM tree extracted from the referencer's
-     * library XML file. This method will extract all
-     *
-     * @returns 'true' if the library data has been read successfully,
-     * otherwise it returns 'false'.
+     * Tags documents found to share an identifier with others, creating
+     * the tag the first time it is needed.
      */
-    bool readLibrary(xmlDocPtr libDocument);
+    void flagDuplicates(std::vector<Document*> const &docs);
 
 private:
+    struct SaveJob;
+
+    /**
+     * Does all of a save's work, either inline or on the save thread.
+     */
+    void runSave(SaveJob *job);
+    /**
+     * Reports the result of a finished save on the main thread.
+     */
+    bool completeSave();
+    void onSaveDone();
+
     /**
      * Contains all data about this library (tags, documents and other
      * configuration).
      */
     struct LibraryData *data;
+    /**
+     * The journal of the reflib this library was loaded from or last written
+     * to, if journalled saving is in use.
+     */
+    LibraryJournal *journal_;
+    /**
+     * The save in progress, if any. While there is one, only its thread may
+     * touch \ref journal_.
+     */
+    SaveJob *saveJob_;
+    /**
+     * What background saves read in place of \ref data, kept between them.
+     */
+    LibraryCopy *saveCopy_;
+    Glib::Dispatcher saveDone_;
 
 	RefWindow &tagwindow_;
 };
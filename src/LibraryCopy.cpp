@@ -0,0 +1,93 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#include "DocumentList.h"
+#include "Library.h"
+#include "TagList.h"
+
+#include "LibraryCopy.h"
+
+
+LibraryCopy::LibraryCopy ()
+	: data_ (new LibraryData ()), serial_ (0), pass_ (0)
+{
+}
+
+
+LibraryCopy::~LibraryCopy ()
+{
+	delete data_;
+}
+
+
+void LibraryCopy::drop (Copied &copied)
+{
+	DocumentList::Container &copies = data_->doclist_->getDocs ();
+	Document *const copy = copies.lookup (copied.copy);
+	if (copy)
+		copies.erase (copy);
+	copied = Copied ();
+}
+
+
+LibraryData &LibraryCopy::update (LibraryData &libdata)
+{
+	data_->manage_target_ = libdata.manage_target_;
+	data_->manage_braces_ = libdata.manage_braces_;
+	data_->manage_utf8_ = libdata.manage_utf8_;
+	data_->library_folder_uri_ = libdata.library_folder_uri_;
+	data_->library_folder_monitor_ = libdata.library_folder_monitor_;
+	*data_->taglist_ = *libdata.taglist_;
+
+	// Handles only mean something in the list they came from
+	DocumentList::Container &copies = data_->doclist_->getDocs ();
+	if (libdata.doclist_->getSerial () != serial_) {
+		copies.clear ();
+		copied_.clear ();
+		serial_ = libdata.doclist_->getSerial ();
+	}
+
+	++pass_;
+	DocumentList::Container &docs = libdata.doclist_->getDocs ();
+	DocumentList::Container::iterator it = docs.begin ();
+	DocumentList::Container::iterator const end = docs.end ();
+	for (; it != end; ++it) {
+		DocumentHandle const handle = docs.getHandle (&(*it));
+		if (handle.index >= copied_.size ())
+			copied_.resize (handle.index + 1);
+
+		Copied &copied = copied_[handle.index];
+		Document *copy = copied.generation == handle.generation
+			? copies.lookup (copied.copy) : NULL;
+		if (!copy) {
+			// New since, perhaps in the slot of one which has gone. Like
+			// it, the copy comes last, so the copies keep the list's order.
+			drop (copied);
+			copy = &copies.emplace (*it, false);
+			copied.generation = handle.generation;
+			copied.copy = copies.getHandle (copy);
+		} else if (copied.revision != it->getRevision ()) {
+			// Assigned in place, to keep its position
+			*copy = Document (*it, false);
+		}
+		copied.revision = it->getRevision ();
+		copied.pass = pass_;
+	}
+
+	// Documents which have gone since
+	std::vector<Copied>::iterator gone = copied_.begin ();
+	for (; gone != copied_.end (); ++gone) {
+		if (gone->pass != pass_)
+			drop (*gone);
+	}
+
+	return *data_;
+}
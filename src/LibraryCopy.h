@@ -0,0 +1,78 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#ifndef LIBRARYCOPY_H
+#define LIBRARYCOPY_H
+
+#include <vector>
+
+#include <glib.h>
+
+#include "DocumentSlab.h"
+
+struct LibraryData;
+
+/**
+ * <p>A copy of a library for saves which run while it is edited, kept from
+ * one save to the next. Each \ref update() only copies the documents which
+ * were added or edited since the last one, as their revisions tell, and
+ * drops the copies of those which have gone.</p>
+ *
+ * <p>The copied documents are put straight in the copy's slab, without
+ * being adopted by its list: a save only walks them, so the key, file,
+ * identifier and search indexes are never built for them.</p>
+ *
+ * <p>The price is that a second copy of every document is kept while the
+ * library is open, which is no more than a save used to hold at its peak
+ * anyway.</p>
+ */
+class LibraryCopy {
+	public:
+	LibraryCopy ();
+	~LibraryCopy ();
+
+	/**
+	 * Brings the copy up to date with <c>libdata</c>, on the main thread
+	 * and while no save is reading the copy.
+	 *
+	 * @return the copy, which a save may then read on another thread until
+	 * the next update.
+	 */
+	LibraryData &update (LibraryData &libdata);
+
+	private:
+	/* What a slot of the library's list held at the last update */
+	struct Copied {
+		Copied () : generation (0), revision (0), pass (0) {}
+
+		guint32 generation;
+		/* The revision of the document when it was copied */
+		guint64 revision;
+		/* The copy, in the copy's own list */
+		DocumentHandle copy;
+		/* The last update to find the document still in the library */
+		guint32 pass;
+	};
+
+	void drop (Copied &copied);
+
+	LibraryData *data_;
+	/* The serial of the list the copies were taken from */
+	guint32 serial_;
+	guint32 pass_;
+	/* By slot of the library's list */
+	std::vector<Copied> copied_;
+
+	LibraryCopy (LibraryCopy const &);
+	LibraryCopy &operator= (LibraryCopy const &);
+};
+
+#endif
@@ -0,0 +1,407 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#include <algorithm>
+#include <cstring>
+#include <functional>
+
+#include <giomm/file.h>
+#include <libxml/parser.h>
+#include <libxml/xmlreader.h>
+
+#include "DocumentList.h"
+#include "Library.h"
+#include "Utility.h"
+
+#include "LibraryJournal.h"
+
+using namespace Utility;
+
+/**
+ * The name of the journal's first record, which stamps the reflib it applies to.
+ */
+#define JOURNAL_ELEMENT_HEADER "journal"
+#define JOURNAL_ATTR_HEADER_SIZE "reflib_size"
+#define JOURNAL_ATTR_HEADER_MTIME "reflib_mtime"
+/**
+ * The name of the record for a removed document.
+ */
+#define JOURNAL_ELEMENT_REMOVE "remove"
+#define JOURNAL_ATTR_REMOVE_KEY "key"
+
+/**
+ * The journal is compacted once it would grow past a quarter of the reflib,
+ * but never while it is smaller than this.
+ */
+#define JOURNAL_MIN_COMPACT_SIZE (1024 * 1024)
+
+
+namespace {
+
+/*
+ * Collects whatever is written to it as a string of XML.
+ */
+class MemoryWriter {
+	public:
+	MemoryWriter ()
+	{
+		buffer_ = xmlBufferCreate ();
+		writer_ = xmlNewTextWriterMemory (buffer_, 0);
+	}
+	~MemoryWriter ()
+	{
+		if (writer_)
+			xmlFreeTextWriter (writer_);
+		xmlBufferFree (buffer_);
+	}
+
+	xmlTextWriterPtr get () {return writer_;}
+
+	std::string finish ()
+	{
+		xmlTextWriterFlush (writer_);
+		return std::string (
+			(char const*) xmlBufferContent (buffer_),
+			xmlBufferLength (buffer_));
+	}
+
+	private:
+	xmlBufferPtr buffer_;
+	xmlTextWriterPtr writer_;
+};
+
+std::string docXML (Document &doc)
+{
+	MemoryWriter writer;
+	doc.writeXML (writer.get ());
+	return writer.finish ();
+}
+
+std::string settingsXML (LibraryData &data)
+{
+	MemoryWriter writer;
+	xmlTextWriterStartElement (writer.get (), XSTR LIB_ELEMENT_LIBRARY);
+	data.writeSettingsXML (writer.get ());
+	xmlTextWriterEndElement (writer.get ());
+	return writer.finish ();
+}
+
+/* Records are a decimal byte count on a line of its own, then the XML */
+void appendRecord (std::string &records, std::string const &xml)
+{
+	char prefix[32];
+	g_snprintf (prefix, sizeof (prefix), "%" G_GSIZE_FORMAT "\n", xml.size ());
+	records += prefix;
+	records += xml;
+	records += '\n';
+}
+
+size_t hashString (std::string const &str)
+{
+	return std::hash<std::string> () (str);
+}
+
+}
+
+
+LibraryJournal::LibraryJournal (Glib::ustring const &libfilename)
+	: libfilename_ (libfilename), journalfilename_ (libfilename + ".journal")
+{
+	settingsHash_ = 0;
+	hasBaseline_ = false;
+	size_ = 0;
+	compactSize_ = JOURNAL_MIN_COMPACT_SIZE;
+	mustCompact_ = false;
+}
+
+
+bool LibraryJournal::stampLibrary (guint64 &size, guint64 &mtime) const
+{
+	try {
+		Glib::RefPtr<Gio::FileInfo> info =
+			Gio::File::create_for_uri (libfilename_)->query_info (
+				G_FILE_ATTRIBUTE_STANDARD_SIZE "," G_FILE_ATTRIBUTE_TIME_MODIFIED);
+		size = info->get_size ();
+		mtime = info->get_attribute_uint64 (G_FILE_ATTRIBUTE_TIME_MODIFIED);
+	} catch (Glib::Exception const &ex) {
+		DEBUG ("Couldn't stat %1: %2", libfilename_, ex.what ());
+		return false;
+	}
+
+	return true;
+}
+
+
+bool LibraryJournal::replay (LibraryData &data, std::set<Document*> &added)
+{
+	char *contents = NULL;
+	gsize length = 0;
+	try {
+		Gio::File::create_for_uri (journalfilename_)->load_contents (contents, length);
+	} catch (Glib::Exception const &) {
+		// Usually there just isn't a journal
+		return false;
+	}
+	std::string const journal (contents, length);
+	g_free (contents);
+
+	guint64 libsize, libmtime;
+	if (!stampLibrary (libsize, libmtime))
+		return false;
+
+	std::unordered_map<std::string, Document*> byKey;
+	DocumentList::Container &docs = data.doclist_->getDocs ();
+	for (DocumentList::Container::iterator it = docs.begin (); it != docs.end (); ++it)
+		byKey[it->getKey ().raw ()] = &(*it);
+
+	gsize pos = 0;
+	bool stamped = false;
+	bool intact = true;
+	while (intact && pos < journal.size ()) {
+		gsize const eol = journal.find ('\n', pos);
+		if (eol == std::string::npos) {
+			intact = false;
+			break;
+		}
+		gsize const recordLength = g_ascii_strtoull (journal.c_str () + pos, NULL, 10);
+		pos = eol + 1;
+		if (journal.size () - pos < recordLength + 1) {
+			intact = false;
+			break;
+		}
+		char const *record = journal.c_str () + pos;
+		pos += recordLength + 1;
+
+		xmlDocPtr recordDoc = xmlReadMemory (record, recordLength, NULL, "UTF-8", 0);
+		xmlNodePtr root = recordDoc ? xmlDocGetRootElement (recordDoc) : NULL;
+		if (!root) {
+			if (recordDoc)
+				xmlFreeDoc (recordDoc);
+			intact = false;
+			break;
+		}
+
+		try {
+			if (!stamped) {
+				// Everything else was written against some other reflib
+				xStr size = xmlGetProp (root, CXSTR JOURNAL_ATTR_HEADER_SIZE);
+				xStr mtime = xmlGetProp (root, CXSTR JOURNAL_ATTR_HEADER_MTIME);
+				stamped = nodeNameEq (root, JOURNAL_ELEMENT_HEADER) && size && mtime
+					&& g_ascii_strtoull (CSTR size, NULL, 10) == libsize
+					&& g_ascii_strtoull (CSTR mtime, NULL, 10) == libmtime;
+				xmlFree (size);
+				xmlFree (mtime);
+				if (!stamped) {
+					DEBUG ("Ignoring stale journal %1", journalfilename_);
+					xmlFreeDoc (recordDoc);
+					return false;
+				}
+			} else if (nodeNameEq (root, LIB_ELEMENT_DOC)) {
+				Document *replacement = data.doclist_->loadDoc (root);
+				std::string const key = replacement->getKey ().raw ();
+
+				std::unordered_map<std::string, Document*>::iterator old = byKey.find (key);
+				if (old != byKey.end ()) {
+					added.erase (old->second);
+					data.doclist_->removeDoc (old->second);
+				}
+				byKey[key] = replacement;
+				added.insert (replacement);
+			} else if (nodeNameEq (root, JOURNAL_ELEMENT_REMOVE)) {
+				xStr key = xmlGetProp (root, CXSTR JOURNAL_ATTR_REMOVE_KEY);
+				std::unordered_map<std::string, Document*>::iterator old =
+					byKey.find (key ? CSTR key : "");
+				if (old != byKey.end ()) {
+					added.erase (old->second);
+					data.doclist_->removeDoc (old->second);
+					byKey.erase (old);
+				}
+				xmlFree (key);
+			} else if (nodeNameEq (root, LIB_ELEMENT_LIBRARY)) {
+				LibraryData settings;
+				xmlTextReaderPtr reader = xmlReaderForMemory (
+					record, recordLength, NULL, "UTF-8", 0);
+				try {
+					settings.extractData (reader);
+				} catch (Glib::Exception const &) {
+					xmlFreeTextReader (reader);
+					throw;
+				}
+				xmlFreeTextReader (reader);
+
+				data.manage_target_ = settings.manage_target_;
+				data.manage_braces_ = settings.manage_braces_;
+				data.manage_utf8_ = settings.manage_utf8_;
+				data.library_folder_uri_ = settings.library_folder_uri_;
+				data.library_folder_monitor_ = settings.library_folder_monitor_;
+				std::swap (data.taglist_, settings.taglist_);
+			}
+		} catch (Glib::Exception const &ex) {
+			DEBUG ("Bad journal record: %1", ex.what ());
+			intact = false;
+		}
+		xmlFreeDoc (recordDoc);
+	}
+
+	if (!stamped)
+		return false;
+
+	size_ = journal.size ();
+	if (!intact) {
+		// Whatever follows a torn or damaged record is lost, and appending
+		// after it would lose the new records too
+		DEBUG ("Journal %1 is damaged after %2 bytes", journalfilename_, pos);
+		mustCompact_ = true;
+	}
+
+	return true;
+}
+
+
+bool LibraryJournal::hashDocs (
+	LibraryData &data,
+	HashMap &hashes,
+	std::string *records)
+{
+	DocumentList::Container &docs = data.doclist_->getDocs ();
+	for (DocumentList::Container::iterator it = docs.begin (); it != docs.end (); ++it) {
+		std::string const &key = it->getKey ().raw ();
+		if (key.empty () || hashes.count (key))
+			return false;
+
+		guint64 const revision = it->getRevision ();
+		if (!records) {
+			// The baseline is what is on disk, and only a change to it
+			// needs writing out
+			DocState const state = {revision, false, 0};
+			hashes[key] = state;
+			continue;
+		}
+
+		HashMap::const_iterator const old = docHashes_.find (key);
+		if (old != docHashes_.end () && old->second.revision == revision) {
+			// Revisions are never reused, so it is as it was
+			hashes[key] = old->second;
+			continue;
+		}
+
+		it->updateRelFileName (libfilename_);
+		std::string const xml = docXML (*it);
+		DocState const state = {revision, true, hashString (xml)};
+		hashes[key] = state;
+
+		if (old == docHashes_.end () || !old->second.hashed || old->second.hash != state.hash)
+			appendRecord (*records, xml);
+	}
+
+	return true;
+}
+
+
+void LibraryJournal::setBaseline (LibraryData &data)
+{
+	docHashes_.clear ();
+	hasBaseline_ = hashDocs (data, docHashes_, NULL);
+	settingsHash_ = hashString (settingsXML (data));
+
+	guint64 libsize, libmtime;
+	if (stampLibrary (libsize, libmtime))
+		compactSize_ = std::max ((gsize) JOURNAL_MIN_COMPACT_SIZE, (gsize) libsize / 4);
+}
+
+
+bool LibraryJournal::append (LibraryData &data)
+{
+	if (!hasBaseline_ || mustCompact_)
+		return false;
+
+	HashMap hashes;
+	std::string records;
+	if (!hashDocs (data, hashes, &records))
+		return false;
+
+	for (HashMap::iterator it = docHashes_.begin (); it != docHashes_.end (); ++it) {
+		if (hashes.count (it->first))
+			continue;
+
+		MemoryWriter writer;
+		xmlTextWriterStartElement (writer.get (), XSTR JOURNAL_ELEMENT_REMOVE);
+		xmlTextWriterWriteAttribute (writer.get (), XSTR JOURNAL_ATTR_REMOVE_KEY, XSTR it->first.c_str ());
+		xmlTextWriterEndElement (writer.get ());
+		appendRecord (records, writer.finish ());
+	}
+
+	std::string const settings = settingsXML (data);
+	size_t const settingsHash = hashString (settings);
+	if (settingsHash != settingsHash_)
+		appendRecord (records, settings);
+
+	if (records.empty ())
+		return true;
+
+	if (size_ + records.size () > compactSize_) {
+		DEBUG ("Journal %1 is due for compaction", journalfilename_);
+		return false;
+	}
+
+	try {
+		Glib::RefPtr<Gio::File> file = Gio::File::create_for_uri (journalfilename_);
+		Glib::RefPtr<Gio::FileOutputStream> stream;
+		if (size_ == 0) {
+			guint64 libsize, libmtime;
+			if (!stampLibrary (libsize, libmtime))
+				return false;
+
+			MemoryWriter writer;
+			xmlTextWriterStartElement (writer.get (), XSTR JOURNAL_ELEMENT_HEADER);
+			xmlTextWriterWriteFormatAttribute (writer.get (), XSTR JOURNAL_ATTR_HEADER_SIZE,
+				"%" G_GUINT64_FORMAT, libsize);
+			xmlTextWriterWriteFormatAttribute (writer.get (), XSTR JOURNAL_ATTR_HEADER_MTIME,
+				"%" G_GUINT64_FORMAT, libmtime);
+			xmlTextWriterEndElement (writer.get ());
+
+			std::string header;
+			appendRecord (header, writer.finish ());
+			records.insert (0, header);
+			stream = file->replace ();
+		} else {
+			stream = file->append_to ();
+		}
+
+		gsize written = 0;
+		stream->write_all (records, written);
+		stream->close ();
+	} catch (Glib::Exception const &ex) {
+		DEBUG ("Couldn't append to %1: %2", journalfilename_, ex.what ());
+		mustCompact_ = true;
+		return false;
+	}
+
+	size_ += records.size ();
+	docHashes_.swap (hashes);
+	settingsHash_ = settingsHash;
+
+	return true;
+}
+
+
+void LibraryJournal::discard ()
+{
+	try {
+		Gio::File::create_for_uri (journalfilename_)->remove ();
+	} catch (Gio::Error const &ex) {
+		if (ex.code () != Gio::Error::NOT_FOUND)
+			DEBUG ("Couldn't remove %1: %2", journalfilename_, ex.what ());
+	}
+
+	size_ = 0;
+	mustCompact_ = false;
+}
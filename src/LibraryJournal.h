@@ -0,0 +1,105 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#ifndef LIBRARYJOURNAL_H
+#define LIBRARYJOURNAL_H
+
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#include <glib.h>
+#include <glibmm/ustring.h>
+
+class Document;
+struct LibraryData;
+
+/**
+ * <p>An append-only log of changes made to a library since its 'reflib' file
+ * was last written in full. It lives next to the reflib as
+ * <tt>&lt;name&gt;.reflib.journal</tt>.</p>
+ *
+ * <p>Each record holds a single XML element: a document as it is written in
+ * the reflib, the key of a removed document, or the library's settings and
+ * tags. The first record stamps the size and modification time of the reflib
+ * the journal applies to, so a journal left behind by an older reflib is
+ * never replayed.</p>
+ *
+ * <p>Documents are told apart by their keys. A library with empty or
+ * duplicate keys cannot be journalled and is always saved in full.</p>
+ */
+class LibraryJournal {
+	public:
+	LibraryJournal (Glib::ustring const &libfilename);
+
+	Glib::ustring const &getLibFilename () const {return libfilename_;}
+
+	/**
+	 * Applies the journal, if there is one for the reflib as it is on disk, to
+	 * <c>data</c>, which must hold what the reflib contains.
+	 *
+	 * @param added receives the documents added or replaced by the journal.
+	 * Their filenames have not been resolved against the library yet.
+	 * @return true if a journal was replayed.
+	 */
+	bool replay (LibraryData &data, std::set<Document*> &added);
+	/**
+	 * Records <c>data</c> as what the reflib and the journal hold together,
+	 * so that \ref append() only logs what changed after this. Only the
+	 * documents' keys and revisions are taken, so nothing is written out.
+	 */
+	void setBaseline (LibraryData &data);
+	/**
+	 * Appends whatever changed in <c>data</c> since the baseline.
+	 *
+	 * @return false if the changes could not be journalled and the library
+	 * must be saved in full instead, e.g. because the journal has grown
+	 * big enough to be worth compacting.
+	 */
+	bool append (LibraryData &data);
+	/**
+	 * Deletes the journal, after the reflib has been written in full.
+	 */
+	void discard ();
+
+	private:
+	/* What a document was like at the baseline or when last journalled */
+	struct DocState {
+		/* Its revision then, so that it needn't be written out again
+		 * to tell that it hasn't changed */
+		guint64 revision;
+		/* The hash of its XML, once it has been written out, so that a
+		 * change which is undone again isn't journalled */
+		bool hashed;
+		size_t hash;
+	};
+	typedef std::unordered_map<std::string, DocState> HashMap;
+
+	bool stampLibrary (guint64 &size, guint64 &mtime) const;
+	bool hashDocs (LibraryData &data, HashMap &hashes, std::string *records);
+
+	Glib::ustring libfilename_;
+	Glib::ustring journalfilename_;
+
+	/* The state of each document the reflib and journal hold, by key */
+	HashMap docHashes_;
+	size_t settingsHash_;
+	bool hasBaseline_;
+
+	/* Size of the journal on disk, or 0 if it has to be started afresh */
+	gsize size_;
+	/* The size past which the library is compacted on the next save */
+	gsize compactSize_;
+	/* Set when the journal on disk can't safely be appended to */
+	bool mustCompact_;
+};
+
+#endif
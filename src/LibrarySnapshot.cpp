@@ -0,0 +1,336 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#include <cstring>
+#include <stdexcept>
+
+#include <glib/gstdio.h>
+#include <giomm/file.h>
+#include <glibmm/miscutils.h>
+
+#include "DocumentList.h"
+#include "Library.h"
+#include "TagList.h"
+#include "Utility.h"
+
+#include "LibrarySnapshot.h"
+
+
+namespace {
+
+/*
+ * Layout: a header, then the library fields, the tags and the documents.
+ * Integers are in host byte order, strings are a 32 bit byte count followed
+ * by the UTF-8 bytes. A document's notes and extra fields are stored as its
+ * packed payload (see Document::getPayload). Bump the version whenever the
+ * layout changes.
+ */
+char const snapshotMagic[8] = {'R', 'F', 'L', 'S', 'N', 'A', 'P', '1'};
+guint32 const snapshotVersion = 2;
+guint32 const snapshotByteOrder = 0x01020304;
+
+struct SnapshotHeader {
+	char magic[8];
+	guint32 version;
+	guint32 byteOrder;
+	guint64 libSize;
+	gint64 libMtime;
+	guint64 libHash;
+};
+
+class SnapshotWriter {
+	public:
+	void putBytes (void const *bytes, gsize length)
+		{buf_.append (static_cast<char const*>(bytes), length);}
+	void putBool (bool const value) {guint8 v = value; putBytes (&v, sizeof (v));}
+	void putU32 (guint32 const value) {putBytes (&value, sizeof (value));}
+	void putI32 (gint32 const value) {putBytes (&value, sizeof (value));}
+	void putString (std::string const &str)
+	{
+		putU32 (str.size ());
+		buf_.append (str);
+	}
+	void putString (Glib::ustring const &str) {putString (str.raw ());}
+
+	std::string const &getBuffer () const {return buf_;}
+
+	private:
+	std::string buf_;
+};
+
+/*
+ * Reads back what SnapshotWriter wrote, throwing std::runtime_error
+ * rather than reading past the end of a damaged snapshot.
+ */
+class SnapshotReader {
+	public:
+	SnapshotReader (char const *contents, gsize const length)
+		: pos_ (contents), end_ (contents + length) {}
+
+	void getBytes (void *bytes, gsize const length)
+	{
+		ensure (length);
+		memcpy (bytes, pos_, length);
+		pos_ += length;
+	}
+	bool getBool () {guint8 v; getBytes (&v, sizeof (v)); return v != 0;}
+	guint32 getU32 () {guint32 v; getBytes (&v, sizeof (v)); return v;}
+	gint32 getI32 () {gint32 v; getBytes (&v, sizeof (v)); return v;}
+	std::string getRaw ()
+	{
+		guint32 const length = getU32 ();
+		ensure (length);
+		std::string str (pos_, length);
+		pos_ += length;
+		return str;
+	}
+	Glib::ustring getString () {return Glib::ustring (getRaw ());}
+
+	bool atEnd () const {return pos_ == end_;}
+
+	private:
+	void ensure (gsize const length) const
+	{
+		if ((gsize)(end_ - pos_) < length)
+			throw std::runtime_error ("truncated snapshot");
+	}
+
+	char const *pos_;
+	char const *end_;
+};
+
+/* 64 bit FNV-1a, only used to tell whether the reflib changed */
+guint64 hashBytes (char const *bytes, gsize const length)
+{
+	guint64 hash = G_GUINT64_CONSTANT (14695981039346656037);
+	for (gsize i = 0; i < length; ++i) {
+		hash ^= (guchar) bytes[i];
+		hash *= G_GUINT64_CONSTANT (1099511628211);
+	}
+	return hash;
+}
+
+}
+
+
+LibrarySnapshot::LibrarySnapshot (Glib::ustring const &libfilename)
+	: libfilename_ (libfilename)
+{
+	libpath_ = Gio::File::create_for_uri (libfilename)->get_path ();
+	if (!libpath_.empty ()) {
+		path_ = Glib::build_filename (
+			Glib::path_get_dirname (libpath_),
+			"." + Glib::path_get_basename (libpath_) + ".snapshot");
+	}
+}
+
+
+bool LibrarySnapshot::stampLibrary (Stamp &stamp) const
+{
+	GStatBuf st;
+	if (g_stat (libpath_.c_str (), &st) != 0)
+		return false;
+
+	GError *error = NULL;
+	GMappedFile *mapped = g_mapped_file_new (libpath_.c_str (), FALSE, &error);
+	if (!mapped) {
+		DEBUG ("Couldn't map %1: %2", libpath_, error->message);
+		g_error_free (error);
+		return false;
+	}
+
+	stamp.size = st.st_size;
+	stamp.mtime = st.st_mtime;
+	stamp.hash = hashBytes (
+		g_mapped_file_get_contents (mapped),
+		g_mapped_file_get_length (mapped));
+	g_mapped_file_unref (mapped);
+
+	return true;
+}
+
+
+bool LibrarySnapshot::read (LibraryData &data)
+{
+	if (path_.empty ())
+		return false;
+
+	GError *error = NULL;
+	GMappedFile *mapped = g_mapped_file_new (path_.c_str (), FALSE, &error);
+	if (!mapped) {
+		// Most likely there simply isn't a snapshot yet
+		g_error_free (error);
+		return false;
+	}
+
+	bool success = false;
+	try {
+		success = decode (
+			g_mapped_file_get_contents (mapped),
+			g_mapped_file_get_length (mapped),
+			data);
+	} catch (std::exception const &ex) {
+		DEBUG ("Ignoring snapshot %1: %2", path_, ex.what ());
+	}
+	g_mapped_file_unref (mapped);
+
+	if (!success)
+		data.clear ();
+
+	return success;
+}
+
+
+bool LibrarySnapshot::decode (
+	char const *contents,
+	gsize const length,
+	LibraryData &data)
+{
+	SnapshotReader in (contents, length);
+
+	SnapshotHeader header;
+	in.getBytes (&header, sizeof (header));
+	if (memcmp (header.magic, snapshotMagic, sizeof (snapshotMagic)) != 0
+	    || header.version != snapshotVersion
+	    || header.byteOrder != snapshotByteOrder)
+		return false;
+
+	// Cheap checks first, the hash means reading the whole reflib
+	GStatBuf st;
+	if (g_stat (libpath_.c_str (), &st) != 0
+	    || header.libSize != (guint64) st.st_size
+	    || header.libMtime != (gint64) st.st_mtime)
+		return false;
+
+	Stamp stamp;
+	if (!stampLibrary (stamp) || stamp.hash != header.libHash)
+		return false;
+
+	// Absolute filenames were resolved against the reflib's location
+	if (in.getString () != libfilename_)
+		return false;
+
+	data.manage_target_ = in.getString ();
+	data.manage_braces_ = in.getBool ();
+	data.manage_utf8_ = in.getBool ();
+	data.library_folder_uri_ = in.getString ();
+	data.library_folder_monitor_ = in.getBool ();
+
+	guint32 const tagCount = in.getU32 ();
+	for (guint32 i = 0; i < tagCount; ++i) {
+		gint32 const uid = in.getI32 ();
+		data.taglist_->loadTag (in.getString (), uid);
+	}
+
+	DocumentList::Container docs;
+	guint32 const docCount = in.getU32 ();
+	for (guint32 i = 0; i < docCount; ++i) {
+		Glib::ustring const filename = in.getString ();
+		Glib::ustring const relfilename = in.getString ();
+		Glib::ustring const key = in.getString ();
+
+		std::vector<int> tagUids (in.getU32 ());
+		for (std::vector<int>::iterator it = tagUids.begin (); it != tagUids.end (); ++it)
+			*it = in.getI32 ();
+
+		BibData bib;
+		bib.setType (in.getString ());
+		bib.setDoi (in.getString ());
+		bib.setTitle (in.getString ());
+		bib.setAuthors (in.getString ());
+		bib.setJournal (in.getString ());
+		bib.setVolume (in.getString ());
+		bib.setIssue (in.getString ());
+		bib.setPages (in.getString ());
+		bib.setYear (in.getString ());
+
+		// The filename is already resolved, so the thumbnail request made
+		// by the constructor is the right one
+		docs.emplace (filename, relfilename, "", key, std::move (tagUids), std::move (bib))
+			.setPayload (in.getRaw ());
+	}
+
+	if (!in.atEnd ())
+		throw std::runtime_error ("trailing data in snapshot");
+
+	data.doclist_->appendDocs (docs);
+
+	return true;
+}
+
+
+void LibrarySnapshot::write (LibraryData &data)
+{
+	if (path_.empty ())
+		return;
+
+	Stamp stamp;
+	if (!stampLibrary (stamp))
+		return;
+
+	SnapshotHeader header;
+	memcpy (header.magic, snapshotMagic, sizeof (snapshotMagic));
+	header.version = snapshotVersion;
+	header.byteOrder = snapshotByteOrder;
+	header.libSize = stamp.size;
+	header.libMtime = stamp.mtime;
+	header.libHash = stamp.hash;
+
+	SnapshotWriter out;
+	out.putBytes (&header, sizeof (header));
+	out.putString (libfilename_);
+
+	out.putString (data.manage_target_);
+	out.putBool (data.manage_braces_);
+	out.putBool (data.manage_utf8_);
+	out.putString (data.library_folder_uri_);
+	out.putBool (data.library_folder_monitor_);
+
+	TagList::TagMap &tags = data.taglist_->getTags ();
+	out.putU32 (tags.size ());
+	for (TagList::TagMap::iterator it = tags.begin (); it != tags.end (); ++it) {
+		out.putI32 (it->second.uid_);
+		out.putString (it->second.name_);
+	}
+
+	DocumentList::Container &docs = data.doclist_->getDocs ();
+	out.putU32 (docs.size ());
+	for (DocumentList::Container::iterator it = docs.begin (); it != docs.end (); ++it) {
+		out.putString (it->getFileName ());
+		out.putString (it->getRelFileName ());
+		out.putString (it->getKey ());
+
+		std::vector<int> &tagUids = it->getTags ();
+		out.putU32 (tagUids.size ());
+		for (std::vector<int>::iterator uid = tagUids.begin (); uid != tagUids.end (); ++uid)
+			out.putI32 (*uid);
+
+		BibData const &bib = it->getCoreBibData ();
+		out.putString (bib.getType ());
+		out.putString (bib.getDoi ());
+		out.putString (bib.getTitle ());
+		out.putString (bib.getAuthors ());
+		out.putString (bib.getJournal ());
+		out.putString (bib.getVolume ());
+		out.putString (bib.getIssue ());
+		out.putString (bib.getPages ());
+		out.putString (bib.getYear ());
+		// Notes and extras stay packed, and unpacked only when needed
+		out.putString (it->getPayload ());
+	}
+
+	std::string const &buffer = out.getBuffer ();
+	GError *error = NULL;
+	if (!g_file_set_contents (path_.c_str (), buffer.data (), buffer.size (), &error)) {
+		DEBUG ("Couldn't write snapshot %1: %2", path_, error->message);
+		g_error_free (error);
+	}
+}
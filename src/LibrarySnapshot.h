@@ -0,0 +1,62 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#ifndef LIBRARYSNAPSHOT_H
+#define LIBRARYSNAPSHOT_H
+
+#include <string>
+
+#include <glib.h>
+#include <glibmm/ustring.h>
+
+struct LibraryData;
+
+/**
+ * <p>A binary copy of a library, kept next to its 'reflib' file, which can be
+ * mapped and turned back into \ref LibraryData without any XML parsing.</p>
+ *
+ * <p>The reflib stays the only source of truth. A snapshot records the size,
+ * modification time and a hash of the reflib it was taken from, and is
+ * ignored as soon as those no longer match. Snapshots are only kept for
+ * local libraries.</p>
+ */
+class LibrarySnapshot {
+	public:
+	LibrarySnapshot (Glib::ustring const &libfilename);
+
+	/**
+	 * Fills <c>data</c>, which must be empty, from the snapshot.
+	 *
+	 * @return false if there is no usable snapshot for the reflib as it is
+	 * on disk right now, in which case <c>data</c> is left empty.
+	 */
+	bool read (LibraryData &data);
+	/**
+	 * Replaces the snapshot with one of <c>data</c>, which must be what the
+	 * reflib on disk contains. Failures are logged and otherwise ignored.
+	 */
+	void write (LibraryData &data);
+
+	private:
+	struct Stamp {
+		guint64 size;
+		gint64 mtime;
+		guint64 hash;
+	};
+	bool stampLibrary (Stamp &stamp) const;
+	bool decode (char const *contents, gsize length, LibraryData &data);
+
+	Glib::ustring libfilename_;
+	std::string libpath_;
+	std::string path_;
+};
+
+#endif
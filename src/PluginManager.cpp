@@ -49,6 +49,26 @@ referencer_download(PyObject *, PyObject *args)
 	return ret;
 }
 
+namespace {
+
+class DictFiller : public FieldVisitor {
+	public:
+	DictFiller (PyObject *dict) : dict_ (dict) {}
+
+	bool visit (char const *name, char const *value)
+	{
+		PyObject *pyValue = PyUnicode_FromString (value);
+		PyDict_SetItemString (dict_, name, pyValue);
+		Py_DECREF (pyValue);
+		return true;
+	}
+
+	private:
+	PyObject *dict_;
+};
+
+}
+
 /**
  * Convert a bibtex snippet into a dictionary of key/value 
  * pairs compatible with set_field in PythonDocument
@@ -64,20 +84,10 @@ referencer_bibtex_to_fields (PyObject *, PyObject *args)
 	Document doc;
 	doc.parseBibtex (bibtex_str);
 
-	/* Retrieve STL map of fields */
-	Document::FieldMap fields = doc.getFields ();
-
-	/* Convert STL map to python dict */
+	/* Copy the fields straight into a python dict */
 	PyObject *dict = PyDict_New();
-
-	Document::FieldMap::iterator fieldIter = fields.begin ();
-	Document::FieldMap::iterator const fieldEnd = fields.end ();
-	for (; fieldIter != fieldEnd; ++fieldIter) {
-		PyDict_SetItem (
-			dict,
-			PyUnicode_FromString (fieldIter->first.c_str()),
-			PyUnicode_FromString (fieldIter->second.c_str()));
-	}
+	DictFiller filler (dict);
+	doc.forEachField (filler);
 
 	return dict;
 }
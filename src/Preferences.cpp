@@ -22,6 +22,9 @@ Preferences *_global_prefs;
 #define CONF_PATH "/apps/referencer"
 #define LIST_VIEW "list"
 #define ICON_VIEW "icon"
+#define SKIP_DUPLICATES "skip"
+#define MERGE_DUPLICATES "merge"
+#define FLAG_DUPLICATES "flag"
 
 Preferences::Preferences ()
 {
@@ -194,6 +197,53 @@ sigc::signal<void>& Preferences::getWorkOfflineSignal ()
 	return workofflinesignal_;
 }
 
+
+bool Preferences::getJournalSave ()
+{
+	return m_settings->get_boolean("journal-save");
+}
+
+
+void Preferences::setJournalSave (bool const &journal)
+{
+	m_settings->set_boolean("journal-save", journal);
+}
+
+
+bool Preferences::getCompressLibrary ()
+{
+	return m_settings->get_boolean("compress-library");
+}
+
+
+void Preferences::setCompressLibrary (bool const &compress)
+{
+	m_settings->set_boolean("compress-library", compress);
+}
+
+
+DocumentList::DuplicatePolicy Preferences::getDuplicatePolicy ()
+{
+	Glib::ustring const policy = m_settings->get_string("duplicate-policy");
+	if (policy == SKIP_DUPLICATES)
+		return DocumentList::DUPLICATES_SKIP;
+	else if (policy == MERGE_DUPLICATES)
+		return DocumentList::DUPLICATES_MERGE;
+	else
+		return DocumentList::DUPLICATES_FLAG;
+}
+
+
+void Preferences::setDuplicatePolicy (DocumentList::DuplicatePolicy const &policy)
+{
+	char const *value = FLAG_DUPLICATES;
+	if (policy == DocumentList::DUPLICATES_SKIP)
+		value = SKIP_DUPLICATES;
+	else if (policy == DocumentList::DUPLICATES_MERGE)
+		value = MERGE_DUPLICATES;
+	m_settings->set_string("duplicate-policy", value);
+}
+
 sigc::signal<void>& Preferences::getPluginDisabledSignal ()
 {
 	return plugindisabledsignal_;
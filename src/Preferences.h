@@ -18,6 +18,7 @@
 #include <gtkmm.h>
 
 #include "Utility.h"
+#include "DocumentList.h"
 #include "PluginManager.h"
 
 class Preferences {
@@ -129,6 +130,15 @@ public:
 	void setWorkOffline (bool const &offline);
 	sigc::signal<void>& getWorkOfflineSignal ();
 
+	bool getJournalSave ();
+	void setJournalSave (bool const &journal);
+
+	bool getCompressLibrary ();
+	void setCompressLibrary (bool const &compress);
+
+	DocumentList::DuplicatePolicy getDuplicatePolicy ();
+	void setDuplicatePolicy (DocumentList::DuplicatePolicy const &policy);
+
 	sigc::signal<void>& getPluginDisabledSignal ();
 
 	bool getUseListView ();
@@ -5,58 +5,122 @@
 #include <structmember.h>
 
 #include "Document.h"
+#include "DocumentList.h"
 #include "Utility.h"
 
 #include "PythonDocument.h"
 
+referencer_document *referencer_document_new (Document *doc)
+{
+	referencer_document *pDoc =
+		PyObject_New (referencer_document, &t_referencer_document);
+	pDoc->doc_ = doc;
+	pDoc->listSerial_ = 0;
+	pDoc->handle_ = DocumentHandle ();
+
+	DocumentList *list = doc->getList ();
+	if (list) {
+		pDoc->listSerial_ = list->getSerial ();
+		pDoc->handle_ = list->getHandle (doc);
+	}
+
+	return pDoc;
+}
+
+/*
+ * The wrapped document, or NULL with a Python exception set if it has
+ * been removed from its library since it was wrapped
+ */
+static Document *documentOf (PyObject *self)
+{
+	referencer_document *pDoc = (referencer_document*)self;
+	if (!pDoc->listSerial_)
+		return pDoc->doc_;
+
+	DocumentList *list = DocumentList::findBySerial (pDoc->listSerial_);
+	if (list && list->getDoc (pDoc->handle_) == pDoc->doc_)
+		return pDoc->doc_;
+
+	PyErr_SetString (PyExc_ReferenceError, "The document is no longer in the library");
+	return NULL;
+}
+
 static PyObject *referencer_document_get_key (PyObject *self, PyObject *)
 {
-	Glib::ustring value = ((referencer_document*)self)->doc_->getKey ();
+	Document *doc = documentOf (self);
+	if (!doc)
+		return NULL;
+
+	Glib::ustring value = doc->getKey ();
 	return PyUnicode_FromString(value.c_str());
 }
 
 
 static PyObject *referencer_document_set_key (PyObject *self, PyObject *args)
 {
+	Document *doc = documentOf (self);
+	if (!doc)
+		return NULL;
+
 	PyObject *value = PyTuple_GetItem (args, 0);
-	((referencer_document*)self)->doc_->setKey (PyUnicode_AsUTF8(value));
+	doc->setKey (PyUnicode_AsUTF8(value));
 	return Py_BuildValue ("i", 0);
 }
 
 
 static PyObject *referencer_document_get_filename (PyObject *self, PyObject *)
 {
-	Glib::ustring value = ((referencer_document*)self)->doc_->getFileName ();
+	Document *doc = documentOf (self);
+	if (!doc)
+		return NULL;
+
+	Glib::ustring value = doc->getFileName ();
 	return PyUnicode_FromString(value.c_str());
 }
 
 
 static PyObject *referencer_document_set_filename (PyObject *self, PyObject *args)
 {
+	Document *doc = documentOf (self);
+	if (!doc)
+		return NULL;
+
 	PyObject *value = PyTuple_GetItem (args, 0);
-	((referencer_document*)self)->doc_->setFileName (PyUnicode_AsUTF8(value));
+	doc->setFileName (PyUnicode_AsUTF8(value));
 	return Py_BuildValue ("i", 0);
 }
 
 static PyObject *referencer_document_get_notes(PyObject *self, PyObject *)
 {
-	Glib::ustring value = ((referencer_document*)self)->doc_->getNotes ();
+	Document *doc = documentOf (self);
+	if (!doc)
+		return NULL;
+
+	Glib::ustring value = doc->getNotes ();
 	return PyUnicode_FromString(value.c_str());
 }
 
 
 static PyObject *referencer_document_set_notes (PyObject *self, PyObject *args)
 {
+	Document *doc = documentOf (self);
+	if (!doc)
+		return NULL;
+
 	PyObject *value = PyTuple_GetItem (args, 0);
-	((referencer_document*)self)->doc_->setNotes (PyUnicode_AsUTF8(value));
+	doc->setNotes (PyUnicode_AsUTF8(value));
 	return Py_BuildValue ("i", 0);
 }
 
 
 static PyObject *referencer_document_get_type (PyObject *self, PyObject *)
 {
+	Document *doc = documentOf (self);
+	if (!doc)
+		return NULL;
+
 	try {
-		Glib::ustring value = ((referencer_document*)self)->doc_->getBibData().getType();
+		Glib::ustring value = doc->getBibData().getType();
 		return PyUnicode_FromString(value.c_str());
 	} catch (std::exception &ex) {
 		PyErr_SetString (PyExc_KeyError, ex.what());
@@ -67,18 +131,26 @@ static PyObject *referencer_document_get_type (PyObject *self, PyObject *)
 
 static PyObject *referencer_document_set_type (PyObject *self, PyObject *args)
 {
+	Document *doc = documentOf (self);
+	if (!doc)
+		return NULL;
+
 	PyObject *value = PyTuple_GetItem (args, 0);
-	((referencer_document*)self)->doc_->getBibData().setType (PyUnicode_AsUTF8(value));
+	doc->getBibData().setType (PyUnicode_AsUTF8(value));
 	return Py_BuildValue ("i", 0);
 }
 
 
 static PyObject *referencer_document_get_field (PyObject *self, PyObject *args)
 {
+	Document *doc = documentOf (self);
+	if (!doc)
+		return NULL;
+
 	PyObject *fieldName = PyTuple_GetItem (args, 0);
 
 	try {
-		Glib::ustring value = ((referencer_document*)self)->doc_->getField (PyUnicode_AsUTF8(fieldName));
+		Glib::ustring value = doc->getField (PyUnicode_AsUTF8(fieldName));
 		return PyUnicode_FromString(value.c_str());
 	}
 	catch (std::range_error &ex) { /* unknown field */
@@ -105,24 +177,35 @@ static PyObject *referencer_document_set_fields (PyObject *, PyObject *)
 
 static PyObject *referencer_document_set_field (PyObject *self, PyObject *args)
 {
+	Document *doc = documentOf (self);
+	if (!doc)
+		return NULL;
+
 	PyObject *fieldName = PyTuple_GetItem (args, 0);
 	PyObject *value = PyTuple_GetItem (args, 1);
-	((referencer_document*)self)->doc_->setField (PyUnicode_AsUTF8(fieldName), PyUnicode_AsUTF8(value));
+	doc->setField (PyUnicode_AsUTF8(fieldName), PyUnicode_AsUTF8(value));
 	return Py_BuildValue ("i", 0);
 }
 
 
 static PyObject *referencer_document_parse_bibtex (PyObject *self, PyObject *args)
 {
+	Document *doc = documentOf (self);
+	if (!doc)
+		return NULL;
+
 	PyObject *bibtex = PyTuple_GetItem (args, 0);
-	((referencer_document*)self)->doc_->parseBibtex (PyUnicode_AsUTF8(bibtex));
+	doc->parseBibtex (PyUnicode_AsUTF8(bibtex));
 	return Py_BuildValue ("i", 0);
 }
 
 static PyObject *referencer_document_print_bibtex (PyObject *self, PyObject *args)
 {
 	/* Parse arguments */
-	Document *doc = ((referencer_document*)self)->doc_;
+	Document *doc = documentOf (self);
+	if (!doc)
+		return NULL;
+
 	bool useBraces = (PyTuple_GetItem (args, 0) == Py_True);
 	bool utf8 = (PyTuple_GetItem (args, 1) == Py_True);
 
@@ -4,15 +4,27 @@
 
 #include <Python.h>
 
+#include "DocumentSlab.h"
+
 class Document;
 
 /* Does this need to be in the header? */
 typedef struct {
 	PyObject_HEAD
 	Document *doc_;
+	/* For a document in a library: the list's serial and the document's
+	 * handle, which show whether doc_ is still there */
+	guint32 listSerial_;
+	DocumentHandle handle_;
 } referencer_document;
 
 
 extern PyTypeObject t_referencer_document;
 
+/*
+ * Wraps doc for a plugin. Once a document in a library has been removed,
+ * the wrapper raises an exception rather than touch it.
+ */
+referencer_document *referencer_document_new (Document *doc);
+
 #endif
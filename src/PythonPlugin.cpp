@@ -217,9 +217,7 @@ int PythonPlugin::canResolve (Document &doc)
 	if (pCanResolveFunc_ == NULL)
 		return -1;
 
-	referencer_document *pDoc =
-		PyObject_New (referencer_document, &t_referencer_document);
-	pDoc->doc_ = &doc;
+	referencer_document *pDoc = referencer_document_new (&doc);
 
 	PyObject *pArgs = NULL;
 	pArgs = Py_BuildValue ("(O)", pDoc);
@@ -277,9 +275,7 @@ bool PythonPlugin::doAction (Glib::ustring const function, std::vector<Document*
 	std::vector<Document*>::iterator it = docs.begin ();
 	std::vector<Document*>::iterator const end = docs.end ();
 	for (int i = 0; it != end; ++it, ++i) {
-		referencer_document *pDoc =
-			PyObject_New (referencer_document, &t_referencer_document);
-		pDoc->doc_ = (*it);
+		referencer_document *pDoc = referencer_document_new (*it);
 		PyList_SetItem (pDocList, i, (PyObject*)pDoc);
 	}
 	
@@ -317,9 +313,7 @@ bool PythonPlugin::updateSensitivity (Glib::ustring const function, std::vector<
 	std::vector<Document*>::iterator it = docs.begin ();
 	std::vector<Document*>::iterator const end = docs.end ();
 	for (int i = 0; it != end; ++it, ++i) {
-		referencer_document *pDoc =
-			PyObject_New (referencer_document, &t_referencer_document);
-		pDoc->doc_ = (*it);
+		referencer_document *pDoc = referencer_document_new (*it);
 		PyList_SetItem (pDocList, i, (PyObject*)pDoc);
 	}
 	
@@ -419,9 +413,7 @@ void PythonPlugin::displayException ()
 bool PythonPlugin::resolveID (Document &doc, PluginCapability::Identifier id)
 {
 	bool success = false;
-	referencer_document *pDoc =
-		PyObject_New (referencer_document, &t_referencer_document);
-	pDoc->doc_ = &doc;
+	referencer_document *pDoc = referencer_document_new (&doc);
 
 	PyObject *pArgs = NULL;
 	switch (id) {
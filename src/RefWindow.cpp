@@ -44,8 +44,10 @@ RefWindow::RefWindow ()
 	ignoreDocSelectionChanged_ = false;
 
 	dirty_ = false;
+	dirtyGeneration_ = 0;
 
 	library_ = new Library (*this);
+	duplicatefinder_ = new DuplicateFinder (*library_);
 
 	constructUI ();
 
@@ -78,6 +80,7 @@ RefWindow::~RefWindow ()
 
 	delete progress_;
 	delete docpropertiesdialog_;
+	delete duplicatefinder_;
 	delete library_;	
 }
 
@@ -177,6 +180,10 @@ void RefWindow::constructUI ()
 			_global_prefs->getUseListView ()));
 	docview_->getSelectionChangedSignal ().connect (
 		sigc::mem_fun (*this, &RefWindow::docSelectionChanged));
+	docview_->getDocChangedSignal ().connect (
+		sigc::mem_fun (*duplicatefinder_, &DuplicateFinder::update));
+	docview_->getDocsAddedSignal ().connect (
+		sigc::mem_fun (*duplicatefinder_, &DuplicateFinder::updateDocs));
 	
 	// The header and wrapper for the notes view
 	notespane_ = Gtk::manage (new Gtk::VBox ());
@@ -486,6 +493,9 @@ void RefWindow::constructMenu ()
 	actiongroup_->add( Gtk::Action::create("ExportNotes",
 		Gtk::Stock::CONVERT, _("Export Notes as HTML")),
  	sigc::mem_fun(*this, &RefWindow::onNotesExport));
+	actiongroup_->add( Gtk::Action::create("FindDuplicates",
+		Gtk::Stock::FIND, _("Find _Near Duplicates...")),
+ 	sigc::mem_fun(*this, &RefWindow::onFindDuplicates));
 
 	actiongroup_->add ( Gtk::Action::create("HelpMenu", _("_Help")) );
 	actiongroup_->add( Gtk::Action::create(
@@ -1045,6 +1055,9 @@ bool RefWindow::onDelete (GdkEventAny *)
 // says to cancel, or saving failed)
 bool RefWindow::ensureSaved ()
 {
+	// A background save may yet fail, or may leave nothing to save
+	library_->finishSave ();
+
 	if (getDirty ()) {
 		Gtk::MessageDialog dialog (
 			String::ucompose ("<b><big>%1</big></b>"
@@ -1642,6 +1655,7 @@ void RefWindow::onNewLibrary ()
 		clearTagList ();
 		docview_->clear ();
 
+		duplicatefinder_->reset ();
 		library_->clear ();
 
 		populateTagList ();
@@ -1687,6 +1701,8 @@ void RefWindow::onOpenLibrary ()
 		setDirty (false);
 
 		DEBUG ("Calling library_->load on %1", libfile);
+		duplicatefinder_->reset ();
+		docview_->cancelSearch ();
 		if (library_->load (libfile)) {
 			ignoreDocSelectionChanged_ = true;
 			ignoreTagSelectionChanged_ = true;
@@ -1714,20 +1730,21 @@ void RefWindow::onSaveLibrary ()
 	if (openedlib_.empty()) {
 		onSaveAsLibrary ();
 	} else {
-		bool saveReturn;
 		updateNotesPane ();
-		try {
-			saveReturn = library_->save (openedlib_);
-		} catch (const Glib::Exception &ex) {
-			Utility::exceptionDialog (&ex, "Saving");
-		}
-
-		if (saveReturn)
-			setDirty (false);
+		library_->saveAsync (openedlib_, sigc::bind (
+			sigc::mem_fun (*this, &RefWindow::onSaveDone), dirtyGeneration_));
 	}
 }
 
 
+void RefWindow::onSaveDone (bool success, unsigned int generation)
+{
+	// Anything changed since the save started still needs saving
+	if (success && generation == dirtyGeneration_)
+		setDirty (false);
+}
+
+
 void RefWindow::onSaveAsLibrary ()
 {
 	Gtk::FileChooserDialog chooser (
@@ -2041,6 +2058,9 @@ void RefWindow::addDocFiles (std::vector<Glib::ustring> const &filenames)
 	Glib::ustring progresstext;
 
 
+	DocumentList::DuplicatePolicy const duplicatePolicy = _global_prefs->getDuplicatePolicy ();
+	std::vector<Document*> duplicates;
+
 	cancelAddDocFiles_ = false;
 	int n = 0;
 	std::vector<Glib::ustring>::const_iterator it = filenames.begin();
@@ -2053,7 +2073,7 @@ void RefWindow::addDocFiles (std::vector<Glib::ustring> const &filenames)
 			Gtk::Main::iteration ();
 
 		Document *newdoc = library_->getDocList()->newDocWithFile(*it);
-		bool added = false;
+		Glib::ustring outcome = _("Not added");
 		bool gotMetadata = false;
 		bool gotText = false;
 		bool gotId = false;
@@ -2084,17 +2104,33 @@ void RefWindow::addDocFiles (std::vector<Glib::ustring> const &filenames)
 				
 				newdoc->getBibData().setTitle (filename);
 			}
-			
-			/* Add the document to the view */
-			docview_->addDoc (newdoc);
-
-			/* Remember it for the end */
-			addedDocs.push_back (newdoc);
 
-			/* Add-dialog UI fields */
-			added = true;
 			gotId = newdoc->hasField ("doi") || newdoc->hasField ("eprint") || newdoc->hasField ("pmid");
 			key = newdoc->getKey ();
+
+			/* Check whether we already have the paper */
+			Document *original = library_->getDocList()->resolveDuplicate (
+				newdoc, duplicatePolicy);
+			if (original && duplicatePolicy == DocumentList::DUPLICATES_FLAG) {
+				duplicates.push_back (original);
+				duplicates.push_back (newdoc);
+			}
+
+			if (original && duplicatePolicy == DocumentList::DUPLICATES_SKIP) {
+				/* newdoc is gone */
+				outcome = String::ucompose (_("Already have %1"), original->getKey ());
+			} else if (original && duplicatePolicy == DocumentList::DUPLICATES_MERGE) {
+				docview_->updateDoc (original);
+				outcome = String::ucompose (_("Merged into %1"), original->getKey ());
+			} else {
+				/* Add the document to the view */
+				docview_->addDoc (newdoc);
+
+				/* Remember it for the end */
+				addedDocs.push_back (newdoc);
+
+				outcome = original ? _("Added, possible duplicate") : _("Added");
+			}
 				
 		} else {
 			DEBUG ("RefWindow::addDocFiles: Warning: didn't succeed adding '%1'.  Duplicate file?\n", *it);
@@ -2119,7 +2155,7 @@ void RefWindow::addDocFiles (std::vector<Glib::ustring> const &filenames)
 
 		Gtk::TreeModel::iterator newRow = reportModel->append();
 		(*newRow)[keyColumn] = key;
-		(*newRow)[resultColumn] = added ? "Added" : "Not added";
+		(*newRow)[resultColumn] = outcome;
 		(*newRow)[idColumn] = gotId ? yes : no;
 		(*newRow)[textColumn] = gotText ? yes : no;
 		(*newRow)[metadataColumn] = gotMetadata ? yes : no;
@@ -2150,6 +2186,11 @@ void RefWindow::addDocFiles (std::vector<Glib::ustring> const &filenames)
 		}
 	}
 
+	if (!duplicates.empty ()) {
+		library_->flagDuplicates (duplicates);
+		populateTagList ();
+	}
+
 	if (!filenames.empty()) {
 		// We added something
 		// Should check if we actually added something in case a newDoc
@@ -2376,6 +2417,16 @@ void RefWindow::onSearch ()
 {
 	SearchDialog dialog(*library_, *docview_);
 	dialog.run();
+
+	/* Results may have been tagged as duplicates */
+	populateTagList ();
+}
+
+
+void RefWindow::onFindDuplicates ()
+{
+	DuplicatesDialog dialog (*this, *duplicatefinder_);
+	dialog.review ();
 }
 
 
@@ -2678,6 +2729,8 @@ void RefWindow::setOpenedLib (Glib::ustring const &openedlib)
 
 void RefWindow::setDirty (bool const &dirty)
 {
+	if (dirty)
+		++dirtyGeneration_;
 	dirty_ = dirty;
 	actiongroup_->get_action("SaveLibrary")
 		->set_sensitive (dirty_);
@@ -2762,16 +2815,15 @@ void RefWindow::onImport ()
 				format = BibUtils::FORMAT_UNKNOWN;
 		}
 
-		library_->getDocList()->importFromFile (filename, format);
-
+		std::vector<Document*> duplicates;
+		library_->getDocList()->importFromFile (
+			filename, format, _global_prefs->getDuplicatePolicy (), &duplicates);
+		library_->flagDuplicates (duplicates);
+		// The imported documents are in the view already, but not with
+		// the tag they just got
+		docview_->updateDocs (duplicates);
 
 		populateTagList ();
-		/*
-		 * Should iterate over added docs with addDoc
-		 * but this performance hit is acceptable since importing
-		 * is a super-rare operation
-		 */
-		docview_->populateDocStore ();
 		updateStatusBar ();
 	}
 }
@@ -2803,20 +2855,19 @@ void RefWindow::onPasteBibtex (GdkAtom selection)
 		return;
 */
 
+	std::vector<Document*> duplicates;
 	int imported =
-		library_->getDocList()->import (clipboardtext, BibUtils::FORMAT_BIBTEX);
+		library_->getDocList()->import (
+			clipboardtext, BibUtils::FORMAT_BIBTEX,
+			_global_prefs->getDuplicatePolicy (), &duplicates);
+	library_->flagDuplicates (duplicates);
+	docview_->updateDocs (duplicates);
 
 	DEBUG ("Imported %1 references", imported);
 
 	if (imported) {
 
 		populateTagList ();
-		/*
-		 * FIXME  should get the Document* from the import
-		 * call and iterate over them with addDoc to be 
-		 * more efficient and not risk losing selection
-		 */
-		docview_->populateDocStore ();
 		updateStatusBar ();
 		statusbar_->push (String::ucompose
 			(_("Imported %1 BibTeX references"), imported), 0);
@@ -3241,7 +3292,20 @@ void RefWindow::SearchDialog::addSelected ()
 				library_.getDocList()->uniqueKey(newdoc.generateKey(), NULL));
 	}
 
-	documentView_.addDoc (library_.getDocList()->insertDoc(newdoc));
+	DocumentList::DuplicatePolicy const policy = _global_prefs->getDuplicatePolicy ();
+	Document *added = library_.getDocList()->insertDoc(std::move (newdoc));
+	Document *original = library_.getDocList()->resolveDuplicate (added, policy);
+	if (!original) {
+		documentView_.addDoc (added);
+	} else if (policy == DocumentList::DUPLICATES_FLAG) {
+		std::vector<Document*> duplicates;
+		duplicates.push_back (original);
+		duplicates.push_back (added);
+		library_.flagDuplicates (duplicates);
+		documentView_.addDoc (added);
+	} else if (policy == DocumentList::DUPLICATES_MERGE) {
+		documentView_.updateDoc (original);
+	}
 }
 
 bool RefWindow::SearchDialog::pluginsExist ()
@@ -3262,5 +3326,169 @@ bool RefWindow::SearchDialog::pluginsExist ()
 }
 
 
+namespace {
+	int const RESPONSE_MERGE = 1;
+	int const RESPONSE_DISMISS = 2;
+}
+
+
+RefWindow::DuplicatesDialog::DuplicatesDialog (RefWindow &window, DuplicateFinder &finder)
+	: window_ (window), finder_ (finder)
+{
+	set_title (_("Near Duplicates"));
+	set_transient_for (*window_.window_);
+	set_default_size (700, 400);
+
+	Gtk::Box *vbox = get_vbox ();
+	vbox->set_spacing (12);
+
+	label_.set_alignment (0.0, 0.5);
+	vbox->pack_start (label_, false, false, 0);
+	vbox->pack_start (progress_, false, false, 0);
+
+	Gtk::TreeModelColumnRecord columns;
+	columns.add (similarityColumn_);
+	columns.add (firstColumn_);
+	columns.add (secondColumn_);
+	columns.add (firstHandleColumn_);
+	columns.add (secondHandleColumn_);
+	model_ = Gtk::ListStore::create (columns);
+
+	view_.set_model (model_);
+	view_.append_column (_("Similarity"), similarityColumn_);
+	view_.append_column (_("Document"), firstColumn_);
+	view_.append_column (_("Possible Duplicate"), secondColumn_);
+	view_.get_selection ()->signal_changed ().connect (
+		sigc::mem_fun (*this, &RefWindow::DuplicatesDialog::updateSensitivity));
+
+	scroll_.set_policy (Gtk::POLICY_AUTOMATIC, Gtk::POLICY_AUTOMATIC);
+	scroll_.set_shadow_type (Gtk::SHADOW_IN);
+	scroll_.add (view_);
+	vbox->pack_start (scroll_, true, true, 0);
+
+	dismissButton_ = add_button (_("_Not Duplicates"), RESPONSE_DISMISS);
+	mergeButton_ = add_button (_("_Merge"), RESPONSE_MERGE);
+	add_button (Gtk::Stock::CLOSE, Gtk::RESPONSE_CLOSE);
+}
+
+
+void RefWindow::DuplicatesDialog::review ()
+{
+	finder_.start ();
+
+	sigc::connection changed = finder_.getChangedSignal ().connect (
+		sigc::mem_fun (*this, &RefWindow::DuplicatesDialog::populate));
+	sigc::connection pulser = Glib::signal_timeout ().connect (
+		sigc::mem_fun (*this, &RefWindow::DuplicatesDialog::pulse), 100);
+
+	show_all ();
+	get_vbox()->set_border_width (12);
+	populate ();
+
+	int response;
+	while ((response = run ()) == RESPONSE_MERGE || response == RESPONSE_DISMISS) {
+		if (response == RESPONSE_MERGE)
+			merge ();
+		else
+			dismiss ();
+	}
+
+	changed.disconnect ();
+	pulser.disconnect ();
+	hide ();
+}
+
+
+void RefWindow::DuplicatesDialog::populate ()
+{
+	model_->clear ();
+
+	/* Both documents of every candidate are still there */
+	DocumentList *doclist = window_.library_->getDocList ();
+	std::vector<DuplicateFinder::Candidate> const candidates = finder_.getCandidates ();
+	std::vector<DuplicateFinder::Candidate>::const_iterator it = candidates.begin ();
+	for (; it != candidates.end (); ++it) {
+		Document *first = doclist->getDoc (it->first);
+		Document *second = doclist->getDoc (it->second);
+
+		Gtk::TreeModel::iterator row = model_->append ();
+		(*row)[similarityColumn_] =
+			String::ucompose ("%1", (int) (it->similarity * 100.0 + 0.5)) + "%";
+		(*row)[firstColumn_] = String::ucompose ("%1: %2",
+			first->getKey (), first->getCoreBibData ().getTitle ());
+		(*row)[secondColumn_] = String::ucompose ("%1: %2",
+			second->getKey (), second->getCoreBibData ().getTitle ());
+		(*row)[firstHandleColumn_] = it->first;
+		(*row)[secondHandleColumn_] = it->second;
+	}
+
+	if (finder_.isRunning ()) {
+		label_.set_text (_("Looking for documents with similar titles and authors..."));
+		progress_.show ();
+	} else {
+		label_.set_text (String::ucompose (
+			_("%1 pairs of documents have similar titles and authors"),
+			candidates.size ()));
+		progress_.hide ();
+	}
+
+	updateSensitivity ();
+}
+
+
+bool RefWindow::DuplicatesDialog::pulse ()
+{
+	if (!finder_.isRunning ())
+		return false;
 
+	progress_.pulse ();
+	return true;
+}
 
+
+void RefWindow::DuplicatesDialog::updateSensitivity ()
+{
+	bool const selected = view_.get_selection ()->count_selected_rows () > 0;
+	mergeButton_->set_sensitive (selected);
+	dismissButton_->set_sensitive (selected);
+}
+
+
+/*
+ * Merge the second document of the selected pair into the first
+ */
+void RefWindow::DuplicatesDialog::merge ()
+{
+	Gtk::TreeModel::iterator row = view_.get_selection ()->get_selected ();
+	if (!row)
+		return;
+
+	DocumentList *doclist = window_.library_->getDocList ();
+	Document *first = doclist->getDoc ((*row)[firstHandleColumn_]);
+	Document *second = doclist->getDoc ((*row)[secondHandleColumn_]);
+	if (first && second) {
+		window_.docview_->removeDoc (second);
+		doclist->mergeDoc (first, second);
+		window_.docview_->updateDoc (first);
+
+		window_.setDirty (true);
+		window_.updateTagSizes ();
+		window_.updateStatusBar ();
+	}
+
+	populate ();
+}
+
+
+void RefWindow::DuplicatesDialog::dismiss ()
+{
+	Gtk::TreeModel::iterator row = view_.get_selection ()->get_selected ();
+	if (!row)
+		return;
+
+	DuplicateFinder::Candidate candidate;
+	candidate.first = (*row)[firstHandleColumn_];
+	candidate.second = (*row)[secondHandleColumn_];
+	finder_.dismiss (candidate);
+	model_->erase (row);
+}
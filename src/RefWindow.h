@@ -18,6 +18,7 @@
 
 #include <gtkmm.h>
 
+#include "DuplicateFinder.h"
 #include "Plugin.h"
 
 class Document;
@@ -164,6 +165,7 @@ class RefWindow {
 		void onAddDocFile ();
 		void onAddDocFolder ();
 		void onSearch ();
+		void onFindDuplicates ();
 
 		/* Helpers for addDocFiles */
 		void onAddDocFilesCancel       (Gtk::Button *button, Gtk::ProgressBar *progress);
@@ -234,6 +236,38 @@ class RefWindow {
 			Gtk::TreeModelColumn<Glib::ustring> resultAuthorColumn_;
 		};
 
+		/* Lets the user go through the pairs DuplicateFinder comes up with */
+		class DuplicatesDialog : public Gtk::Dialog {
+			public:
+			DuplicatesDialog (RefWindow &window, DuplicateFinder &finder);
+			void review ();
+
+			private:
+			RefWindow &window_;
+			DuplicateFinder &finder_;
+
+			void populate ();
+			bool pulse ();
+			void updateSensitivity ();
+			void merge ();
+			void dismiss ();
+
+			Gtk::Label label_;
+			Gtk::ProgressBar progress_;
+			Gtk::ScrolledWindow scroll_;
+			Gtk::TreeView view_;
+			Gtk::Button *mergeButton_;
+			Gtk::Button *dismissButton_;
+
+			Glib::RefPtr<Gtk::ListStore>         model_;
+			Gtk::TreeModelColumn<Glib::ustring>  similarityColumn_;
+			Gtk::TreeModelColumn<Glib::ustring>  firstColumn_;
+			Gtk::TreeModelColumn<Glib::ustring>  secondColumn_;
+			Gtk::TreeModelColumn<DocumentHandle> firstHandleColumn_;
+			Gtk::TreeModelColumn<DocumentHandle> secondHandleColumn_;
+		};
+		DuplicateFinder *duplicatefinder_;
+
 		public:
                 void signalException ();
 		void onPasteBibtex (GdkAtom selection);
@@ -252,6 +286,7 @@ class RefWindow {
 		void onAbout ();
 		void onNewLibrary ();
 		void onSaveLibrary ();
+		void onSaveDone (bool success, unsigned int generation);
 		void onSaveAsLibrary ();
 		void onOpenLibrary ();
 		void onExportBibtex ();
@@ -287,6 +322,8 @@ class RefWindow {
 		bool ensureSaved ();
 		bool getDirty () {return dirty_;}
 		bool dirty_;
+		/* Counts changes, so a save knows if any were made while it ran */
+		unsigned int dirtyGeneration_;
 
 		/* Remember which file is open */
 		Glib::ustring openedlib_;
@@ -0,0 +1,551 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+#include <algorithm>
+#include <cstring>
+
+#include "BibData.h"
+#include "ChangeStamp.h"
+#include "Document.h"
+#include "DocumentSlab.h"
+#include "SubstringSearch.h"
+
+#include "SearchIndex.h"
+
+
+namespace {
+
+/*
+ * Gathers a document's searchable text as it is stored, NUL after each
+ * value, which is quick enough for the main thread. Casefolding it is left
+ * to whoever indexes it.
+ */
+class TextCollector : public FieldVisitor {
+	public:
+	TextCollector (std::string &text) : text_ (text) {}
+
+	bool visit (char const *, char const *value)
+	{
+		text_ += value;
+		text_ += '\0';
+		return true;
+	}
+
+	private:
+	std::string &text_;
+};
+
+
+bool isSpace (char const *p)
+{
+	if (!(*p & 0x80))
+		return *p == '\0' || g_ascii_isspace (*p);
+	return g_unichar_isspace (g_utf8_get_char (p));
+}
+
+
+/*
+ * Finds the next whitespace separated word of UTF-8 text, leaving p just
+ * after it. Returns false once there are no more.
+ */
+bool nextWord (char const *&p, char const *const end, char const *&word, size_t &length)
+{
+	while (p < end && isSpace (p))
+		p = g_utf8_next_char (p);
+	if (p >= end)
+		return false;
+
+	word = p;
+	while (p < end && !isSpace (p))
+		p = g_utf8_next_char (p);
+	if (p > end)
+		p = end;
+	length = p - word;
+	return true;
+}
+
+
+bool startsBefore (size_t const offset, std::pair<size_t, guint32> const &start)
+{
+	return offset < start.first;
+}
+
+}
+
+
+SearchIndex::SearchIndex ()
+	: deadVocabulary_ (0), deadTexts_ (0), indexed_ (0), removals_ (0),
+	  cleared_ (0), seen_ (0), invalidations_ (0)
+{
+}
+
+
+void SearchIndex::clear ()
+{
+	Glib::Threads::Mutex::Lock lock (mutex_);
+	tokens_.clear ();
+	ids_.clear ();
+	freeTokens_.clear ();
+	vocabulary_.clear ();
+	starts_.clear ();
+	deadVocabulary_ = 0;
+	texts_.clear ();
+	deadTexts_ = 0;
+	entries_.clear ();
+	indexed_ = 0;
+	removedAt_.clear ();
+	// Changes collected before are for documents which are gone
+	cleared_ = ++removals_;
+	seen_ = 0;
+}
+
+
+std::vector<std::string> SearchIndex::splitTerms (Glib::ustring const &text)
+{
+	std::vector<std::string> terms;
+	std::string const folded = text.casefold ().raw ();
+	char const *p = folded.data ();
+	char const *const end = p + folded.size ();
+	char const *word;
+	size_t length;
+	while (nextWord (p, end, word, length))
+		terms.push_back (std::string (word, length));
+	return terms;
+}
+
+
+guint32 SearchIndex::intern (std::string const &text)
+{
+	std::unordered_map<std::string, guint32>::const_iterator const it = ids_.find (text);
+	if (it != ids_.end ())
+		return it->second;
+
+	guint32 id;
+	if (!freeTokens_.empty ()) {
+		id = freeTokens_.back ();
+		freeTokens_.pop_back ();
+	} else {
+		id = tokens_.size ();
+		tokens_.push_back (Token ());
+	}
+
+	Token &token = tokens_[id];
+	token.offset = vocabulary_.size ();
+	token.length = text.size ();
+	vocabulary_ += text;
+	vocabulary_ += '\0';
+	starts_.push_back (std::make_pair (token.offset, id));
+	ids_.insert (std::make_pair (text, id));
+	return id;
+}
+
+
+void SearchIndex::releaseToken (guint32 const id)
+{
+	Token &token = tokens_[id];
+	ids_.erase (vocabulary_.substr (token.offset, token.length));
+	std::fill (
+		vocabulary_.begin () + token.offset,
+		vocabulary_.begin () + token.offset + token.length,
+		'\0');
+	deadVocabulary_ += token.length + 1;
+	freeTokens_.push_back (id);
+}
+
+
+void SearchIndex::add (
+	DocumentHandle const &handle,
+	Document *doc,
+	guint64 const revision,
+	char const *text,
+	size_t const textLength)
+{
+	guint32 const slot = handle.index;
+	if (slot >= entries_.size ())
+		entries_.resize (slot + 1);
+
+	Entry &entry = entries_[slot];
+	entry.doc = doc;
+	entry.generation = handle.generation;
+	entry.revision = revision;
+	entry.tokens.clear ();
+	entry.text = texts_.size ();
+
+	// Each value as collected, casefolded, NUL after each
+	char const *value = text;
+	char const *const textEnd = text + textLength;
+	while (value < textEnd) {
+		size_t const valueLength = strlen (value);
+		gchar *folded = g_utf8_casefold (value, valueLength);
+		texts_ += folded;
+		texts_ += '\0';
+		g_free (folded);
+		value += valueLength + 1;
+	}
+	entry.length = texts_.size () - entry.text;
+
+	std::string scratch;
+	char const *p = texts_.data () + entry.text;
+	char const *const end = p + entry.length;
+	char const *word;
+	size_t length;
+	while (nextWord (p, end, word, length)) {
+		scratch.assign (word, length);
+		entry.tokens.push_back (intern (scratch));
+	}
+	std::sort (entry.tokens.begin (), entry.tokens.end ());
+	entry.tokens.erase (
+		std::unique (entry.tokens.begin (), entry.tokens.end ()),
+		entry.tokens.end ());
+
+	std::vector<guint32>::const_iterator id = entry.tokens.begin ();
+	for (; id != entry.tokens.end (); ++id) {
+		std::vector<guint32> &postings = tokens_[*id].postings;
+		// A freshly loaded slab is in slot order, so this mostly appends
+		if (postings.empty () || postings.back () < slot)
+			postings.push_back (slot);
+		else
+			postings.insert (
+				std::lower_bound (postings.begin (), postings.end (), slot), slot);
+	}
+	++indexed_;
+}
+
+
+void SearchIndex::remove (guint32 const slot)
+{
+	Glib::Threads::Mutex::Lock lock (mutex_);
+	drop (slot);
+
+	// So that changes collected before don't put the document back
+	if (slot >= removedAt_.size ())
+		removedAt_.resize (slot + 1, 0);
+	removedAt_[slot] = ++removals_;
+}
+
+
+void SearchIndex::drop (guint32 const slot)
+{
+	if (slot >= entries_.size () || !entries_[slot].doc)
+		return;
+
+	Entry &entry = entries_[slot];
+	std::vector<guint32>::const_iterator id = entry.tokens.begin ();
+	for (; id != entry.tokens.end (); ++id) {
+		std::vector<guint32> &postings = tokens_[*id].postings;
+		std::vector<guint32>::iterator const posting =
+			std::lower_bound (postings.begin (), postings.end (), slot);
+		if (posting != postings.end () && *posting == slot)
+			postings.erase (posting);
+		if (postings.empty ())
+			releaseToken (*id);
+	}
+
+	deadTexts_ += entry.length;
+	entry.doc = NULL;
+	entry.tokens.clear ();
+	--indexed_;
+}
+
+
+/*
+ * Copies what is still used of each arena into a new one, once most of it
+ * is space left behind
+ */
+void SearchIndex::compact ()
+{
+	if (deadVocabulary_ > vocabulary_.size () / 2) {
+		std::string vocabulary;
+		vocabulary.reserve (vocabulary_.size () - deadVocabulary_);
+		starts_.clear ();
+		for (guint32 id = 0; id < tokens_.size (); ++id) {
+			Token &token = tokens_[id];
+			if (token.postings.empty ())
+				continue;
+			starts_.push_back (std::make_pair (vocabulary.size (), id));
+			vocabulary.append (vocabulary_, token.offset, token.length + 1);
+			token.offset = starts_.back ().first;
+		}
+		vocabulary_.swap (vocabulary);
+		deadVocabulary_ = 0;
+	}
+
+	if (deadTexts_ > texts_.size () / 2) {
+		std::string texts;
+		texts.reserve (texts_.size () - deadTexts_);
+		std::vector<Entry>::iterator entry = entries_.begin ();
+		for (; entry != entries_.end (); ++entry) {
+			if (!entry->doc)
+				continue;
+			size_t const offset = texts.size ();
+			texts.append (texts_, entry->text, entry->length);
+			entry->text = offset;
+		}
+		texts_.swap (texts);
+		deadTexts_ = 0;
+	}
+}
+
+
+/*
+ * Indexes the document again if it is new to the index or has changed
+ * since it was indexed. Returns its slot.
+ */
+guint32 SearchIndex::update (DocumentSlab &docs, Document &doc)
+{
+	DocumentHandle const handle = docs.getHandle (&doc);
+	if (isBehind (handle, doc)) {
+		std::string text;
+		TextCollector collector (text);
+		doc.forEachSearchable (collector);
+		drop (handle.index);
+		add (handle, &doc, doc.getRevision (), text.data (), text.size ());
+	}
+	return handle.index;
+}
+
+
+bool SearchIndex::isBehind (DocumentHandle const &handle, Document const &doc) const
+{
+	guint32 const slot = handle.index;
+	return slot >= entries_.size ()
+		|| entries_[slot].doc != &doc
+		|| entries_[slot].generation != handle.generation
+		|| entries_[slot].revision < doc.getRevision ();
+}
+
+
+bool SearchIndex::collect (DocumentSlab &docs, Changes &changes)
+{
+	// Nothing anywhere has changed since the last look
+	guint64 const current = ChangeStamp::current ();
+	if (current == seen_)
+		return false;
+
+	changes.docs.clear ();
+	changes.text.clear ();
+	changes.revision = current;
+	changes.invalidations = invalidations_;
+
+	Glib::Threads::Mutex::Lock lock (mutex_);
+	changes.removals = removals_;
+	DocumentSlab::iterator it = docs.begin ();
+	DocumentSlab::iterator const end = docs.end ();
+	for (; it != end; ++it) {
+		DocumentHandle const handle = docs.getHandle (&(*it));
+		if (!isBehind (handle, *it))
+			continue;
+
+		Changes::Change change;
+		change.slot = handle.index;
+		change.generation = handle.generation;
+		change.doc = &(*it);
+		change.revision = it->getRevision ();
+		change.text = changes.text.size ();
+		TextCollector collector (changes.text);
+		it->forEachSearchable (collector);
+		change.length = changes.text.size () - change.text;
+		changes.docs.push_back (change);
+	}
+
+	return true;
+}
+
+
+bool SearchIndex::apply (Changes const &changes, gint const *cancelled)
+{
+	Glib::Threads::Mutex::Lock lock (mutex_);
+	// Everything collected has since been cleared away
+	if (cleared_ > changes.removals)
+		return true;
+
+	std::vector<Changes::Change>::const_iterator it = changes.docs.begin ();
+	for (size_t i = 0; it != changes.docs.end (); ++it, ++i) {
+		if (cancelled && i % 256 == 0 && g_atomic_int_get (cancelled))
+			return false;
+
+		// Taken out since, so it may be gone
+		if (it->slot < removedAt_.size () && removedAt_[it->slot] > changes.removals)
+			continue;
+
+		drop (it->slot);
+		add (DocumentHandle (it->slot, it->generation), it->doc, it->revision,
+			changes.text.data () + it->text, it->length);
+	}
+	compact ();
+
+	return true;
+}
+
+
+void SearchIndex::caughtUp (Changes const &changes)
+{
+	// Unless documents older than it were added meanwhile
+	if (changes.invalidations == invalidations_)
+		seen_ = changes.revision;
+}
+
+
+void SearchIndex::refresh (DocumentSlab &docs)
+{
+	Changes changes;
+	if (collect (docs, changes) && apply (changes))
+		caughtUp (changes);
+}
+
+
+bool SearchIndex::refines (
+	std::vector<std::string> const &terms,
+	std::vector<std::string> const &previous)
+{
+	std::vector<std::string>::const_iterator old = previous.begin ();
+	for (; old != previous.end (); ++old) {
+		std::vector<std::string>::const_iterator term = terms.begin ();
+		while (term != terms.end () && term->find (*old) == std::string::npos)
+			++term;
+		if (term == terms.end ())
+			return false;
+	}
+
+	return true;
+}
+
+
+std::vector<Document*> SearchIndex::search (DocumentSlab &docs, Glib::ustring const &text)
+{
+	refresh (docs);
+	return find (splitTerms (text), NULL);
+}
+
+
+std::vector<Document*> SearchIndex::search (
+	DocumentSlab &docs,
+	Glib::ustring const &text,
+	std::vector<Document*> const &within)
+{
+	refresh (docs);
+
+	std::vector<DocumentHandle> handles;
+	handles.reserve (within.size ());
+	std::vector<Document*>::const_iterator it = within.begin ();
+	for (; it != within.end (); ++it)
+		handles.push_back (docs.getHandle (*it));
+	return find (splitTerms (text), &handles);
+}
+
+
+std::vector<Document*> SearchIndex::find (
+	std::vector<std::string> const &terms,
+	std::vector<DocumentHandle> const *within,
+	gint const *cancelled)
+{
+	Glib::Threads::Mutex::Lock lock (mutex_);
+
+	// Past this many candidates, their text outweighs the vocabulary
+	size_t const perDoc = indexed_ ? (texts_.size () - deadTexts_) / indexed_ : 0;
+	if (!within || within->size () * perDoc > vocabulary_.size () - deadVocabulary_)
+		return match (terms, cancelled);
+
+	std::vector<Document*> results;
+	for (size_t i = 0; i < within->size (); ++i) {
+		if (cancelled && i % 1024 == 0 && g_atomic_int_get (cancelled))
+			return std::vector<Document*> ();
+
+		// Without looking at the slab or the documents, which the main
+		// thread may be changing
+		DocumentHandle const &handle = (*within)[i];
+		if (handle.index >= entries_.size ())
+			continue;
+		Entry const &entry = entries_[handle.index];
+		if (entry.doc && entry.generation == handle.generation
+		    && matches (entry, terms))
+			results.push_back (entry.doc);
+	}
+	return results;
+}
+
+
+bool SearchIndex::matches (DocumentSlab &docs, Document *doc, Glib::ustring const &text)
+{
+	if (!docs.contains (doc))
+		return doc->matchesSearch (text);
+
+	Glib::Threads::Mutex::Lock lock (mutex_);
+	guint32 const slot = update (docs, *doc);
+	return matches (entries_[slot], splitTerms (text));
+}
+
+
+bool SearchIndex::matches (Entry const &entry, std::vector<std::string> const &terms) const
+{
+	char const *const text = texts_.data () + entry.text;
+	std::vector<std::string>::const_iterator term = terms.begin ();
+	for (; term != terms.end (); ++term) {
+		if (!findSubstring (text, entry.length, term->data (), term->size ()))
+			return false;
+	}
+
+	return true;
+}
+
+
+std::vector<Document*> SearchIndex::match (std::vector<std::string> terms, gint const *cancelled)
+{
+	std::vector<Document*> results;
+
+	// The longest terms are likely to rule out the most documents
+	std::sort (terms.begin (), terms.end (),
+		[] (std::string const &a, std::string const &b) {return a.size () > b.size ();});
+
+	// How many of the terms each slot has matched so far
+	std::vector<guint32> matched (entries_.size (), 0);
+	size_t candidates = indexed_;
+	char const *const vocabulary = vocabulary_.data ();
+	size_t const size = vocabulary_.size ();
+	for (guint32 t = 0; t < terms.size () && candidates; ++t) {
+		std::string const &term = terms[t];
+		size_t found = 0;
+		size_t offset = 0;
+		while (offset < size && found < candidates) {
+			char const *const hit = findSubstring (
+				vocabulary + offset, size - offset, term.data (), term.size ());
+			if (!hit)
+				break;
+			if (cancelled && g_atomic_int_get (cancelled))
+				return results;
+
+			// The token the hit is in, as no term spans a NUL
+			std::vector<std::pair<size_t, guint32> >::const_iterator const start =
+				std::upper_bound (starts_.begin (), starts_.end (), size_t (hit - vocabulary),
+					startsBefore) - 1;
+			Token const &token = tokens_[start->second];
+			offset = token.offset + token.length + 1;
+
+			std::vector<guint32>::const_iterator slot = token.postings.begin ();
+			for (; slot != token.postings.end (); ++slot) {
+				if (matched[*slot] == t) {
+					matched[*slot] = t + 1;
+					++found;
+				}
+			}
+		}
+		candidates = found;
+	}
+
+	if (!candidates)
+		return results;
+
+	results.reserve (candidates);
+	for (guint32 slot = 0; slot < entries_.size (); ++slot) {
+		if (entries_[slot].doc && matched[slot] == terms.size ())
+			results.push_back (entries_[slot].doc);
+	}
+	return results;
+}
@@ -0,0 +1,243 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <glib.h>
+#include <glibmm/threads.h>
+#include <glibmm/ustring.h>
+
+class Document;
+class DocumentSlab;
+struct DocumentHandle;
+
+/**
+ * <p>An inverted index of the text the search box looks through: every
+ * field, the notes and the key of each document in a \ref DocumentSlab,
+ * casefolded and split into tokens at whitespace. Each token lists the
+ * slots of the documents it turns up in.</p>
+ *
+ * <p>A search term matches a document if it is a substring of any of its
+ * text, and as terms hold no whitespace that is the same as being a
+ * substring of one of its tokens. So a search only scans the tokens, and
+ * documents which match none of the terms are never looked at.</p>
+ *
+ * <p>The tokens are kept end to end in one arena, and so is each
+ * document's casefolded text, so both a search of the whole vocabulary and
+ * a check of a few documents are a scan of contiguous bytes with
+ * findSubstring(). Values are separated by NULs, which no term holds.</p>
+ *
+ * <p>The index catches up with the slab when it is searched: documents
+ * which are new to it, or whose revision moved on since they were indexed,
+ * are tokenised again. Documents have to be taken out with \ref remove()
+ * before they leave the slab.</p>
+ *
+ * <p>Documents may only be read on the main thread. So to catch up off it,
+ * \ref collect() copies the text of the documents the index is behind on,
+ * as it is stored, and \ref apply() casefolds and tokenises that on a worker
+ * thread, where \ref find() can then run too. A lock keeps the main thread
+ * from changing the index meanwhile.</p>
+ */
+class SearchIndex {
+	public:
+	SearchIndex ();
+
+	/**
+	 * Makes the next search look for documents that are new to the index,
+	 * for when documents are added which may be older than the last search.
+	 */
+	void invalidate () {seen_ = 0; ++invalidations_;}
+	void remove (guint32 slot);
+	void clear ();
+
+	/**
+	 * @return the documents in <c>docs</c> in which every term of
+	 * <c>text</c> turns up, in slot order.
+	 */
+	std::vector<Document*> search (DocumentSlab &docs, Glib::ustring const &text);
+	/**
+	 * Like \ref search(), for when only the documents in <c>within</c>
+	 * can match, as they are what a search which <c>text</c> refines
+	 * found. While there are few of them it looks through their own text
+	 * rather than the whole vocabulary.
+	 *
+	 * @return the documents of <c>within</c> which match, in its order.
+	 */
+	std::vector<Document*> search (
+		DocumentSlab &docs,
+		Glib::ustring const &text,
+		std::vector<Document*> const &within);
+
+	/**
+	 * Brings the index up to date with the documents in <c>docs</c>.
+	 */
+	void refresh (DocumentSlab &docs);
+
+	/**
+	 * The documents of a slab which the index is behind on, and their
+	 * text as it was when they were collected.
+	 */
+	class Changes {
+		public:
+		Changes () : revision (0), invalidations (0), removals (0) {}
+
+		private:
+		friend class SearchIndex;
+		struct Change {
+			guint32 slot;
+			guint32 generation;
+			Document *doc;
+			guint64 revision;
+			/* Where its text is in text */
+			size_t text;
+			size_t length;
+		};
+		std::vector<Change> docs;
+		/* Each value as stored, NUL after each */
+		std::string text;
+		/* ChangeStamp::current() when they were collected */
+		guint64 revision;
+		guint32 invalidations;
+		guint64 removals;
+	};
+	/**
+	 * On the main thread, takes what \ref refresh() would index, without
+	 * the costly part of indexing it.
+	 *
+	 * @return false if nothing has changed since the index last caught up.
+	 */
+	bool collect (DocumentSlab &docs, Changes &changes);
+	/**
+	 * Indexes what was collected, on any thread. Documents removed from
+	 * the index since are left out. Gives up part way once
+	 * <c>cancelled</c> is set.
+	 *
+	 * @return false if it gave up.
+	 */
+	bool apply (Changes const &changes, gint const *cancelled = NULL);
+	/**
+	 * On the main thread, once <c>changes</c> have been applied in full,
+	 * so that the next refresh only looks for what changed since.
+	 */
+	void caughtUp (Changes const &changes);
+	/**
+	 * The matches for search terms, as split by \ref splitTerms(), from
+	 * the index as it was last brought up to date, and only among the
+	 * documents <c>within</c> names unless it is NULL. Gives up and returns
+	 * nothing once <c>cancelled</c> is set, so it can run on a worker
+	 * thread: it never looks at the documents themselves, which the main
+	 * thread may be removing, and handles to ones which are gone simply
+	 * don't match.
+	 */
+	std::vector<Document*> find (
+		std::vector<std::string> const &terms,
+		std::vector<DocumentHandle> const *within,
+		gint const *cancelled = NULL);
+
+	/**
+	 * Whether everything that matches <c>terms</c> also matches
+	 * <c>previous</c>: each previous term is part of one of the new ones,
+	 * as when more of a search is typed, or another term is added.
+	 */
+	static bool refines (
+		std::vector<std::string> const &terms,
+		std::vector<std::string> const &previous);
+
+	/**
+	 * Whether one document, which must be in <c>docs</c>, matches search
+	 * box text. Only that document is brought up to date.
+	 */
+	bool matches (DocumentSlab &docs, Document *doc, Glib::ustring const &text);
+
+	/**
+	 * Splits search box text into casefolded terms at whitespace.
+	 */
+	static std::vector<std::string> splitTerms (Glib::ustring const &text);
+
+	private:
+	struct Token {
+		/* Where the token is in vocabulary_ */
+		size_t offset;
+		size_t length;
+		/* Slots of the documents with the token, in order */
+		std::vector<guint32> postings;
+	};
+	struct Entry {
+		Entry () : doc (NULL), generation (0), revision (0), text (0), length (0) {}
+
+		/* NULL if the slot isn't indexed */
+		Document *doc;
+		/* Of the slot when the document was indexed */
+		guint32 generation;
+		guint64 revision;
+		std::vector<guint32> tokens;
+		/* Where the document's text is in texts_ */
+		size_t text;
+		size_t length;
+	};
+
+	void add (
+		DocumentHandle const &handle,
+		Document *doc,
+		guint64 revision,
+		char const *text,
+		size_t textLength);
+	void drop (guint32 slot);
+	guint32 intern (std::string const &text);
+	void releaseToken (guint32 id);
+	void compact ();
+	std::vector<Document*> match (std::vector<std::string> terms, gint const *cancelled);
+	bool matches (Entry const &entry, std::vector<std::string> const &terms) const;
+	guint32 update (DocumentSlab &docs, Document &doc);
+	bool isBehind (DocumentHandle const &handle, Document const &doc) const;
+
+	std::vector<Token> tokens_;
+	std::unordered_map<std::string, guint32> ids_;
+	/* Tokens no document has any more, for reuse */
+	std::vector<guint32> freeTokens_;
+	/*
+	 * Every token, NUL terminated, and which token starts where, in order.
+	 * Tokens which are let go are overwritten with NULs, so that nothing
+	 * matches them, until the arena is compacted.
+	 */
+	std::string vocabulary_;
+	std::vector<std::pair<size_t, guint32> > starts_;
+	size_t deadVocabulary_;
+	/* The documents' text, with the space left behind by old versions */
+	std::string texts_;
+	size_t deadTexts_;
+	/* By slot */
+	std::vector<Entry> entries_;
+	size_t indexed_;
+	/* Counts removals, and by slot, the count when it was last removed */
+	guint64 removals_;
+	std::vector<guint64> removedAt_;
+	/* The count of removals when the index was cleared */
+	guint64 cleared_;
+	Glib::Threads::Mutex mutex_;
+
+	/* Only used on the main thread */
+	/* ChangeStamp::current() when the index last caught up */
+	guint64 seen_;
+	/* Counts invalidate() */
+	guint32 invalidations_;
+
+	SearchIndex (SearchIndex const &);
+	SearchIndex &operator= (SearchIndex const &);
+};
+
+#endif
@@ -0,0 +1,286 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <glibmm/threads.h>
+
+#include "Utility.h"
+
+#include "StringPool.h"
+
+
+namespace {
+
+/*
+ * A pooled string. Entries are never freed or changed, but for the link
+ * to the entry of their casefold, which is set once, and whether they
+ * have been interned as a value, which is too.
+ */
+struct Entry {
+	Entry (Glib::ustring const &str_, size_t hash_)
+		: str (str_), hash (hash_), fold (NULL), value (false) {}
+
+	Glib::ustring const str;
+	size_t const hash;
+	mutable std::atomic<Entry const*> fold;
+	/* Otherwise it is only held for lookups, as a casefold or a spelling */
+	mutable std::atomic<bool> value;
+};
+
+/*
+ * The pool's strings, in an open addressed hash table which is never more
+ * than half full. Lookups read it without taking the lock: slots are only
+ * ever filled in, and a table which has grown too small is replaced by a
+ * bigger copy rather than changed, and kept, as lookups may still be
+ * reading it. A lookup which races with the string being added misses it,
+ * as it would have done a moment earlier.
+ */
+struct Table {
+	Table (size_t capacity) : mask (capacity - 1), slots (capacity)
+	{
+		for (size_t i = 0; i < capacity; ++i)
+			slots[i].store (NULL, std::memory_order_relaxed);
+	}
+
+	size_t const mask;
+	std::vector<std::atomic<Entry const*> > slots;
+};
+
+/* Never destroyed, so that interned strings outlive every static document */
+Glib::Threads::Mutex &poolMutex ()
+{
+	static Glib::Threads::Mutex *mutex = new Glib::Threads::Mutex ();
+	return *mutex;
+}
+
+std::atomic<Table*> &poolTable ()
+{
+	static std::atomic<Table*> *table = new std::atomic<Table*> (new Table (1024));
+	return *table;
+}
+
+/* Locked by poolMutex (): the entries which are values, and the others */
+size_t poolStrings = 0;
+size_t poolBytes = 0;
+size_t poolFolds = 0;
+size_t poolFoldBytes = 0;
+std::atomic<size_t> poolInterned (0);
+
+
+/* Keyed on the raw bytes: ustring's own comparison collates */
+size_t hashString (Glib::ustring const &str)
+{
+	return std::hash<std::string> () (str.raw ());
+}
+
+
+/* Needs no lock */
+Entry const *lookup (Glib::ustring const &str, size_t const hash)
+{
+	Table const *table = poolTable ().load (std::memory_order_acquire);
+	for (size_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+		Entry const *entry = table->slots[i].load (std::memory_order_acquire);
+		if (!entry)
+			return NULL;
+		if (entry->hash == hash && entry->str.raw () == str.raw ())
+			return entry;
+	}
+}
+
+
+/* Call with the pool locked */
+void place (Table &table, Entry const *entry)
+{
+	size_t i = entry->hash & table.mask;
+	while (table.slots[i].load (std::memory_order_relaxed))
+		i = (i + 1) & table.mask;
+	table.slots[i].store (entry, std::memory_order_release);
+}
+
+
+/*
+ * Call with the pool locked. A value is counted as one even if it was
+ * pooled before only for lookups.
+ */
+Entry const *internLocked (Glib::ustring const &str, bool const value)
+{
+	size_t const hash = hashString (str);
+	Entry const *entry = lookup (str, hash);
+	if (entry) {
+		if (value && !entry->value.load (std::memory_order_relaxed)) {
+			entry->value.store (true, std::memory_order_release);
+			--poolFolds;
+			poolFoldBytes -= str.bytes ();
+			++poolStrings;
+			poolBytes += str.bytes ();
+		}
+		return entry;
+	}
+
+	Table *table = poolTable ().load (std::memory_order_relaxed);
+	if ((poolStrings + poolFolds + 1) * 2 > table->slots.size ()) {
+		// The old table is left as it is for whoever is still reading it
+		Table *grown = new Table (table->slots.size () * 2);
+		for (size_t i = 0; i < table->slots.size (); ++i) {
+			Entry const *old = table->slots[i].load (std::memory_order_relaxed);
+			if (old)
+				place (*grown, old);
+		}
+		poolTable ().store (grown, std::memory_order_release);
+		table = grown;
+	}
+
+	Entry *added = new Entry (str, hash);
+	if (value) {
+		added->value.store (true, std::memory_order_relaxed);
+		++poolStrings;
+		poolBytes += str.bytes ();
+	} else {
+		++poolFolds;
+		poolFoldBytes += str.bytes ();
+	}
+	place (*table, added);
+	return added;
+}
+
+
+/* Needs no lock once the string is pooled as a value */
+Entry const *intern (Glib::ustring const &str)
+{
+	Entry const *entry = lookup (str, hashString (str));
+	if (entry && entry->value.load (std::memory_order_acquire))
+		return entry;
+
+	Glib::Threads::Mutex::Lock lock (poolMutex ());
+	return internLocked (str, true);
+}
+
+
+/* The entry of the casefold of a pooled string, worked out once */
+Entry const *fold (Entry const *entry)
+{
+	Entry const *fold = entry->fold.load (std::memory_order_acquire);
+	if (fold)
+		return fold;
+
+	// Folded outside the lock, it being the slow part
+	Glib::ustring const casefold = entry->str.casefold ();
+
+	Glib::Threads::Mutex::Lock lock (poolMutex ());
+	fold = internLocked (casefold, false);
+	// Links are only ever set under the lock, and always to the same fold
+	entry->fold.store (fold, std::memory_order_release);
+	// A casefold folds to itself
+	fold->fold.store (fold, std::memory_order_release);
+	return fold;
+}
+
+}
+
+
+Glib::ustring const *StringPool::empty ()
+{
+	static Glib::ustring const *str = new Glib::ustring ();
+	return str;
+}
+
+
+Glib::ustring const *StringPool::intern (Glib::ustring const &str)
+{
+	if (str.empty ())
+		return empty ();
+
+	++poolInterned;
+	return &::intern (str)->str;
+}
+
+
+Glib::ustring const *StringPool::intern (char const *str)
+{
+	if (!str || !*str)
+		return empty ();
+
+	return intern (Glib::ustring (str));
+}
+
+
+Glib::ustring const *StringPool::find (Glib::ustring const &str)
+{
+	if (str.empty ())
+		return empty ();
+
+	Entry const *entry = lookup (str, hashString (str));
+	return entry ? &entry->str : NULL;
+}
+
+
+Glib::ustring const *StringPool::folded (Glib::ustring const *interned)
+{
+	if (interned->empty ())
+		return empty ();
+
+	return &fold (::intern (*interned))->str;
+}
+
+
+Glib::ustring const *StringPool::findFolded (Glib::ustring const &str)
+{
+	if (str.empty ())
+		return empty ();
+
+	Entry const *entry = lookup (str, hashString (str));
+	Entry const *fold = entry ? entry->fold.load (std::memory_order_acquire) : NULL;
+	if (fold)
+		return &fold->str;
+
+	// A spelling not seen before may still fold like one which has been
+	Glib::ustring const casefold = str.casefold ();
+	fold = lookup (casefold, hashString (casefold));
+	if (!fold || fold->fold.load (std::memory_order_acquire) != fold)
+		return NULL;
+
+	// Remember the spelling, so that the next lookup of it needn't casefold
+	Glib::Threads::Mutex::Lock lock (poolMutex ());
+	entry = internLocked (str, false);
+	entry->fold.store (fold, std::memory_order_release);
+	return &fold->str;
+}
+
+
+StringPool::Stats StringPool::getStats ()
+{
+	Glib::Threads::Mutex::Lock lock (poolMutex ());
+	Stats stats;
+	stats.strings = poolStrings;
+	stats.bytes = poolBytes;
+	stats.folds = poolFolds;
+	stats.foldBytes = poolFoldBytes;
+	stats.interned = poolInterned.load ();
+	return stats;
+}
+
+
+void StringPool::logStats ()
+{
+	Stats const stats = getStats ();
+	// Each value interned again would otherwise have been a copy of its own
+	size_t const average = stats.strings ? stats.bytes / stats.strings : 0;
+	size_t const repeats = stats.interned > stats.strings ? stats.interned - stats.strings : 0;
+	DEBUG ("String pool: %1 strings, %2 bytes, interned %3 times, ~%4 bytes saved",
+		stats.strings, stats.bytes, stats.interned,
+		repeats * (average + sizeof (Glib::ustring)));
+	DEBUG ("String pool: %1 casefolds and spellings for lookups, %2 bytes",
+		stats.folds, stats.foldBytes);
+}
@@ -0,0 +1,104 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#ifndef STRINGPOOL_H
+#define STRINGPOOL_H
+
+#include <cstddef>
+
+#include <glibmm/ustring.h>
+
+/**
+ * <p>One shared copy of each distinct string that is interned, for values
+ * which repeat across a whole library: document types, journals, years
+ * and the keys of extra fields.</p>
+ *
+ * <p>Interned strings live for the rest of the session, even after the
+ * library they came from is closed, so the pool is only meant for values
+ * with few distinct instances. Author lists, which are nearly as varied as
+ * titles, are not pooled.</p>
+ *
+ * <p>It may be used from any thread. Looking up strings which are already
+ * pooled, and their casefolds once worked out, takes no lock, so that
+ * lookups don't wait on a library being loaded on other threads.</p>
+ */
+class StringPool {
+	public:
+	struct Stats {
+		/* Distinct strings interned */
+		size_t strings;
+		/* Bytes of text in them */
+		size_t bytes;
+		/* Other strings held, only for lookups: casefolds and spellings */
+		size_t folds;
+		size_t foldBytes;
+		/* Times a string was interned */
+		size_t interned;
+	};
+
+	/**
+	 * @return the pooled copy of <c>str</c>, which stays valid for good.
+	 */
+	static Glib::ustring const *intern (Glib::ustring const &str);
+	static Glib::ustring const *intern (char const *str);
+	static Glib::ustring const *empty ();
+	/**
+	 * @return the pooled copy of <c>str</c>, or NULL if it has never been
+	 * interned. Doesn't add anything to the pool.
+	 */
+	static Glib::ustring const *find (Glib::ustring const &str);
+
+	/**
+	 * @return the pooled casefold of a pooled string. It is only worked
+	 * out the first time, so strings which fold alike can be told apart
+	 * by comparing pointers.
+	 */
+	static Glib::ustring const *folded (Glib::ustring const *interned);
+	/**
+	 * @return what \ref folded() would give for <c>str</c>, or NULL if no
+	 * string which folds like it has been folded yet. Takes no lock and
+	 * doesn't allocate when <c>str</c> itself has been looked up or folded
+	 * before. Otherwise it is casefolded, and pooled if something folds
+	 * like it, so that it needn't be casefolded again.
+	 */
+	static Glib::ustring const *findFolded (Glib::ustring const &str);
+
+	static Stats getStats ();
+	/**
+	 * Writes how much the pool holds, and roughly how much it saves, to
+	 * the debug log.
+	 */
+	static void logStats ();
+};
+
+/**
+ * A string held in the \ref StringPool. Copying one copies a pointer, and
+ * two are equal exactly when they are the same pooled string.
+ */
+class InternedString {
+	public:
+	InternedString () : str_ (StringPool::empty ()) {}
+	InternedString (Glib::ustring const &str) : str_ (StringPool::intern (str)) {}
+	InternedString (char const *str) : str_ (StringPool::intern (str)) {}
+
+	operator Glib::ustring const & () const {return *str_;}
+	Glib::ustring const &str () const {return *str_;}
+	char const *c_str () const {return str_->c_str ();}
+	bool empty () const {return str_->empty ();}
+
+	bool operator== (InternedString const &other) const {return str_ == other.str_;}
+	bool operator!= (InternedString const &other) const {return str_ != other.str_;}
+
+	private:
+	Glib::ustring const *str_;
+};
+
+#endif
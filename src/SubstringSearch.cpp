@@ -0,0 +1,104 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+#include <cstring>
+
+#if defined (__AVX2__)
+#include <immintrin.h>
+#elif defined (__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "SubstringSearch.h"
+
+
+/*
+ * Checks the candidate starts flagged in mask, lowest first. The first and
+ * last bytes are known to match already.
+ */
+static inline char const *checkCandidates (
+	unsigned mask,
+	char const *start,
+	char const *needle,
+	size_t const needleLength)
+{
+	while (mask) {
+		unsigned const bit = __builtin_ctz (mask);
+		if (memcmp (start + bit + 1, needle + 1, needleLength - 2) == 0)
+			return start + bit;
+		mask &= mask - 1;
+	}
+	return NULL;
+}
+
+
+char const *findSubstring (
+	char const *haystack,
+	size_t const length,
+	char const *needle,
+	size_t const needleLength)
+{
+	if (needleLength == 0)
+		return haystack;
+	if (needleLength > length)
+		return NULL;
+	if (needleLength == 1)
+		return static_cast<char const *> (memchr (haystack, needle[0], length));
+
+	char const last = needle[needleLength - 1];
+	// Where a match could start
+	size_t const starts = length - needleLength + 1;
+	size_t i = 0;
+
+#if defined (__AVX2__)
+	__m256i const first32 = _mm256_set1_epi8 (needle[0]);
+	__m256i const last32 = _mm256_set1_epi8 (last);
+	for (; i + 32 <= starts; i += 32) {
+		__m256i const heads = _mm256_loadu_si256 (
+			reinterpret_cast<__m256i const *> (haystack + i));
+		__m256i const tails = _mm256_loadu_si256 (
+			reinterpret_cast<__m256i const *> (haystack + i + needleLength - 1));
+		unsigned const mask = _mm256_movemask_epi8 (_mm256_and_si256 (
+			_mm256_cmpeq_epi8 (heads, first32), _mm256_cmpeq_epi8 (tails, last32)));
+		char const *match = checkCandidates (mask, haystack + i, needle, needleLength);
+		if (match)
+			return match;
+	}
+#endif
+
+#if defined (__SSE2__)
+	__m128i const first16 = _mm_set1_epi8 (needle[0]);
+	__m128i const last16 = _mm_set1_epi8 (last);
+	for (; i + 16 <= starts; i += 16) {
+		__m128i const heads = _mm_loadu_si128 (
+			reinterpret_cast<__m128i const *> (haystack + i));
+		__m128i const tails = _mm_loadu_si128 (
+			reinterpret_cast<__m128i const *> (haystack + i + needleLength - 1));
+		unsigned const mask = _mm_movemask_epi8 (_mm_and_si128 (
+			_mm_cmpeq_epi8 (heads, first16), _mm_cmpeq_epi8 (tails, last16)));
+		char const *match = checkCandidates (mask, haystack + i, needle, needleLength);
+		if (match)
+			return match;
+	}
+#endif
+
+	while (i < starts) {
+		char const *const head = static_cast<char const *> (
+			memchr (haystack + i, needle[0], starts - i));
+		if (!head)
+			return NULL;
+		if (head[needleLength - 1] == last
+		    && memcmp (head + 1, needle + 1, needleLength - 2) == 0)
+			return head;
+		i = head - haystack + 1;
+	}
+
+	return NULL;
+}
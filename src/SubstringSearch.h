@@ -0,0 +1,32 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#ifndef SUBSTRINGSEARCH_H
+#define SUBSTRINGSEARCH_H
+
+#include <cstddef>
+
+/**
+ * Finds the first occurrence of a needle in a haystack of bytes, which may
+ * hold NULs. It looks for the needle's first and last bytes a vector at a
+ * time (AVX2 or SSE2, whichever the build targets) and only compares the
+ * rest where both turn up, with a scalar loop for other targets and for
+ * what is left over.
+ *
+ * @return the start of the match, or NULL if there is none.
+ */
+char const *findSubstring (
+	char const *haystack,
+	size_t length,
+	char const *needle,
+	size_t needleLength);
+
+#endif
@@ -127,7 +127,11 @@ void ThumbnailGenerator::_setDocumentThumbnail(Glib::RefPtr<Gdk::Pixbuf>& result
 
 void ThumbnailGenerator::_taskDone ()
 {
-	taskList_.erase (currentFile_);
+	const std::pair<TaskList::iterator, TaskList::iterator> docs =
+		taskList_.equal_range (currentFile_);
+	for (TaskList::iterator i = docs.first; i != docs.second; ++i)
+		requests_.erase (i->second);
+	taskList_.erase (docs.first, docs.second);
 	currentFile_ = "";
 	this->run();
 }
@@ -212,19 +216,31 @@ Glib::RefPtr<Gdk::Pixbuf> ThumbnailGenerator::lookupThumb (Glib::ustring const &
 
 void ThumbnailGenerator::registerRequest (Glib::ustring const &file, Document *doc)
 {
-	taskList_.insert (std::pair<Glib::ustring, Document*>(file,doc));
+	/* A document only ever waits for the thumbnail of its current file */
+	deregisterRequest (doc);
+	requests_[doc] = taskList_.insert (std::pair<Glib::ustring, Document*>(file,doc));
 }
 
 void ThumbnailGenerator::deregisterRequest (Document *doc)
 {
-	/* Erase exactly one entry which has its second field equal to doc */
-	typedef std::multimap<Glib::ustring, Document*>::iterator Iterator;
-	for (Iterator i = taskList_.begin(); i!= taskList_.end(); ++i) {
-		if (i->second == doc) {
-			taskList_.erase (i);
-			return;
-		}
-	}
+	std::map<Document *, TaskList::iterator>::iterator it = requests_.find (doc);
+	if (it == requests_.end ())
+		return;
+
+	taskList_.erase (it->second);
+	requests_.erase (it);
+}
+
+void ThumbnailGenerator::moveRequest (Document *from, Document *to)
+{
+	std::map<Document *, TaskList::iterator>::iterator it = requests_.find (from);
+	if (it == requests_.end ())
+		return;
+
+	TaskList::iterator const task = it->second;
+	task->second = to;
+	requests_.erase (it);
+	requests_[to] = task;
 }
 
 
@@ -11,7 +11,10 @@ class Document;
 
 class ThumbnailGenerator
 {
-	std::multimap<Glib::ustring, Document *> taskList_;
+	typedef std::multimap<Glib::ustring, Document *> TaskList;
+	TaskList taskList_;
+	/* Each document's pending request, so deregistering is not a scan */
+	std::map<Document *, TaskList::iterator> requests_;
 	Glib::ustring currentFile_;
 	Glib::RefPtr<Gio::File> currentUri_;
 	Glib::RefPtr<Gio::File> thumbnail_file_;
@@ -32,6 +35,8 @@ class ThumbnailGenerator
 	public:
 	void registerRequest (Glib::ustring const &file, Document *doc);
 	void deregisterRequest (Document *doc);
+	/* Hands a pending request over to a document moved elsewhere */
+	void moveRequest (Document *from, Document *to);
 	Glib::RefPtr<Gdk::Pixbuf> getThumbnailSynchronous (Glib::ustring const &file);
 
 	static ThumbnailGenerator &instance ();
@@ -342,36 +342,47 @@ std::vector<Glib::ustring> recurseFolder (
 
 void writeBibKey (
 	std::ostringstream &out,
-	Glib::ustring key,
+	Glib::ustring const &key,
 	Glib::ustring const & value,
 	bool const usebraces,
 	bool const utf8)
 {
-	if (!key.validate()) {
+	writeBibKey (out, key.c_str (), value.c_str (), usebraces, utf8);
+}
+
+
+/*
+ * Text goes out as the UTF-8 it is stored as, so that fields can be
+ * written straight from where they are kept
+ */
+void writeBibKey (
+	std::ostringstream &out,
+	char const *key,
+	char const *value,
+	bool const usebraces,
+	bool const utf8)
+{
+	if (!g_utf8_validate (key, -1, NULL)) {
 		DEBUG ("Bad unicode");
 		return;
 	}
 
-	if (!value.validate ()) {
+	if (!g_utf8_validate (value, -1, NULL)) {
 		DEBUG ("Bad unicode for key %1", key);
 		return;
 	}
 
-	if (!value.empty ()) {
+	if (*value) {
+		/* Exception to rule for braces for pages, since 
+		 * {{100--200}} causes problems for some reason */
+		bool const braces = usebraces && g_ascii_strcasecmp (key, "pages") != 0;
 		// Okay to always append comma, since bibtex doesn't mind the trailing one
-		if (utf8) {
-			/* Exception to rule for braces for pages, since 
-			 * {{100--200}} causes problems for some reason */
-			if (usebraces && key.lowercase() != "pages")
-				out << "\t" << key << " = {{" << value << "}},\n";
-			else
-				out << "\t" << key << " = {" << value << "},\n";
-		} else {
-			if (usebraces && key.lowercase() != "pages")
-				out << "\t" << key << " = {{" << escapeBibtexAccents (value) << "}},\n";
-			else
-				out << "\t" << key << " = {" << escapeBibtexAccents (value) << "},\n";
-		}
+		out << "\t" << key << (braces ? " = {{" : " = {");
+		if (utf8)
+			out << value;
+		else
+			out << escapeBibtexAccents (value);
+		out << (braces ? "}},\n" : "},\n");
 	}
 }
 
@@ -142,11 +142,18 @@ namespace Utility {
 
 	void writeBibKey (
 		std::ostringstream &out,
-		Glib::ustring key,
+		Glib::ustring const &key,
 		Glib::ustring const & value,
 		bool const usebraces,
 		bool const utf8);
 
+	void writeBibKey (
+		std::ostringstream &out,
+		char const *key,
+		char const *value,
+		bool const usebraces,
+		bool const utf8);
+
 	std::string escapeBibtexAccents (
 		Glib::ustring target);
 
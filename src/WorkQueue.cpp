@@ -0,0 +1,113 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#include <glib.h>
+
+#include "Utility.h"
+
+#include "WorkQueue.h"
+
+
+WorkQueue::WorkQueue (unsigned int const threads)
+{
+	pending_ = 0;
+	failed_ = false;
+	quit_ = false;
+
+	for (unsigned int i = 0; i < threads; ++i) {
+		threads_.push_back (Glib::Threads::Thread::create (
+			sigc::mem_fun (*this, &WorkQueue::run)));
+	}
+}
+
+
+WorkQueue::~WorkQueue ()
+{
+	{
+		Glib::Threads::Mutex::Lock lock (mutex_);
+		quit_ = true;
+		jobAvailable_.broadcast ();
+	}
+
+	std::vector<Glib::Threads::Thread*>::iterator it = threads_.begin ();
+	std::vector<Glib::Threads::Thread*>::iterator const end = threads_.end ();
+	for (; it != end; ++it)
+		(*it)->join ();
+}
+
+
+unsigned int WorkQueue::defaultThreadCount ()
+{
+	unsigned int const processors = g_get_num_processors ();
+	return processors > 1 ? processors : 1;
+}
+
+
+void WorkQueue::push (sigc::slot<void> const &job)
+{
+	if (threads_.empty ()) {
+		runJob (job);
+		return;
+	}
+
+	Glib::Threads::Mutex::Lock lock (mutex_);
+	jobs_.push_back (job);
+	++pending_;
+	jobAvailable_.signal ();
+}
+
+
+bool WorkQueue::wait ()
+{
+	Glib::Threads::Mutex::Lock lock (mutex_);
+	while (pending_ > 0)
+		jobsDone_.wait (mutex_);
+
+	bool const failed = failed_;
+	failed_ = false;
+	return !failed;
+}
+
+
+void WorkQueue::runJob (sigc::slot<void> const &job)
+{
+	try {
+		job ();
+	} catch (...) {
+		DEBUG ("Warning: WorkQueue: job threw an exception");
+		Glib::Threads::Mutex::Lock lock (mutex_);
+		failed_ = true;
+	}
+}
+
+
+void WorkQueue::run ()
+{
+	Glib::Threads::Mutex::Lock lock (mutex_);
+	for (;;) {
+		while (jobs_.empty () && !quit_)
+			jobAvailable_.wait (mutex_);
+
+		// Only quit once the queue has been drained
+		if (jobs_.empty ())
+			return;
+
+		sigc::slot<void> job = jobs_.front ();
+		jobs_.pop_front ();
+
+		lock.release ();
+		runJob (job);
+		lock.acquire ();
+
+		if (--pending_ == 0)
+			jobsDone_.broadcast ();
+	}
+}
@@ -0,0 +1,72 @@
+/*
+ * Referencer is released under the GNU General Public License v2
+ * See the COPYING file for licensing details.
+ *
+ * Copyright 2007 John Spray
+ * (Exceptions listed in README)
+ *
+ */
+
+
+
+#ifndef WORKQUEUE_H
+#define WORKQUEUE_H
+
+#include <deque>
+#include <vector>
+
+#include <glibmm/threads.h>
+#include <sigc++/sigc++.h>
+
+/**
+ * <p>A small pool of worker threads which run queued jobs in the order they
+ * were pushed.</p>
+ *
+ * <p>Jobs must not touch GTK or anything else that belongs to the main loop.
+ * Exceptions escaping a job are swallowed, so jobs should catch and record
+ * their own errors for the caller to inspect after \ref wait().</p>
+ */
+class WorkQueue {
+	public:
+	/**
+	 * Starts <c>threads</c> worker threads. With no threads at all, jobs run
+	 * synchronously inside \ref push().
+	 */
+	WorkQueue (unsigned int const threads);
+	/**
+	 * Finishes all queued jobs and joins the worker threads.
+	 */
+	~WorkQueue ();
+
+	void push (sigc::slot<void> const &job);
+	/**
+	 * Blocks until every job pushed so far has finished.
+	 *
+	 * @return false if an exception escaped any job which finished since
+	 * the last wait.
+	 */
+	bool wait ();
+
+	unsigned int getThreadCount () const {return threads_.size ();}
+
+	/**
+	 * One thread per processor, and at least one, so that queued jobs never
+	 * run on the thread which pushes them.
+	 */
+	static unsigned int defaultThreadCount ();
+
+	private:
+	void run ();
+	void runJob (sigc::slot<void> const &job);
+
+	std::deque<sigc::slot<void> > jobs_;
+	std::vector<Glib::Threads::Thread*> threads_;
+	Glib::Threads::Mutex mutex_;
+	Glib::Threads::Cond jobAvailable_;
+	Glib::Threads::Cond jobsDone_;
+	unsigned int pending_;
+	bool failed_;
+	bool quit_;
+};
+
+#endif